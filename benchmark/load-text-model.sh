@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Compare the parallel text model parser with the fscanf() loader.
+#
+# Usage: benchmark/load-text-model.sh MODEL_TXT [N_RUNS] [THREADS]
+#
+# MODEL_TXT is a model saved by word2vec with -binary 0 (or word2vec_train
+# --binary 0). The elapsed time reported by Groonga for word2vec_load is
+# printed for each run.
+
+if test $# -lt 1; then
+    echo "Usage: $0 MODEL_TXT [N_RUNS] [THREADS]" 1>&2
+    exit 1
+fi
+
+model="$1"
+n_runs="${2:-3}"
+threads="${3:-}"
+
+base_dir="`dirname $0`"
+top_dir=$(cd -P "$base_dir/.." 2>/dev/null || cd "$base_dir/.."; pwd)
+
+if test -z "$GROONGA"; then
+    GROONGA="`make -s -C $top_dir word2vec-groonga`"
+fi
+GRN_PLUGINS_DIR="$top_dir"
+export GRN_PLUGINS_DIR
+
+db_dir=$(mktemp -d)
+trap "rm -rf $db_dir" EXIT
+db="$db_dir/db"
+"$GROONGA" -n "$db" plugin_register word2vec/word2vec > /dev/null || exit 1
+
+load_command="word2vec_load --file_path $model --binary 0"
+if test -n "$threads"; then
+    load_command="$load_command --threads $threads"
+fi
+
+elapsed() {
+    "$GROONGA" "$db" $load_command | sed -e 's/^\[\[[^,]*,[^,]*,\([^]]*\)\].*$/\1/'
+}
+
+for loader in fscanf parallel; do
+    for i in $(seq 1 $n_runs); do
+	if test "$loader" = "fscanf"; then
+	    seconds=$(GRN_WORD2VEC_TEXT_LOADER=fscanf elapsed)
+	else
+	    seconds=$(GRN_WORD2VEC_TEXT_LOADER= elapsed)
+	fi
+	echo "$loader	$i	$seconds"
+    done
+done
@@ -0,0 +1,250 @@
+/*
+  Copyright(C) 2014-2015 Naoya Murakami <naoya@createfield.com>
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Library General Public
+  License as published by the Free Software Foundation; version 2
+  of the License.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+  Library General Public License for more details.
+
+  You should have received a copy of the GNU Library General Public
+  License along with this library; if not, write to the Free
+  Software Foundation, Inc., 51 Franklin St, Fifth Floor, Boston,
+  MA 02110-1301, USA
+*/
+
+/*
+  Native model format shared by the plugin (word2vec_convert,
+  word2vec_load) and the vendored word2vec binary. Plain C so that both
+  can include it.
+*/
+
+#ifndef GROONGA_WORD2VEC_MODEL_FORMAT_H
+#define GROONGA_WORD2VEC_MODEL_FORMAT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#define NATIVE_MODEL_MAGIC "GRNW2VN"
+#define NATIVE_MODEL_MAGIC_LEN 8
+#define NATIVE_MODEL_VERSION 1
+#define NATIVE_MODEL_ALIGNMENT 4096
+#define NATIVE_MODEL_FLAG_INT8 0x1
+#define NATIVE_MODEL_FLAG_PQ 0x2
+#define NATIVE_MODEL_FLAG_FP16 0x4
+#define NATIVE_MODEL_FLAG_BF16 0x8
+/* rows are sorted by key instead of by word frequency */
+#define NATIVE_MODEL_FLAG_KEY_ORDER 0x10
+/* the precision flags are mutually exclusive */
+#define NATIVE_MODEL_PRECISION_FLAGS \
+  (NATIVE_MODEL_FLAG_INT8|NATIVE_MODEL_FLAG_PQ|NATIVE_MODEL_FLAG_FP16|NATIVE_MODEL_FLAG_BF16)
+#define NATIVE_MODEL_FLAGS \
+  (NATIVE_MODEL_PRECISION_FLAGS|NATIVE_MODEL_FLAG_KEY_ORDER)
+
+#define PQ_N_CENTROIDS 256
+
+/*
+  Native model file layout (host byte order):
+
+    native_model_header
+    padding up to matrix_offset (NATIVE_MODEL_ALIGNMENT)
+    float matrix[n_words][dim_size]      L2-normalized rows
+                                         with NATIVE_MODEL_FLAG_FP16 or _BF16:
+                                         uint16_t matrix[n_words][dim_size]
+                                         with NATIVE_MODEL_FLAG_INT8:
+                                         int8_t matrix[n_words][dim_size]
+                                         float scales[n_words] (8-aligned)
+                                         with NATIVE_MODEL_FLAG_PQ:
+                                         float codebook[pq_subspaces][PQ_N_CENTROIDS]
+                                                       [dim_size / pq_subspaces]
+                                         uint8_t codes[n_words][pq_subspaces]
+    uint64_t key_offsets[n_words + 1]    at vocab_offset
+    char keys[]                          key of row i is
+                                         keys[key_offsets[i]..key_offsets[i + 1]]
+*/
+typedef struct {
+  char magic[NATIVE_MODEL_MAGIC_LEN];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t n_words;
+  uint64_t dim_size;
+  uint64_t matrix_offset;
+  uint64_t vocab_offset;
+  uint64_t vocab_size;
+  uint64_t pq_subspaces;                 /* 0 without NATIVE_MODEL_FLAG_PQ */
+} native_model_header;
+
+typedef union {
+  uint32_t u;
+  float f;
+} float_bits;
+
+/* round to nearest even; values are from normalized rows so |value| <= 1 */
+static inline uint16_t
+float_to_half(float value)
+{
+  float_bits v;
+  uint32_t sign;
+  uint16_t half;
+
+  v.f = value;
+  sign = v.u & 0x80000000;
+  v.u ^= sign;
+  if (v.u >= 0x47800000) {
+    half = (v.u > 0x7f800000) ? 0x7e00 : 0x7c00;
+  } else if (v.u < 0x38800000) {
+    /* subnormal or zero: let the FPU round the mantissa */
+    v.f += 0.5f;
+    half = (uint16_t)(v.u - 0x3f000000);
+  } else {
+    uint32_t mantissa_odd = (v.u >> 13) & 1;
+    v.u += 0xc8000fff + mantissa_odd;
+    half = (uint16_t)(v.u >> 13);
+  }
+  return half | (uint16_t)(sign >> 16);
+}
+
+static inline float
+half_to_float(uint16_t half)
+{
+  float_bits v;
+  /* rebias the exponent by multiplying by 2^112; handles subnormals too */
+  v.u = (uint32_t)(half & 0x7fff) << 13;
+  v.f *= 5.192296858534828e+33f;
+  v.u |= (uint32_t)(half & 0x8000) << 16;
+  return v.f;
+}
+
+static inline uint16_t
+float_to_bf16(float value)
+{
+  float_bits v;
+  v.f = value;
+  return (uint16_t)((v.u + 0x7fff + ((v.u >> 16) & 1)) >> 16);
+}
+
+static inline float
+bf16_to_float(uint16_t bf16)
+{
+  float_bits v;
+  v.u = (uint32_t)bf16 << 16;
+  return v.f;
+}
+
+/* symmetric quantization: row[a] ~= quantized[a] * scale */
+static inline float
+quantize_row(const float *row, long long size, int8_t *quantized)
+{
+  long long a;
+  float max_abs = 0, scale;
+
+  for (a = 0; a < size; a++) {
+    if (fabsf(row[a]) > max_abs) max_abs = fabsf(row[a]);
+  }
+  if (max_abs == 0) {
+    memset(quantized, 0, size);
+    return 0;
+  }
+  scale = max_abs / 127;
+  for (a = 0; a < size; a++) {
+    quantized[a] = (int8_t)lrintf(row[a] / scale);
+  }
+  return scale;
+}
+
+/* bytes from matrix_offset to the end of the matrix (and scales) */
+static inline uint64_t
+native_model_matrix_size(uint64_t words, uint64_t size, uint32_t flags,
+                         uint64_t n_subspaces)
+{
+  if (flags & NATIVE_MODEL_FLAG_PQ) {
+    return PQ_N_CENTROIDS * size * sizeof(float) + words * n_subspaces;
+  }
+  if (flags & NATIVE_MODEL_FLAG_INT8) {
+    uint64_t scale_offset = (words * size + sizeof(uint64_t) - 1) & ~(uint64_t)(sizeof(uint64_t) - 1);
+    return scale_offset + words * sizeof(float);
+  }
+  if (flags & (NATIVE_MODEL_FLAG_FP16|NATIVE_MODEL_FLAG_BF16)) {
+    return words * size * sizeof(uint16_t);
+  }
+  return words * size * sizeof(float);
+}
+
+/* keys_size is the total bytes of all keys */
+static inline void
+native_model_init_header(native_model_header *header,
+                         uint64_t words, uint64_t size, uint32_t flags,
+                         uint64_t n_subspaces, uint64_t keys_size)
+{
+  memset(header, 0, sizeof(*header));
+  memcpy(header->magic, NATIVE_MODEL_MAGIC, NATIVE_MODEL_MAGIC_LEN);
+  header->version = NATIVE_MODEL_VERSION;
+  header->flags = flags;
+  header->n_words = words;
+  header->dim_size = size;
+  header->matrix_offset = NATIVE_MODEL_ALIGNMENT;
+  header->pq_subspaces = (flags & NATIVE_MODEL_FLAG_PQ) ? n_subspaces : 0;
+  header->vocab_offset = header->matrix_offset +
+    native_model_matrix_size(words, size, flags, header->pq_subspaces);
+  header->vocab_offset = (header->vocab_offset + sizeof(uint64_t) - 1) & ~(uint64_t)(sizeof(uint64_t) - 1);
+  header->vocab_size = (words + 1) * sizeof(uint64_t) + keys_size;
+}
+
+/*
+  Write normalized fp32 rows at header->matrix_offset in the precision of
+  header->flags. Product-quantized rows need a trained codebook and are
+  written by the caller. Returns 0 on allocation failure.
+*/
+static inline int
+native_model_write_rows(FILE *fo, const native_model_header *header, const float *matrix)
+{
+  uint64_t words = header->n_words, size = header->dim_size, i, a;
+
+  fseeko(fo, header->matrix_offset, SEEK_SET);
+  if (header->flags & NATIVE_MODEL_FLAG_INT8) {
+    int8_t *quantized = (int8_t *)malloc(size);
+    float *scales = (float *)malloc(words * sizeof(float));
+    if (quantized == NULL || scales == NULL) {
+      free(quantized);
+      free(scales);
+      return 0;
+    }
+    for (i = 0; i < words; i++) {
+      scales[i] = quantize_row(matrix + i * size, size, quantized);
+      fwrite(quantized, 1, size, fo);
+    }
+    fseeko(fo, header->matrix_offset +
+           native_model_matrix_size(words, size, header->flags, 0) -
+           words * sizeof(float), SEEK_SET);
+    fwrite(scales, sizeof(float), words, fo);
+    free(quantized);
+    free(scales);
+  } else if (header->flags & (NATIVE_MODEL_FLAG_FP16|NATIVE_MODEL_FLAG_BF16)) {
+    uint16_t *row = (uint16_t *)malloc(size * sizeof(uint16_t));
+    if (row == NULL) {
+      return 0;
+    }
+    for (i = 0; i < words; i++) {
+      const float *src = matrix + i * size;
+      if (header->flags & NATIVE_MODEL_FLAG_FP16) {
+        for (a = 0; a < size; a++) row[a] = float_to_half(src[a]);
+      } else {
+        for (a = 0; a < size; a++) row[a] = float_to_bf16(src[a]);
+      }
+      fwrite(row, sizeof(uint16_t), size, fo);
+    }
+    free(row);
+  } else {
+    fwrite(matrix, sizeof(float), words * size, fo);
+  }
+  return 1;
+}
+
+#endif /* GROONGA_WORD2VEC_MODEL_FORMAT_H */
@@ -17,16 +17,45 @@
   MA 02110-1301, USA
 */
 
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define WORD2VEC_X86_DISPATCH
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef GRN_WITH_ZLIB
+#include <zlib.h>
+#endif
 
 #include <groonga/plugin.h>
 
+#include "model_format.h"
+
 #include <iostream>
 #include <string>
+#include <algorithm>
+#include <functional>
+#include <queue>
+#include <vector>
 
 #include "Eigen/Dense"
 
@@ -58,7 +87,8 @@ static grn_encoding sole_mecab_encoding = GRN_ENC_NONE;
 #define DEFAULT_OUTPUT_COLUMNS  "_id,_score"
 
 #define DEFAULT_N_SORT 40
-#define INSERTION_SORT_THRESHOLD 200
+#define SCAN_ROWS_PER_THREAD 65536
+#define SCAN_BLOCK_SIZE 256
 
 #define DOC_ID_PREFIX "doc_id:"
 #define DOC_ID_PREFIX_LEN 7
@@ -69,12 +99,44 @@ static grn_encoding sole_mecab_encoding = GRN_ENC_NONE;
 const long long max_size = 2000; // max length of strings
 const long long max_length_of_vocab_word = 255; // max length of vocabulary entries
 
-#define MAX_MODEL 20
+#define MAX_LOAD_THREADS 64
+
+#define VOCAB_FILE_SUFFIX ".vocab"
+#define SHM_MODEL_DIR "/dev/shm"
+#define SHM_MODEL_PREFIX "groonga-word2vec-"
+#define NATIVE_MODEL_SUFFIX "_w2v.native"
+
+#define PQ_MAX_SUBSPACE_DIM 8
+#define PQ_TRAIN_SAMPLE (PQ_N_CENTROIDS * 64)
+#define PQ_KMEANS_ITERATIONS 10
+
+#define HNSW_FILE_SUFFIX ".hnsw"
+#define HNSW_MAGIC "GRNW2VH"
+#define HNSW_MAGIC_LEN 8
+#define HNSW_VERSION 2
+#define HNSW_M 16
+#define HNSW_M0 (2 * HNSW_M)
+#define HNSW_EF_CONSTRUCTION 100
+#define HNSW_MAX_LEVEL 15
+#define HNSW_N_LOCKS 4096
+#define DEFAULT_HNSW_EF 64
+
+#define IVF_FILE_SUFFIX ".ivf"
+#define IVF_MAGIC "GRNW2VI"
+#define IVF_MAGIC_LEN 8
+#define IVF_VERSION 3
+#define IVF_TRAIN_SAMPLE_PER_LIST 64
+#define IVF_KMEANS_ITERATIONS 10
+#define DEFAULT_IVF_NPROBE 8
+
+#define LSH_N_TABLES 16
+#define LSH_MAX_TABLES 64
+#define LSH_MAX_BITS 16
+#define LSH_BUCKET_ROWS 16
+#define DEFAULT_LSH_PROBE 1
+#define LSH_MAX_PROBE 2
 
-long long n_words[MAX_MODEL], dim_size[MAX_MODEL] = {0};
-float *M[MAX_MODEL] = {NULL};
 static grn_hash *model_idxes = NULL;
-static grn_pat *vocab[MAX_MODEL]  = {NULL};
 
 typedef struct {
   double score;
@@ -96,6 +158,234 @@ typedef struct {
   string label[MAX_COLUMNS];
 } train_option;
 
+typedef enum {
+  MODEL_PRECISION_FP32,
+  MODEL_PRECISION_FP16,
+  MODEL_PRECISION_BF16,
+  MODEL_PRECISION_INT8,
+  MODEL_PRECISION_PQ
+} model_precision;
+
+/* placement of the scanned rows on NUMA nodes (see word2vec_load --numa) */
+typedef enum {
+  NUMA_MODE_NONE,
+  NUMA_MODE_INTERLEAVE,
+  NUMA_MODE_REPLICATE
+} numa_mode;
+
+/* pages behind the scanned rows (see word2vec_load --pages) */
+typedef enum {
+  MODEL_PAGES_NORMAL,
+  MODEL_PAGES_TRANSPARENT,
+  MODEL_PAGES_HUGETLB
+} model_pages;
+
+/* index searched by word2vec_distance --search_mode (see word2vec_load --index) */
+typedef enum {
+  MODEL_INDEX_NONE,
+  MODEL_INDEX_HNSW,
+  MODEL_INDEX_IVF,
+  MODEL_INDEX_LSH
+} model_index;
+
+/* how word2vec_distance finds the nearest rows */
+typedef enum {
+  SEARCH_MODE_EXACT,
+  SEARCH_MODE_HNSW,
+  SEARCH_MODE_IVF,
+  SEARCH_MODE_LSH
+} search_mode;
+
+typedef struct hnsw_visited {
+  uint16_t *marks;
+  uint16_t tag;
+  struct hnsw_visited *next;
+} hnsw_visited;
+
+/*
+  HNSW graph over rows 0..n_rows - 1. A link list is a count followed by
+  up to m rows (m0 on layer 0): the list of row i on layer 0 is at
+  links0 + i * (m0 + 1), on layer l >= 1 at
+  upper_links + upper_offsets[i] + (l - 1) * (m + 1).
+*/
+typedef struct {
+  long long n_rows;
+  int m;
+  int m0;
+  int max_level;
+  uint32_t entry_point;
+  uint8_t *levels;
+  uint32_t *links0;
+  uint32_t *upper_links;
+  uint64_t *upper_offsets;
+  size_t memory_size;
+  /* mapping of the .hnsw file behind levels, links0 and upper_links, or NULL */
+  void *map;
+  size_t map_size;
+  /* visited marks reused by searches */
+  pthread_mutex_t visited_mutex;
+  hnsw_visited *free_visited;
+} hnsw_index;
+
+/*
+  Inverted file: the candidates clustered around n_lists centroids. The
+  rows of list l are list_rows[list_offsets[l]..list_offsets[l + 1]), in
+  row order, and rows holds their scanned rows in that order so that a
+  list is read sequentially.
+*/
+typedef struct {
+  long long n_rows;
+  int n_lists;
+  long long dim_size;
+  float *centroids;
+  uint64_t *list_offsets;
+  uint32_t *list_rows;
+  /*
+    M, M16, M8 or pq_codes of the candidates in list order, and M8's
+    scales. They are mapped from the .ivf file, or grouped in memory
+    (rows_map_size > 0, see map_rows) when the file cannot be written.
+    The NUMA copies replace rows when the model's rows are copied.
+  */
+  void *rows;
+  size_t rows_map_size;
+  void **numa_rows;
+  int n_numa_rows;
+  size_t numa_rows_size;
+  float *row_scale;
+  size_t memory_size;
+  /* mapping of the .ivf file behind centroids, list_offsets and list_rows, or NULL */
+  void *map;
+  size_t map_size;
+} ivf_index;
+
+/*
+  Sign-random-projection LSH: each table hashes a row to the signs of
+  its dot products with n_bits random hyperplanes. The rows of bucket b
+  of table t are bucket_rows[t][bucket_offsets[t][b]..bucket_offsets[t][b + 1]),
+  in row order.
+*/
+typedef struct {
+  long long n_rows;
+  int n_tables;
+  int n_bits;
+  long long dim_size;
+  float *planes;                      /* [n_tables][n_bits][dim_size] */
+  uint32_t *bucket_offsets;           /* [n_tables][(1 << n_bits) + 1] */
+  uint32_t *bucket_rows;              /* [n_tables][n_rows] */
+  size_t memory_size;
+} lsh_index;
+
+typedef struct {
+  int binary;
+  int n_threads;
+  grn_bool is_shared;
+  model_precision precision;
+  int pq_subspaces; /* 0: sub-vectors of up to PQ_MAX_SUBSPACE_DIM dims */
+  long long max_words; /* 0: all rows */
+  grn_bool query_only_tail;
+  numa_mode numa;
+  model_pages pages;
+  grn_bool lock;
+  model_index index;
+  /* lists of the ivf index; 0 for about sqrt(candidates) */
+  int ivf_lists;
+  /* tables of the lsh index; 0 for LSH_N_TABLES */
+  int lsh_tables;
+} load_option;
+
+/*
+  A loaded model. word2vec_load builds a new one off to the side and
+  publishes it in models[] with a pointer swap; word2vec_distance holds a
+  reference for the whole query, so a reload or unload never frees rows a
+  running query is reading. The last reference closes the model.
+*/
+typedef struct {
+  long long n_words;
+  /* rows 0..n_candidates-1 are scanned; the rest only serve as query terms */
+  long long n_candidates;
+  long long dim_size;
+  float *M;
+  /* rows stored as fp16 or bf16 instead of M (see word2vec_load --precision) */
+  uint16_t *M16;
+  /* int8 rows; row i is M8[i] * row_scale[i] */
+  int8_t *M8;
+  float *row_scale;
+  /*
+    product-quantized rows: row i is the concatenation of
+    pq_codebook[m][pq_codes[i][m]] for m < pq_subspaces
+    (pq_codebook[m] is PQ_N_CENTROIDS x dim_size / pq_subspaces)
+  */
+  uint8_t *pq_codes;
+  float *pq_codebook;
+  int pq_subspaces;
+  /* allocation behind M8/row_scale or pq_codes/pq_codebook when quantized at load time */
+  void *quantized_buffer;
+  /* fp32 rows of a mapped native model kept for reranking int8/pq results */
+  const float *rerank_matrix;
+  model_precision precision;
+  /*
+    rows are sorted by key (NATIVE_MODEL_FLAG_KEY_ORDER) rather than by
+    frequency, so the first rows are not the most frequent words
+  */
+  grn_bool key_order;
+  /*
+    copies of the scanned rows (M, M16, M8 or pq_codes of the candidates)
+    placed by word2vec_load --numa: one per node with replicate, a single
+    copy striped across the nodes with interleave
+  */
+  void **numa_rows;
+  int n_numa_rows;
+  size_t numa_rows_size;
+  /* anonymous mapping the heap rows were moved to by word2vec_load --pages */
+  void *rows_map;
+  size_t rows_map_size;
+  /* pages actually behind the scanned rows and whether they are mlock()-ed */
+  model_pages pages;
+  grn_bool locked;
+  /* graph over the candidates built or read by word2vec_load --index hnsw */
+  hnsw_index *hnsw;
+  /* lists built or read by word2vec_load --index ivf */
+  ivf_index *ivf;
+  /* tables built by word2vec_load --index lsh */
+  lsh_index *lsh;
+  grn_pat *vocab;
+  /* options the model was loaded with, reused by word2vec_apply_delta */
+  load_option option;
+  /* read-only mapping of a native model file; M (or M8, pq_codes) points into it */
+  void *map;
+  size_t map_size;
+  /* shared flock held while attached to a model in shared memory, or -1 */
+  int shm_lock;
+  char *shm_path;
+  /* bytes of rows held in memory, counted against GRN_WORD2VEC_MEMORY_LIMIT */
+  size_t memory_size;
+  /* model_clock at the last acquire_model(), for LRU eviction */
+  unsigned long long last_used;
+  int n_refs;
+} word2vec_model;
+
+/*
+  Registry of loaded models. Slot i belongs to the model path with id
+  i + 1 in model_idxes; it grows with the number of distinct paths.
+*/
+typedef struct {
+  word2vec_model *model;
+  /* background loads in flight (word2vec_load --async) */
+  int n_loading;
+  /* the last background load failed */
+  grn_bool failed;
+} model_slot;
+
+static model_slot *models = NULL;
+static int n_model_slots = 0;
+static unsigned long long model_clock = 0;
+/* background loads in flight over all slots; GRN_PLUGIN_FIN waits for them */
+static int n_background_loads = 0;
+/* guards model_idxes, models[] and taking a reference to a published model */
+static pthread_mutex_t models_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* signaled when a background load finishes */
+static pthread_cond_t models_cond = PTHREAD_COND_INITIALIZER;
+
 
 static void
 output_header(grn_ctx *ctx, int nhits)
@@ -519,183 +809,6734 @@ get_train_file_path(grn_ctx *ctx, char *file_name)
    strcat(file_name, "_w2v.txt");
 }
 
+static void
+get_native_model_file_path(grn_ctx *ctx, char *file_name)
+{
+   grn_obj *db;
+   db = grn_ctx_db(ctx);
+   const char *path;
+   path = grn_obj_path(ctx, db);
+   strcpy(file_name, path);
+   strcat(file_name, NATIVE_MODEL_SUFFIX);
+}
+
+/* the converted native model is preferred while it is not older than _w2v.bin */
+static void
+get_load_model_file_path(grn_ctx *ctx, char *file_name)
+{
+  char native_file_name[max_size];
+  struct stat model_stat, native_stat;
+
+  get_model_file_path(ctx, file_name);
+  get_native_model_file_path(ctx, native_file_name);
+  if (stat(native_file_name, &native_stat) == 0 &&
+      (stat(file_name, &model_stat) != 0 ||
+       native_stat.st_mtime >= model_stat.st_mtime)) {
+    strcpy(file_name, native_file_name);
+  }
+}
+
+/*
+  Slot of file_name in models[]. An unknown path gets a new slot when
+  add is true; otherwise -1 is returned. -1 is also returned on failure.
+*/
 static int
-get_model_idx(grn_ctx *ctx, const char *file_name)
+get_model_idx(grn_ctx *ctx, const char *file_name, grn_bool add)
 {
-  int model_idx = 0;
+  grn_id id = GRN_ID_NIL;
+  int model_idx = -1;
+
+  pthread_mutex_lock(&models_mutex);
   if (!model_idxes) {
     model_idxes = grn_hash_create(ctx, NULL,
                                     GRN_TABLE_MAX_KEY_SIZE,
                                     0,
                                     GRN_OBJ_TABLE_HASH_KEY|GRN_OBJ_KEY_VAR_SIZE);
-    if (!model_idxes) {
-      return 0;
+  }
+  if (model_idxes) {
+    id = grn_hash_get(ctx, model_idxes,
+                      file_name, strlen(file_name),
+                      NULL);
+    if (id == GRN_ID_NIL && add) {
+      id = grn_hash_add(ctx, model_idxes,
+                        file_name, strlen(file_name),
+                        NULL, NULL);
     }
   }
-  model_idx = grn_hash_get(ctx, model_idxes,
-                             file_name, strlen(file_name),
-                             NULL);
-  if (model_idx == GRN_ID_NIL) {
-    model_idx = grn_hash_add(ctx, model_idxes,
-                               file_name, strlen(file_name),
-                               NULL, NULL);
-    if (model_idx > MAX_MODEL || model_idx == GRN_ID_NIL) {
-      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
-                     "[word2vec_load] "
-                     "Couldn't get model index : %s",
-                     file_name);
-      return 0;
+  if (id != GRN_ID_NIL && (int)id > n_model_slots) {
+    int n_slots = n_model_slots > 0 ? n_model_slots * 2 : 16;
+    model_slot *slots;
+    while (n_slots < (int)id) n_slots *= 2;
+    slots = (model_slot *)GRN_PLUGIN_REALLOC(ctx, models,
+                                             n_slots * sizeof(model_slot));
+    if (slots == NULL) {
+      id = GRN_ID_NIL;
+    } else {
+      memset(slots + n_model_slots, 0, (n_slots - n_model_slots) * sizeof(model_slot));
+      models = slots;
+      n_model_slots = n_slots;
     }
   }
-  if (model_idx) {
-    model_idx--;
+  if (id != GRN_ID_NIL) {
+    model_idx = id - 1;
+  } else if (add) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Couldn't get model index : %s",
+                   file_name);
   }
+  pthread_mutex_unlock(&models_mutex);
   return model_idx;
 }
 
+/*
+  Drop this process's reference to a shared model. Every attached process
+  holds a shared flock on the lock file, so getting it exclusively means
+  we were the last one and the segment can be removed.
+*/
 static void
-word2vec_unload(grn_ctx *ctx, int i)
+detach_shm_model(grn_ctx *ctx, word2vec_model *model)
+{
+  char file_name[max_size];
+
+  if (flock(model->shm_lock, LOCK_EX|LOCK_NB) == 0) {
+    unlink(model->shm_path);
+    snprintf(file_name, max_size, "%s%s", model->shm_path, VOCAB_FILE_SUFFIX);
+    grn_pat_remove(ctx, file_name);
+    snprintf(file_name, max_size, "%s%s.lock", model->shm_path, VOCAB_FILE_SUFFIX);
+    unlink(file_name);
+    snprintf(file_name, max_size, "%s.build", model->shm_path);
+    unlink(file_name);
+    snprintf(file_name, max_size, "%s.lock", model->shm_path);
+    unlink(file_name);
+  }
+  close(model->shm_lock);
+  model->shm_lock = -1;
+  GRN_PLUGIN_FREE(ctx, model->shm_path);
+  model->shm_path = NULL;
+}
+
+static word2vec_model *
+create_model(grn_ctx *ctx)
 {
-  if (vocab[i] != NULL) {
-    grn_pat_close(ctx, vocab[i]);
-    vocab[i] = NULL;
+  word2vec_model *model;
+
+  model = (word2vec_model *)GRN_PLUGIN_MALLOC(ctx, sizeof(word2vec_model));
+  if (model == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Cannot allocate model");
+    return NULL;
+  }
+  memset(model, 0, sizeof(word2vec_model));
+  model->precision = MODEL_PRECISION_FP32;
+  model->shm_lock = -1;
+  model->n_refs = 1;
+  return model;
+}
+
+static void
+close_hnsw_index(grn_ctx *ctx, hnsw_index *index)
+{
+  hnsw_visited *visited, *next;
+
+  if (index->map != NULL) {
+    munmap(index->map, index->map_size);
+  } else {
+    if (index->levels) {
+      GRN_PLUGIN_FREE(ctx, index->levels);
+    }
+    if (index->links0) {
+      GRN_PLUGIN_FREE(ctx, index->links0);
+    }
+    if (index->upper_links) {
+      GRN_PLUGIN_FREE(ctx, index->upper_links);
+    }
   }
-  if (M[i] != NULL){
-    GRN_PLUGIN_FREE(ctx, M[i]);
-    M[i] = NULL;
+  if (index->upper_offsets) {
+    GRN_PLUGIN_FREE(ctx, index->upper_offsets);
   }
-  n_words[i] = 0;
-  dim_size[i] = 0;
+  for (visited = index->free_visited; visited; visited = next) {
+    next = visited->next;
+    GRN_PLUGIN_FREE(ctx, visited->marks);
+    GRN_PLUGIN_FREE(ctx, visited);
+  }
+  pthread_mutex_destroy(&(index->visited_mutex));
+  GRN_PLUGIN_FREE(ctx, index);
 }
 
-static grn_bool
-word2vec_load(grn_ctx *ctx, const char *file_name, int model_idx, int binary)
+static void
+close_ivf_index(grn_ctx *ctx, ivf_index *index)
 {
-  FILE *f;
-  float len;
-  long long a, b;
-  grn_obj buf;
+  if (index->map != NULL) {
+    munmap(index->map, index->map_size);
+  } else {
+    if (index->centroids) {
+      GRN_PLUGIN_FREE(ctx, index->centroids);
+    }
+    if (index->list_offsets) {
+      GRN_PLUGIN_FREE(ctx, index->list_offsets);
+    }
+    if (index->list_rows) {
+      GRN_PLUGIN_FREE(ctx, index->list_rows);
+    }
+  }
+  if (index->rows_map_size > 0) {
+    if (index->rows) {
+      munmap(index->rows, index->rows_map_size);
+    }
+    if (index->row_scale) {
+      GRN_PLUGIN_FREE(ctx, index->row_scale);
+    }
+  }
+  if (index->numa_rows) {
+    int i;
+    for (i = 0; i < index->n_numa_rows; i++) {
+      munmap(index->numa_rows[i], index->numa_rows_size);
+    }
+    GRN_PLUGIN_FREE(ctx, index->numa_rows);
+  }
+  GRN_PLUGIN_FREE(ctx, index);
+}
 
-  f = fopen(file_name, "rb");
-  if (f == NULL) {
-    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
-                   "[word2vec_load] "
-                   "Input file not found : %s",
-                   file_name);
-    return GRN_FALSE;
+static void
+close_lsh_index(grn_ctx *ctx, lsh_index *index)
+{
+  if (index->planes) {
+    GRN_PLUGIN_FREE(ctx, index->planes);
+  }
+  if (index->bucket_offsets) {
+    GRN_PLUGIN_FREE(ctx, index->bucket_offsets);
+  }
+  if (index->bucket_rows) {
+    GRN_PLUGIN_FREE(ctx, index->bucket_rows);
   }
+  GRN_PLUGIN_FREE(ctx, index);
+}
 
-  word2vec_unload(ctx, model_idx);
+static void
+close_model(grn_ctx *ctx, word2vec_model *model)
+{
+  if (model->vocab != NULL) {
+    grn_pat_close(ctx, model->vocab);
+  }
+  if (model->map != NULL) {
+    munmap(model->map, model->map_size);
+  } else if (model->M != NULL && (void *)model->M != model->rows_map) {
+    GRN_PLUGIN_FREE(ctx, model->M);
+  }
+  if (model->M16 != NULL && model->map == NULL &&
+      (void *)model->M16 != model->rows_map) {
+    GRN_PLUGIN_FREE(ctx, model->M16);
+  }
+  if (model->quantized_buffer != NULL) {
+    GRN_PLUGIN_FREE(ctx, model->quantized_buffer);
+  }
+  if (model->rows_map != NULL) {
+    munmap(model->rows_map, model->rows_map_size);
+  }
+  if (model->numa_rows != NULL) {
+    int i;
+    for (i = 0; i < model->n_numa_rows; i++) {
+      munmap(model->numa_rows[i], model->numa_rows_size);
+    }
+    GRN_PLUGIN_FREE(ctx, model->numa_rows);
+  }
+  if (model->hnsw != NULL) {
+    close_hnsw_index(ctx, model->hnsw);
+  }
+  if (model->ivf != NULL) {
+    close_ivf_index(ctx, model->ivf);
+  }
+  if (model->lsh != NULL) {
+    close_lsh_index(ctx, model->lsh);
+  }
+  if (model->shm_lock != -1) {
+    detach_shm_model(ctx, model);
+  }
+  GRN_PLUGIN_FREE(ctx, model);
+}
 
-  fscanf(f, "%lld", &n_words[model_idx]);
-  fscanf(f, "%lld", &dim_size[model_idx]);
-  M[model_idx] = (float *)GRN_PLUGIN_MALLOC(ctx, (long long)n_words[model_idx] * (long long)dim_size[model_idx] * sizeof(float));
+/* take a reference to the model published at model_idx, or NULL */
+static word2vec_model *
+acquire_model(int model_idx)
+{
+  word2vec_model *model;
 
-  vocab[model_idx] = grn_pat_create(ctx, NULL,
-                                    GRN_TABLE_MAX_KEY_SIZE,
-                                    0,
-                                    GRN_OBJ_TABLE_PAT_KEY|GRN_OBJ_KEY_VAR_SIZE);
+  pthread_mutex_lock(&models_mutex);
+  model = models[model_idx].model;
+  if (model != NULL) {
+    __atomic_add_fetch(&(model->n_refs), 1, __ATOMIC_RELAXED);
+    model->last_used = ++model_clock;
+  }
+  pthread_mutex_unlock(&models_mutex);
+  return model;
+}
 
-  if (vocab[model_idx] == NULL) {
-    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
-                   "[word2vec_load] "
-                   "Cannot create vocab table");
+static void
+release_model(grn_ctx *ctx, word2vec_model *model)
+{
+  if (__atomic_sub_fetch(&(model->n_refs), 1, __ATOMIC_ACQ_REL) == 0) {
+    close_model(ctx, model);
+  }
+}
+
+/*
+  Replace the model at model_idx (NULL unloads it). The previous model is
+  closed when its last reader releases it. Returns whether there was one.
+*/
+static grn_bool
+publish_model(grn_ctx *ctx, int model_idx, word2vec_model *model)
+{
+  word2vec_model *old_model;
+
+  pthread_mutex_lock(&models_mutex);
+  old_model = models[model_idx].model;
+  models[model_idx].model = model;
+  if (model != NULL) {
+    model->last_used = ++model_clock;
+  }
+  pthread_mutex_unlock(&models_mutex);
+  if (old_model == NULL) {
     return GRN_FALSE;
   }
+  release_model(ctx, old_model);
+  return GRN_TRUE;
+}
 
-  GRN_TEXT_INIT(&buf, 0);
-  for (b = 0; b < n_words[model_idx]; b++) {
-    a = 0;
-    GRN_BULK_REWIND(&buf);
-    if (binary == 0) {
-      char format[20];
-      char word[max_length_of_vocab_word];
-      float value;
-      sprintf(format,"%%%ds",max_length_of_vocab_word);
-      fscanf(f, format, word);
-      if (!grn_pat_add(ctx, vocab[model_idx], word, strlen(word), NULL, NULL)) {
-        GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Faild load vocab");
-        grn_obj_unlink(ctx, &buf);
-        return GRN_FALSE;
-      }
-      for (a = 0; a < dim_size[model_idx]; a++) {
-        fscanf(f, "%f", &M[model_idx][a + b * dim_size[model_idx]]);
-        len += M[model_idx][a + b * dim_size[model_idx]] * M[model_idx][a + b * dim_size[model_idx]];
+/*
+  GRN_WORD2VEC_MEMORY_LIMIT in bytes, with an optional K, M or G suffix; 0
+  is unlimited. It is environment-only and read again on every load.
+*/
+static size_t
+get_memory_limit(void)
+{
+  const char *env;
+  char *end;
+  size_t limit;
+
+  env = getenv("GRN_WORD2VEC_MEMORY_LIMIT");
+  if (env == NULL) {
+    return 0;
+  }
+  limit = strtoull(env, &end, 10);
+  switch (*end) {
+  case 'G' : case 'g' :
+    limit <<= 10;
+    /* fall through */
+  case 'M' : case 'm' :
+    limit <<= 10;
+    /* fall through */
+  case 'K' : case 'k' :
+    limit <<= 10;
+  default :
+    break;
+  }
+  return limit;
+}
+
+/*
+  Unload the least recently used models until the published models fit
+  in GRN_WORD2VEC_MEMORY_LIMIT. The model at keep_idx (just loaded) is
+  never evicted; queries still using an evicted model keep it alive.
+*/
+static void
+evict_models(grn_ctx *ctx, int keep_idx)
+{
+  size_t limit = get_memory_limit();
+
+  while (limit > 0) {
+    word2vec_model *victim = NULL;
+    size_t total = 0;
+    int i, victim_idx = -1;
+    char victim_name[GRN_TABLE_MAX_KEY_SIZE];
+    int victim_name_len = 0;
+
+    pthread_mutex_lock(&models_mutex);
+    for (i = 0; i < n_model_slots; i++) {
+      if (models[i].model == NULL) continue;
+      total += models[i].model->memory_size;
+      if (i != keep_idx &&
+          (victim_idx == -1 || models[i].model->last_used < models[victim_idx].model->last_used)) {
+        victim_idx = i;
       }
-    } else {
-      while (1) {
-        char c = fgetc(f);
-        if (c != '\n' && c!= ' ') GRN_TEXT_PUTC(ctx, &buf, c);
-        if (feof(f) || (c == ' ')) break;
-        if ((a < max_length_of_vocab_word) && (c != '\n')) a++;
+    }
+    if (total > limit && victim_idx != -1) {
+      victim = models[victim_idx].model;
+      models[victim_idx].model = NULL;
+      victim_name_len = grn_hash_get_key(ctx, model_idxes, victim_idx + 1,
+                                         victim_name, GRN_TABLE_MAX_KEY_SIZE);
+    }
+    pthread_mutex_unlock(&models_mutex);
+    if (victim == NULL) {
+      if (total > limit) {
+        GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                       "[word2vec_load] "
+                       "Loaded models exceed memory limit : %zu > %zu",
+                       total, limit);
       }
+      break;
+    }
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_NOTICE,
+                   "[word2vec_load] evicted %.*s (%zu bytes)",
+                   victim_name_len, victim_name, victim->memory_size);
+    release_model(ctx, victim);
+  }
+}
 
-      if (!grn_pat_add(ctx, vocab[model_idx], GRN_TEXT_VALUE(&buf), GRN_TEXT_LEN(&buf), NULL, NULL)) {
-        GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Faild load vocab");
-        grn_obj_unlink(ctx, &buf);
-        return GRN_FALSE;
-      }
-      for (a = 0; a < dim_size[model_idx]; a++) fread(&M[model_idx][a + b * dim_size[model_idx]], sizeof(float), 1, f);
+static grn_bool
+word2vec_unload(grn_ctx *ctx, int i)
+{
+  return publish_model(ctx, i, NULL);
+}
+
+static grn_bool
+is_native_model_file(FILE *f)
+{
+  char magic[NATIVE_MODEL_MAGIC_LEN];
+  grn_bool is_native;
+
+  is_native = (fread(magic, 1, NATIVE_MODEL_MAGIC_LEN, f) == NATIVE_MODEL_MAGIC_LEN &&
+               memcmp(magic, NATIVE_MODEL_MAGIC, NATIVE_MODEL_MAGIC_LEN) == 0);
+  rewind(f);
+  return is_native;
+}
+
+static grn_bool
+is_gzip_file(FILE *f)
+{
+  unsigned char magic[2];
+  grn_bool is_gzip;
+
+  is_gzip = (fread(magic, 1, 2, f) == 2 && magic[0] == 0x1f && magic[1] == 0x8b);
+  rewind(f);
+  return is_gzip;
+}
+
+/*
+  Dot product kernels for the distance scan, chosen once at plugin init
+  by CPUID (GRN_WORD2VEC_SIMD caps the level: scalar, sse2, avx2 or
+  avx512). Every fp32 reduction sums element a into lane a % SIMD_LANES
+  with a separate multiply and add, folds the lanes in halves and then
+  adds the remaining elements in order, so all levels return the same
+  bits and results do not depend on the CPU. A fused multiply-add rounds
+  once and would break this, so the plugin is built with
+  -ffp-contract=off (see Makefile.am). Rows keep their dim_size stride
+  and are read with unaligned loads.
+*/
+#define SIMD_LANES 16
+
+typedef float (*dot_f32_func)(const float *x, const float *y, long long size);
+typedef float (*dot_u16_func)(const float *x, const uint16_t *y, long long size);
+typedef int32_t (*dot_i8_func)(const int8_t *x, const int8_t *y, long long size);
+
+static float
+dot_f32_scalar(const float *x, const float *y, long long size)
+{
+  float lanes[SIMD_LANES] = {0};
+  float sum;
+  long long a = 0;
+  int i, width;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    for (i = 0; i < SIMD_LANES; i++) {
+      float product = x[a + i] * y[a + i];
+      lanes[i] += product;
     }
-    len = 0;
-    for (a = 0; a < dim_size[model_idx]; a++) len += M[model_idx][a + b * dim_size[model_idx]] * M[model_idx][a + b * dim_size[model_idx]];
-    len = sqrt(len);
-    for (a = 0; a < dim_size[model_idx]; a++) M[model_idx][a + b * dim_size[model_idx]] /= len;
   }
-  grn_obj_unlink(ctx, &buf);
-  fclose(f);
+  for (width = SIMD_LANES / 2; width > 0; width /= 2) {
+    for (i = 0; i < width; i++) lanes[i] += lanes[i + width];
+  }
+  sum = lanes[0];
+  for (; a < size; a++) sum += x[a] * y[a];
+  return sum;
+}
 
-  return GRN_TRUE;
+/* x . y where y is fp16 (half) or bf16, widened with to_float */
+#define DOT_U16_SCALAR(name, to_float)                                    \
+static float                                                            \
+name(const float *x, const uint16_t *y, long long size)                 \
+{                                                                       \
+  float lanes[SIMD_LANES] = {0};                                        \
+  float sum;                                                            \
+  long long a = 0;                                                      \
+  int i, width;                                                         \
+                                                                        \
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {                     \
+    for (i = 0; i < SIMD_LANES; i++) {                                  \
+      float product = x[a + i] * to_float(y[a + i]);                    \
+      lanes[i] += product;                                              \
+    }                                                                   \
+  }                                                                     \
+  for (width = SIMD_LANES / 2; width > 0; width /= 2) {                 \
+    for (i = 0; i < width; i++) lanes[i] += lanes[i + width];           \
+  }                                                                     \
+  sum = lanes[0];                                                       \
+  for (; a < size; a++) sum += x[a] * to_float(y[a]);                   \
+  return sum;                                                           \
 }
 
-static grn_obj *
-command_word2vec_load(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
-                      grn_user_data *user_data)
+DOT_U16_SCALAR(dot_f16_scalar, half_to_float)
+DOT_U16_SCALAR(dot_bf16_scalar, bf16_to_float)
+
+#undef DOT_U16_SCALAR
+
+/* int8 x int8 dot product with int32 accumulation */
+static int32_t
+int8_dot_scalar(const int8_t *x, const int8_t *y, long long size)
 {
-  char file_name[max_size];
-  grn_obj *var;
-  int binary = 1;
-  var = grn_plugin_proc_get_var(ctx, user_data, "file_path", -1);
-  if (GRN_TEXT_LEN(var) == 0) {
-    get_model_file_path(ctx, file_name);
-  } else {
-    strcpy(file_name, GRN_TEXT_VALUE(var));
-    file_name[GRN_TEXT_LEN(var)] = '\0';
+  long long a;
+  int32_t sum = 0;
+  for (a = 0; a < size; a++) sum += (int32_t)x[a] * (int32_t)y[a];
+  return sum;
+}
+
+#if defined(WORD2VEC_X86_DISPATCH) || defined(__SSE2__)
+#ifdef WORD2VEC_X86_DISPATCH
+# define SIMD_TARGET(isa) __attribute__((__target__(isa)))
+#else
+# define SIMD_TARGET(isa)
+#endif
+
+/* fold 4 lanes [i] + [i + 2], then [0] + [1] */
+SIMD_TARGET("sse2") static inline float
+fold_sse2(__m128 s)
+{
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+SIMD_TARGET("sse2") static float
+dot_f32_sse2(const float *x, const float *y, long long size)
+{
+  __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+  __m128 acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+  float sum;
+  long long a = 0;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + a), _mm_loadu_ps(y + a)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + a + 4), _mm_loadu_ps(y + a + 4)));
+    acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_loadu_ps(x + a + 8), _mm_loadu_ps(y + a + 8)));
+    acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_loadu_ps(x + a + 12), _mm_loadu_ps(y + a + 12)));
   }
-  var = grn_plugin_proc_get_var(ctx, user_data, "binary", -1);
-  if (GRN_TEXT_LEN(var) != 0) {
-    binary = atoi(GRN_TEXT_VALUE(var));
+  sum = fold_sse2(_mm_add_ps(_mm_add_ps(acc0, acc2), _mm_add_ps(acc1, acc3)));
+  for (; a < size; a++) sum += x[a] * y[a];
+  return sum;
+}
+
+/* bf16 is the upper half of fp32: interleave zeros below it */
+SIMD_TARGET("sse2") static float
+dot_bf16_sse2(const float *x, const uint16_t *y, long long size)
+{
+  __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps();
+  __m128 acc2 = _mm_setzero_ps(), acc3 = _mm_setzero_ps();
+  __m128i zero = _mm_setzero_si128();
+  float sum;
+  long long a = 0;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    __m128i v0 = _mm_loadu_si128((const __m128i *)(y + a));
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(y + a + 8));
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + a),
+                                       _mm_castsi128_ps(_mm_unpacklo_epi16(zero, v0))));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + a + 4),
+                                       _mm_castsi128_ps(_mm_unpackhi_epi16(zero, v0))));
+    acc2 = _mm_add_ps(acc2, _mm_mul_ps(_mm_loadu_ps(x + a + 8),
+                                       _mm_castsi128_ps(_mm_unpacklo_epi16(zero, v1))));
+    acc3 = _mm_add_ps(acc3, _mm_mul_ps(_mm_loadu_ps(x + a + 12),
+                                       _mm_castsi128_ps(_mm_unpackhi_epi16(zero, v1))));
   }
+  sum = fold_sse2(_mm_add_ps(_mm_add_ps(acc0, acc2), _mm_add_ps(acc1, acc3)));
+  for (; a < size; a++) sum += x[a] * bf16_to_float(y[a]);
+  return sum;
+}
 
-  if (word2vec_load(ctx, file_name, get_model_idx(ctx, file_name), binary) == GRN_TRUE) {
-    grn_ctx_output_bool(ctx, GRN_TRUE);
-  } else {
-    grn_ctx_output_bool(ctx, GRN_FALSE);
+SIMD_TARGET("sse2") static int32_t
+int8_dot_sse2(const int8_t *x, const int8_t *y, long long size)
+{
+  long long a = 0;
+  int32_t sum;
+  __m128i acc = _mm_setzero_si128();
+
+  for (; a + 16 <= size; a += 16) {
+    __m128i vx = _mm_loadu_si128((const __m128i *)(x + a));
+    __m128i vy = _mm_loadu_si128((const __m128i *)(y + a));
+    /* sign-extend to 16 bits, then multiply and add adjacent pairs into 32 bits */
+    __m128i x_lo = _mm_srai_epi16(_mm_unpacklo_epi8(vx, vx), 8);
+    __m128i x_hi = _mm_srai_epi16(_mm_unpackhi_epi8(vx, vx), 8);
+    __m128i y_lo = _mm_srai_epi16(_mm_unpacklo_epi8(vy, vy), 8);
+    __m128i y_hi = _mm_srai_epi16(_mm_unpackhi_epi8(vy, vy), 8);
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(x_lo, y_lo));
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(x_hi, y_hi));
   }
-  return NULL;
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  sum = _mm_cvtsi128_si32(acc);
+  for (; a < size; a++) sum += (int32_t)x[a] * (int32_t)y[a];
+  return sum;
 }
+#endif
 
-static grn_obj *
-command_word2vec_unload(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
-                        GNUC_UNUSED grn_user_data *user_data)
+#ifdef WORD2VEC_X86_DISPATCH
+/* fold 8 lanes [i] + [i + 4], then as fold_sse2 */
+SIMD_TARGET("avx2") static inline float
+fold_avx(__m256 v)
 {
-  for (int i = 0; i < MAX_MODEL; i++) {
-    word2vec_unload(ctx, i);
+  return fold_sse2(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+
+SIMD_TARGET("avx2") static float
+dot_f32_avx2(const float *x, const float *y, long long size)
+{
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  float sum;
+  long long a = 0;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(x + a),
+                                             _mm256_loadu_ps(y + a)));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(x + a + 8),
+                                             _mm256_loadu_ps(y + a + 8)));
+  }
+  sum = fold_avx(_mm256_add_ps(acc0, acc1));
+  for (; a < size; a++) sum += x[a] * y[a];
+  return sum;
+}
+
+SIMD_TARGET("avx2,f16c") static float
+dot_f16_avx2(const float *x, const uint16_t *y, long long size)
+{
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  float sum;
+  long long a = 0;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    __m256 y0 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(y + a)));
+    __m256 y1 = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(y + a + 8)));
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(x + a), y0));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(x + a + 8), y1));
+  }
+  sum = fold_avx(_mm256_add_ps(acc0, acc1));
+  for (; a < size; a++) sum += x[a] * half_to_float(y[a]);
+  return sum;
+}
+
+SIMD_TARGET("avx2") static float
+dot_bf16_avx2(const float *x, const uint16_t *y, long long size)
+{
+  __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps();
+  float sum;
+  long long a = 0;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    __m256i v0 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(y + a)));
+    __m256i v1 = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(y + a + 8)));
+    acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(x + a),
+                                             _mm256_castsi256_ps(_mm256_slli_epi32(v0, 16))));
+    acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(x + a + 8),
+                                             _mm256_castsi256_ps(_mm256_slli_epi32(v1, 16))));
+  }
+  sum = fold_avx(_mm256_add_ps(acc0, acc1));
+  for (; a < size; a++) sum += x[a] * bf16_to_float(y[a]);
+  return sum;
+}
+
+SIMD_TARGET("avx2") static int32_t
+int8_dot_avx2(const int8_t *x, const int8_t *y, long long size)
+{
+  long long a = 0;
+  int32_t sum;
+  __m256i acc = _mm256_setzero_si256();
+  __m128i s;
+
+  for (; a + 16 <= size; a += 16) {
+    __m256i vx = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(x + a)));
+    __m256i vy = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(y + a)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(vx, vy));
+  }
+  s = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+  s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+  sum = _mm_cvtsi128_si32(s);
+  for (; a < size; a++) sum += (int32_t)x[a] * (int32_t)y[a];
+  return sum;
+}
+
+/* fold 16 lanes [i] + [i + 8], then as fold_avx */
+SIMD_TARGET("avx512f") static inline float
+fold_avx512(__m512 v)
+{
+  __m256 lo = _mm512_castps512_ps256(v);
+  __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+  return fold_avx(_mm256_add_ps(lo, hi));
+}
+
+SIMD_TARGET("avx512f") static float
+dot_f32_avx512(const float *x, const float *y, long long size)
+{
+  __m512 acc = _mm512_setzero_ps();
+  float sum;
+  long long a = 0;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_loadu_ps(x + a), _mm512_loadu_ps(y + a)));
+  }
+  sum = fold_avx512(acc);
+  for (; a < size; a++) sum += x[a] * y[a];
+  return sum;
+}
+
+SIMD_TARGET("avx512f") static float
+dot_f16_avx512(const float *x, const uint16_t *y, long long size)
+{
+  __m512 acc = _mm512_setzero_ps();
+  float sum;
+  long long a = 0;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    __m512 v = _mm512_cvtph_ps(_mm256_loadu_si256((const __m256i *)(y + a)));
+    acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_loadu_ps(x + a), v));
+  }
+  sum = fold_avx512(acc);
+  for (; a < size; a++) sum += x[a] * half_to_float(y[a]);
+  return sum;
+}
+
+SIMD_TARGET("avx512f") static float
+dot_bf16_avx512(const float *x, const uint16_t *y, long long size)
+{
+  __m512 acc = _mm512_setzero_ps();
+  float sum;
+  long long a = 0;
+
+  for (; a + SIMD_LANES <= size; a += SIMD_LANES) {
+    __m512i v = _mm512_cvtepu16_epi32(_mm256_loadu_si256((const __m256i *)(y + a)));
+    acc = _mm512_add_ps(acc, _mm512_mul_ps(_mm512_loadu_ps(x + a),
+                                           _mm512_castsi512_ps(_mm512_slli_epi32(v, 16))));
+  }
+  sum = fold_avx512(acc);
+  for (; a < size; a++) sum += x[a] * bf16_to_float(y[a]);
+  return sum;
+}
+#endif
+
+static dot_f32_func dot_f32 = dot_f32_scalar;
+static dot_u16_func dot_f16 = dot_f16_scalar;
+static dot_u16_func dot_bf16 = dot_bf16_scalar;
+static dot_i8_func int8_dot = int8_dot_scalar;
+static const char *simd_level = "scalar";
+
+static void
+init_simd_kernels(grn_ctx *ctx)
+{
+  const char *max_level = getenv("GRN_WORD2VEC_SIMD");
+  grn_bool allow_sse2 = GRN_TRUE, allow_avx2 = GRN_TRUE, allow_avx512 = GRN_TRUE;
+
+  if (max_level != NULL) {
+    if (strcmp(max_level, "scalar") == 0) {
+      allow_sse2 = allow_avx2 = allow_avx512 = GRN_FALSE;
+    } else if (strcmp(max_level, "sse2") == 0) {
+      allow_avx2 = allow_avx512 = GRN_FALSE;
+    } else if (strcmp(max_level, "avx2") == 0) {
+      allow_avx512 = GRN_FALSE;
+    }
+  }
+#if defined(WORD2VEC_X86_DISPATCH)
+  __builtin_cpu_init();
+  if (allow_sse2 && __builtin_cpu_supports("sse2")) {
+    dot_f32 = dot_f32_sse2;
+    dot_bf16 = dot_bf16_sse2;
+    int8_dot = int8_dot_sse2;
+    simd_level = "sse2";
+  }
+  if (allow_avx2 && __builtin_cpu_supports("avx2")) {
+    dot_f32 = dot_f32_avx2;
+    dot_bf16 = dot_bf16_avx2;
+    int8_dot = int8_dot_avx2;
+    simd_level = "avx2";
+    /* every AVX2 CPU has F16C so far, but it is a separate CPUID bit */
+    {
+      unsigned int eax, ebx, ecx, edx;
+      __asm__ ("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+      if (ecx & (1u << 29)) {
+        dot_f16 = dot_f16_avx2;
+      }
+    }
+  }
+  if (allow_avx512 && __builtin_cpu_supports("avx512f")) {
+    dot_f32 = dot_f32_avx512;
+    dot_f16 = dot_f16_avx512;
+    dot_bf16 = dot_bf16_avx512;
+    simd_level = "avx512";
+  }
+#elif defined(__SSE2__)
+  if (allow_sse2) {
+    dot_f32 = dot_f32_sse2;
+    dot_bf16 = dot_bf16_sse2;
+    int8_dot = int8_dot_sse2;
+    simd_level = "sse2";
+  }
+#endif
+  GRN_PLUGIN_LOG(ctx, GRN_LOG_INFO, "[word2vec] SIMD kernels : %s", simd_level);
+}
+
+/* y += sign * x; elementwise, so the compiler vectorizes it without changing results */
+static void
+add_f32(float sign, const float *x, float *y, long long size)
+{
+  long long a;
+  for (a = 0; a < size; a++) y[a] += sign * x[a];
+}
+
+static void
+normalize_row(float *row, long long size)
+{
+  float len = sqrt(dot_f32(row, row, size));
+  long long a;
+  for (a = 0; a < size; a++) row[a] /= len;
+}
+
+static int
+get_default_n_threads(void)
+{
+  long n_processors = sysconf(_SC_NPROCESSORS_ONLN);
+  if (n_processors < 1) {
+    return 1;
+  }
+  if (n_processors > MAX_LOAD_THREADS) {
+    return MAX_LOAD_THREADS;
+  }
+  return (int)n_processors;
+}
+
+static grn_bool
+parse_precision(const char *name, unsigned int name_len, model_precision *precision)
+{
+  if (name_len == 4 && memcmp(name, "fp32", 4) == 0) {
+    *precision = MODEL_PRECISION_FP32;
+  } else if (name_len == 4 && memcmp(name, "fp16", 4) == 0) {
+    *precision = MODEL_PRECISION_FP16;
+  } else if (name_len == 4 && memcmp(name, "bf16", 4) == 0) {
+    *precision = MODEL_PRECISION_BF16;
+  } else if (name_len == 4 && memcmp(name, "int8", 4) == 0) {
+    *precision = MODEL_PRECISION_INT8;
+  } else if (name_len == 2 && memcmp(name, "pq", 2) == 0) {
+    *precision = MODEL_PRECISION_PQ;
+  } else {
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+static const char *
+get_precision_name(model_precision precision)
+{
+  switch (precision) {
+  case MODEL_PRECISION_FP16 :
+    return "fp16";
+  case MODEL_PRECISION_BF16 :
+    return "bf16";
+  case MODEL_PRECISION_INT8 :
+    return "int8";
+  case MODEL_PRECISION_PQ :
+    return "pq";
+  default :
+    return "fp32";
+  }
+}
+
+static grn_bool
+parse_numa_mode(const char *name, unsigned int name_len, numa_mode *mode)
+{
+  if (name_len == 4 && memcmp(name, "none", 4) == 0) {
+    *mode = NUMA_MODE_NONE;
+  } else if (name_len == 10 && memcmp(name, "interleave", 10) == 0) {
+    *mode = NUMA_MODE_INTERLEAVE;
+  } else if (name_len == 9 && memcmp(name, "replicate", 9) == 0) {
+    *mode = NUMA_MODE_REPLICATE;
+  } else {
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+static grn_bool
+parse_pages(const char *name, unsigned int name_len, model_pages *pages)
+{
+  if (name_len == 6 && memcmp(name, "normal", 6) == 0) {
+    *pages = MODEL_PAGES_NORMAL;
+  } else if (name_len == 11 && memcmp(name, "transparent", 11) == 0) {
+    *pages = MODEL_PAGES_TRANSPARENT;
+  } else if (name_len == 7 && memcmp(name, "hugetlb", 7) == 0) {
+    *pages = MODEL_PAGES_HUGETLB;
+  } else {
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+static const char *
+get_pages_name(model_pages pages)
+{
+  switch (pages) {
+  case MODEL_PAGES_TRANSPARENT :
+    return "transparent";
+  case MODEL_PAGES_HUGETLB :
+    return "hugetlb";
+  default :
+    return "normal";
+  }
+}
+
+static grn_bool
+parse_index(const char *name, unsigned int name_len, model_index *index)
+{
+  if (name_len == 4 && memcmp(name, "none", 4) == 0) {
+    *index = MODEL_INDEX_NONE;
+  } else if (name_len == 4 && memcmp(name, "hnsw", 4) == 0) {
+    *index = MODEL_INDEX_HNSW;
+  } else if (name_len == 3 && memcmp(name, "ivf", 3) == 0) {
+    *index = MODEL_INDEX_IVF;
+  } else if (name_len == 3 && memcmp(name, "lsh", 3) == 0) {
+    *index = MODEL_INDEX_LSH;
+  } else {
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+static grn_bool
+parse_search_mode(const char *name, unsigned int name_len, search_mode *mode)
+{
+  if (name_len == 5 && memcmp(name, "exact", 5) == 0) {
+    *mode = SEARCH_MODE_EXACT;
+  } else if (name_len == 4 && memcmp(name, "hnsw", 4) == 0) {
+    *mode = SEARCH_MODE_HNSW;
+  } else if (name_len == 3 && memcmp(name, "ivf", 3) == 0) {
+    *mode = SEARCH_MODE_IVF;
+  } else if (name_len == 3 && memcmp(name, "lsh", 3) == 0) {
+    *mode = SEARCH_MODE_LSH;
+  } else {
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+static const char *
+get_model_index_name(const word2vec_model *model)
+{
+  if (model->hnsw) {
+    return "hnsw";
+  }
+  if (model->ivf) {
+    return "ivf";
+  }
+  if (model->lsh) {
+    return "lsh";
+  }
+  return "none";
+}
+
+/* whether the index was mapped from a saved .hnsw or .ivf file */
+static grn_bool
+model_index_is_mapped(const word2vec_model *model)
+{
+  return (model->hnsw && model->hnsw->map) || (model->ivf && model->ivf->map);
+}
+
+/*
+  Defaults of word2vec_load. GRN_WORD2VEC_SHARED and GRN_WORD2VEC_PRECISION
+  also apply to the implicit load in word2vec_distance.
+*/
+static void
+init_load_option(load_option *option)
+{
+  const char *env;
+
+  option->binary = 1;
+  option->n_threads = get_default_n_threads();
+  option->is_shared = GRN_FALSE;
+  option->precision = MODEL_PRECISION_FP32;
+  option->pq_subspaces = 0;
+  option->max_words = 0;
+  option->query_only_tail = GRN_FALSE;
+  option->numa = NUMA_MODE_NONE;
+  option->pages = MODEL_PAGES_NORMAL;
+  option->lock = GRN_FALSE;
+  option->index = MODEL_INDEX_NONE;
+  option->ivf_lists = 0;
+  option->lsh_tables = 0;
+
+  env = getenv("GRN_WORD2VEC_SHARED");
+  if (env && atoi(env)) {
+    option->is_shared = GRN_TRUE;
+  }
+  env = getenv("GRN_WORD2VEC_PRECISION");
+  if (env) {
+    parse_precision(env, strlen(env), &(option->precision));
+  }
+  env = getenv("GRN_WORD2VEC_MAX_WORDS");
+  if (env) {
+    option->max_words = atoll(env);
+  }
+  env = getenv("GRN_WORD2VEC_NUMA");
+  if (env) {
+    parse_numa_mode(env, strlen(env), &(option->numa));
+  }
+  env = getenv("GRN_WORD2VEC_PAGES");
+  if (env) {
+    parse_pages(env, strlen(env), &(option->pages));
+  }
+  env = getenv("GRN_WORD2VEC_LOCK");
+  if (env && atoi(env)) {
+    option->lock = GRN_TRUE;
+  }
+  env = getenv("GRN_WORD2VEC_INDEX");
+  if (env) {
+    parse_index(env, strlen(env), &(option->index));
+  }
+}
+
+/* dot product of an int8 query (see quantize_row) and an int8 row */
+static inline float
+model_row_dot_int8(const word2vec_model *model, const int8_t *query, float query_scale, long long row)
+{
+  long long size = model->dim_size;
+  return query_scale * model->row_scale[row] *
+    (float)int8_dot(query, model->M8 + row * size, size);
+}
+
+/* ADC lookup: sum of the per-subspace scores of the row's centroids */
+static inline float
+model_row_dot_pq(const word2vec_model *model, const float *table, long long row)
+{
+  int m, n_subspaces = model->pq_subspaces;
+  const uint8_t *code = model->pq_codes + row * n_subspaces;
+  float dist = 0;
+  for (m = 0; m < n_subspaces; m++) dist += table[m * PQ_N_CENTROIDS + code[m]];
+  return dist;
+}
+
+/* table[m][c]: dot product of the query's m-th sub-vector and centroid c */
+static void
+build_pq_table(const word2vec_model *model, const float *vec, float *table)
+{
+  int m, c, n_subspaces = model->pq_subspaces;
+  long long sub_size = model->dim_size / n_subspaces;
+
+  for (m = 0; m < n_subspaces; m++) {
+    const float *x = vec + m * sub_size;
+    for (c = 0; c < PQ_N_CENTROIDS; c++) {
+      const float *y = model->pq_codebook + ((long long)m * PQ_N_CENTROIDS + c) * sub_size;
+      table[m * PQ_N_CENTROIDS + c] = dot_f32(x, y, sub_size);
+    }
+  }
+}
+
+/* element a of a row, widened to fp32 */
+static inline float
+model_value(const word2vec_model *model, long long row, long long a)
+{
+  long long i = a + row * model->dim_size;
+  switch (model->precision) {
+  case MODEL_PRECISION_FP16 :
+    return half_to_float(model->M16[i]);
+  case MODEL_PRECISION_BF16 :
+    return bf16_to_float(model->M16[i]);
+  case MODEL_PRECISION_INT8 :
+    return model->M8[i] * model->row_scale[row];
+  case MODEL_PRECISION_PQ :
+    {
+      long long sub_size = model->dim_size / model->pq_subspaces;
+      long long m = a / sub_size;
+      uint8_t c = model->pq_codes[row * model->pq_subspaces + m];
+      return model->pq_codebook[(m * PQ_N_CENTROIDS + c) * sub_size + a % sub_size];
+    }
+  default :
+    return model->M[i];
+  }
+}
+
+/* dot product of vec and a row with fp32 accumulation */
+static float
+model_row_dot(const word2vec_model *model, const float *vec, long long row)
+{
+  long long a, size = model->dim_size;
+  float dist = 0;
+
+  switch (model->precision) {
+  case MODEL_PRECISION_FP16 :
+    dist = dot_f16(vec, model->M16 + row * size, size);
+    break;
+  case MODEL_PRECISION_BF16 :
+    dist = dot_bf16(vec, model->M16 + row * size, size);
+    break;
+  case MODEL_PRECISION_INT8 :
+    {
+      const int8_t *r = model->M8 + row * size;
+      for (a = 0; a < size; a++) dist += vec[a] * r[a];
+      dist *= model->row_scale[row];
+    }
+    break;
+  case MODEL_PRECISION_PQ :
+    {
+      int m, n_subspaces = model->pq_subspaces;
+      long long sub_size = size / n_subspaces;
+      const uint8_t *code = model->pq_codes + row * n_subspaces;
+      /* sub-vectors are at most PQ_MAX_SUBSPACE_DIM long, too short for dot_f32 */
+      for (m = 0; m < n_subspaces; m++) {
+        const float *x = vec + m * sub_size;
+        const float *y = model->pq_codebook + ((long long)m * PQ_N_CENTROIDS + code[m]) * sub_size;
+        for (a = 0; a < sub_size; a++) dist += x[a] * y[a];
+      }
+    }
+    break;
+  default :
+    dist = dot_f32(vec, model->M + row * size, size);
+    break;
+  }
+  return dist;
+}
+
+/* vec += sign * row, with sign 1 or -1 */
+static void
+add_model_row(const word2vec_model *model, float sign, long long row, float *vec)
+{
+  long long a, size = model->dim_size;
+
+  if (model->precision == MODEL_PRECISION_FP32) {
+    add_f32(sign, model->M + row * size, vec, size);
+    return;
+  }
+  for (a = 0; a < size; a++) vec[a] += sign * model_value(model, row, a);
+}
+
+/* query of a distance scan in the representation the model is scanned in */
+typedef struct {
+  const float *vec;
+  const int8_t *query_int8;
+  float query_scale;
+  const float *pq_table;
+} scan_query;
+
+static int
+get_default_scan_threads(void)
+{
+  const char *env = getenv("GRN_WORD2VEC_SCAN_THREADS");
+  if (env) {
+    return atoi(env);
+  }
+  return get_default_n_threads();
+}
+
+/* a scan is split only into ranges of at least this many rows */
+static long long
+get_scan_rows_per_thread(void)
+{
+  const char *env = getenv("GRN_WORD2VEC_SCAN_ROWS_PER_THREAD");
+  if (env && atoll(env) > 0) {
+    return atoll(env);
+  }
+  return SCAN_ROWS_PER_THREAD;
+}
+
+/* a scored row; position is the order in which rows are scanned */
+typedef struct {
+  float dist;
+  long long position;
+  long long row;
+} scan_result;
+
+/*
+  Bounded heap of the best size results with the worst one at the root.
+  Of two results with the same distance the one scanned first is better,
+  as in a stable sort, so the winners do not depend on how the scan is
+  split.
+*/
+typedef struct {
+  scan_result *results;
+  long long size;
+  long long n;
+} top_k;
+
+static inline grn_bool
+scan_result_is_worse(const scan_result *x, const scan_result *y)
+{
+  return x->dist < y->dist || (x->dist == y->dist && x->position > y->position);
+}
+
+static grn_bool
+top_k_init(grn_ctx *ctx, top_k *top, long long size)
+{
+  top->size = size;
+  top->n = 0;
+  top->results = NULL;
+  if (size > 0) {
+    top->results = (scan_result *)GRN_PLUGIN_MALLOC(ctx, size * sizeof(scan_result));
+    if (top->results == NULL) {
+      return GRN_FALSE;
+    }
+  }
+  return GRN_TRUE;
+}
+
+static void
+top_k_fin(grn_ctx *ctx, top_k *top)
+{
+  if (top->results) {
+    GRN_PLUGIN_FREE(ctx, top->results);
+    top->results = NULL;
+  }
+}
+
+static void
+top_k_sift_down(top_k *top, long long i)
+{
+  scan_result *results = top->results;
+
+  for (;;) {
+    long long child = 2 * i + 1, worst = i;
+    scan_result result;
+    if (child < top->n && scan_result_is_worse(&results[child], &results[worst])) {
+      worst = child;
+    }
+    if (child + 1 < top->n && scan_result_is_worse(&results[child + 1], &results[worst])) {
+      worst = child + 1;
+    }
+    if (worst == i) {
+      break;
+    }
+    result = results[i];
+    results[i] = results[worst];
+    results[worst] = result;
+    i = worst;
+  }
+}
+
+static inline void
+top_k_push(top_k *top, float dist, long long position, long long row)
+{
+  scan_result result;
+  long long i;
+
+  result.dist = dist;
+  result.position = position;
+  result.row = row;
+  if (top->n < top->size) {
+    for (i = top->n++; i > 0 && scan_result_is_worse(&result, &top->results[(i - 1) / 2]);
+         i = (i - 1) / 2) {
+      top->results[i] = top->results[(i - 1) / 2];
+    }
+    top->results[i] = result;
+  } else if (top->size > 0 && scan_result_is_worse(&top->results[0], &result)) {
+    top->results[0] = result;
+    top_k_sift_down(top, 0);
+  }
+}
+
+/* sort the results best first in place (the heap is consumed) */
+static void
+top_k_sort(top_k *top)
+{
+  long long n = top->n;
+
+  while (top->n > 1) {
+    scan_result worst = top->results[0];
+    top->results[0] = top->results[--top->n];
+    top_k_sift_down(top, 0);
+    top->results[top->n] = worst;
+  }
+  top->n = n;
+}
+
+static inline grn_bool
+top_k_accepts(const top_k *top, float dist, long long position)
+{
+  scan_result result;
+
+  if (top->n < top->size) {
+    return GRN_TRUE;
+  }
+  result.dist = dist;
+  result.position = position;
+  return top->size > 0 && scan_result_is_worse(&top->results[0], &result);
+}
+
+/* dists[p - start] = score of row p (rows[p] if rows is not NULL) */
+static void
+score_rows(const word2vec_model *model, const scan_query *query,
+           const long long *rows, long long start, long long end, float *dists)
+{
+  long long p;
+
+  if (query->query_int8) {
+    for (p = start; p < end; p++) {
+      dists[p - start] = model_row_dot_int8(model, query->query_int8, query->query_scale,
+                                            rows ? rows[p] : p);
+    }
+  } else if (query->pq_table) {
+    for (p = start; p < end; p++) {
+      dists[p - start] = model_row_dot_pq(model, query->pq_table, rows ? rows[p] : p);
+    }
+  } else {
+    for (p = start; p < end; p++) {
+      dists[p - start] = model_row_dot(model, query->vec, rows ? rows[p] : p);
+    }
+  }
+}
+
+typedef struct {
+  grn_ctx *ctx;
+  const word2vec_model *model;
+  const scan_query *query;
+  const long long *rows;              /* NULL to scan rows start..end - 1 */
+  long long start;
+  long long end;
+  /* model row of each scanned row when model stores them in another order, or NULL */
+  const uint32_t *row_ids;
+  const long long *skip_rows;
+  int n_skip_rows;
+  float threshold;
+  /* bitmap of the rows that may be kept, or NULL for all */
+  const uint8_t *row_filter;
+  const RE2 *stop_filter;             /* only on the calling thread */
+  top_k *top;
+} scan_arg;
+
+/*
+  Keep a scored row in scan->top if it passes the threshold and
+  row_filter and would enter top. The key is looked up only then and
+  only if stop_filter is set.
+*/
+static inline void
+offer_scan_result(scan_arg *scan, float dist, long long position, long long row)
+{
+  int b;
+
+  if (scan->threshold > 0 && dist < scan->threshold) {
+    return;
+  }
+  if (!top_k_accepts(scan->top, dist, position)) {
+    return;
+  }
+  if (scan->row_filter && !(scan->row_filter[row >> 3] & (1 << (row & 7)))) {
+    return;
+  }
+  for (b = 0; b < scan->n_skip_rows && scan->skip_rows[b] != row; b++) ;
+  if (b < scan->n_skip_rows) {
+    return;
+  }
+  if (scan->stop_filter) {
+    char key_name[GRN_TABLE_MAX_KEY_SIZE];
+    int key_len;
+    key_len = grn_pat_get_key(scan->ctx, scan->model->vocab, row + 1,
+                              key_name, GRN_TABLE_MAX_KEY_SIZE);
+    if (RE2::FullMatch(re2::StringPiece(key_name, key_len), *scan->stop_filter)) {
+      return;
+    }
+  }
+  top_k_push(scan->top, dist, position, row);
+}
+
+/* score a block of rows at a time and offer them in scan order */
+static void *
+scan_partition(void *arg)
+{
+  scan_arg *scan = (scan_arg *)arg;
+  float dists[SCAN_BLOCK_SIZE];
+  long long block, block_end, p;
+
+  for (block = scan->start; block < scan->end; block = block_end) {
+    block_end = block + SCAN_BLOCK_SIZE < scan->end ? block + SCAN_BLOCK_SIZE : scan->end;
+    score_rows(scan->model, scan->query, scan->rows, block, block_end, dists);
+    for (p = block; p < block_end; p++) {
+      long long row = scan->rows ? scan->rows[p] : p;
+      offer_scan_result(scan, dists[p - block], p, scan->row_ids ? scan->row_ids[row] : row);
+    }
+  }
+  return NULL;
+}
+
+/*
+  Score rows[0..n_rows) (rows 0..n_rows - 1 if rows is NULL) into top,
+  split into n_threads consecutive ranges. Each thread keeps its own top
+  and they are merged by scan position, so the result does not depend on
+  n_threads. stop_filter reads keys, so it runs on this thread only.
+*/
+static grn_bool
+scan_rows(grn_ctx *ctx, const word2vec_model *model, const scan_query *query,
+          const long long *rows, long long n_rows, int n_threads,
+          const long long *skip_rows, int n_skip_rows, float threshold,
+          const RE2 *stop_filter, top_k *top)
+{
+  pthread_t threads[MAX_LOAD_THREADS];
+  scan_arg args[MAX_LOAD_THREADS];
+  grn_bool started[MAX_LOAD_THREADS];
+  top_k tops[MAX_LOAD_THREADS];
+  long long rows_per_thread, i;
+  grn_bool succeeded = GRN_TRUE;
+  int t;
+
+  if (n_threads > MAX_LOAD_THREADS) {
+    n_threads = MAX_LOAD_THREADS;
+  }
+  if (n_threads > n_rows) {
+    n_threads = n_rows;
+  }
+  if (n_threads < 1 || stop_filter) {
+    n_threads = 1;
+  }
+  /* the first range goes straight into top */
+  tops[0] = *top;
+  for (t = 1; t < n_threads; t++) {
+    if (!top_k_init(ctx, &tops[t], top->size)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_distance] couldn't allocate scan buffers");
+      n_threads = t;
+      succeeded = GRN_FALSE;
+      break;
+    }
+  }
+
+  rows_per_thread = (n_rows + n_threads - 1) / n_threads;
+  for (t = 0; t < n_threads; t++) {
+    args[t].ctx = ctx;
+    args[t].model = model;
+    args[t].query = query;
+    args[t].rows = rows;
+    args[t].start = t * rows_per_thread < n_rows ? t * rows_per_thread : n_rows;
+    args[t].end = (t + 1) * rows_per_thread < n_rows ? (t + 1) * rows_per_thread : n_rows;
+    args[t].row_ids = NULL;
+    args[t].skip_rows = skip_rows;
+    args[t].n_skip_rows = n_skip_rows;
+    args[t].threshold = threshold;
+    args[t].row_filter = NULL;
+    args[t].stop_filter = stop_filter;
+    args[t].top = &tops[t];
+    /* this thread scans the first range */
+    started[t] = succeeded && t > 0 &&
+      (pthread_create(&threads[t], NULL, scan_partition, &args[t]) == 0);
+  }
+  for (t = 0; t < n_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else if (succeeded) {
+      scan_partition(&args[t]);
+    }
+  }
+
+  *top = tops[0];
+  for (t = 1; t < n_threads; t++) {
+    for (i = 0; i < tops[t].n; i++) {
+      const scan_result *result = &tops[t].results[i];
+      top_k_push(top, result->dist, result->position, result->row);
+    }
+    top_k_fin(ctx, &tops[t]);
+  }
+  return succeeded;
+}
+
+/*
+  Drop the fp32 matrix once it has been quantized. A mapped native model
+  stays mapped (but not resident) so that word2vec_distance can rerank
+  candidates with the exact rows.
+*/
+static void
+release_fp32_matrix(grn_ctx *ctx, word2vec_model *model)
+{
+  if (model->map != NULL) {
+    madvise(model->map, model->map_size, MADV_DONTNEED);
+    madvise(model->map, model->map_size, MADV_RANDOM);
+    model->rerank_matrix = model->M;
+  } else {
+    GRN_PLUGIN_FREE(ctx, model->M);
+  }
+  model->M = NULL;
+}
+
+/* Replace the fp32 matrix with int8 rows and per-row scales. */
+static grn_bool
+quantize_model(grn_ctx *ctx, word2vec_model *model)
+{
+  long long b, words = model->n_words, size = model->dim_size;
+  char *buffer;
+
+  buffer = (char *)GRN_PLUGIN_MALLOC(ctx, words * size + words * sizeof(float));
+  if (buffer == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot allocate matrix : %lld x %lld", words, size);
+    return GRN_FALSE;
+  }
+  model->row_scale = (float *)buffer;
+  model->M8 = (int8_t *)(buffer + words * sizeof(float));
+  for (b = 0; b < words; b++) {
+    model->row_scale[b] = quantize_row(model->M + b * size, size,
+                                           model->M8 + b * size);
+  }
+  model->quantized_buffer = buffer;
+
+  release_fp32_matrix(ctx, model);
+  model->precision = MODEL_PRECISION_INT8;
+  return GRN_TRUE;
+}
+
+/*
+  Number of PQ subspaces for dim_size. 0 picks sub-vectors of up to
+  PQ_MAX_SUBSPACE_DIM dims; an explicit value must divide dim_size.
+  Returns 0 when n_subspaces can't be used.
+*/
+static int
+get_pq_subspaces(long long size, int n_subspaces)
+{
+  long long sub_size;
+
+  if (n_subspaces == 0) {
+    for (sub_size = PQ_MAX_SUBSPACE_DIM; sub_size > 1; sub_size--) {
+      if (size % sub_size == 0) {
+        return (int)(size / sub_size);
+      }
+    }
+    return (int)size;
+  }
+  if (n_subspaces < 0 || n_subspaces > size || size % n_subspaces != 0) {
+    return 0;
+  }
+  return n_subspaces;
+}
+
+typedef struct {
+  const float *matrix;
+  long long words;
+  long long size;
+  int n_subspaces;
+  int first_subspace;
+  int subspace_step;
+  float *codebook;
+  uint8_t *codes;
+  double *sums;      /* scratch: PQ_N_CENTROIDS x sub_size */
+  long long *counts; /* scratch: PQ_N_CENTROIDS */
+} pq_train_arg;
+
+static inline int
+nearest_centroid(const float *x, const float *centroids, int n_centroids, long long sub_size)
+{
+  int c, nearest = 0;
+  float nearest_dist = 0;
+  long long a;
+
+  for (c = 0; c < n_centroids; c++) {
+    const float *y = centroids + c * sub_size;
+    float dist = 0;
+    for (a = 0; a < sub_size; a++) {
+      float d = x[a] - y[a];
+      dist += d * d;
+    }
+    if (c == 0 || dist < nearest_dist) {
+      nearest = c;
+      nearest_dist = dist;
+    }
+  }
+  return nearest;
+}
+
+/*
+  k-means over evenly spaced sample rows for each subspace of the thread,
+  then encode every row of those subspaces
+*/
+static void *
+train_pq_subspaces(void *arg)
+{
+  pq_train_arg *pq = (pq_train_arg *)arg;
+  long long sub_size = pq->size / pq->n_subspaces;
+  long long n_train = pq->words < PQ_TRAIN_SAMPLE ? pq->words : PQ_TRAIN_SAMPLE;
+  int n_centroids = n_train < PQ_N_CENTROIDS ? (int)n_train : PQ_N_CENTROIDS;
+  long long a, b;
+  int m, c, iteration;
+
+  for (m = pq->first_subspace; m < pq->n_subspaces; m += pq->subspace_step) {
+    float *centroids = pq->codebook + (long long)m * PQ_N_CENTROIDS * sub_size;
+    const float *sub_matrix = pq->matrix + m * sub_size;
+
+    memset(centroids, 0, PQ_N_CENTROIDS * sub_size * sizeof(float));
+    for (c = 0; c < n_centroids; c++) {
+      b = (long long)c * n_train / n_centroids * pq->words / n_train;
+      memcpy(centroids + c * sub_size, sub_matrix + b * pq->size, sub_size * sizeof(float));
+    }
+    for (iteration = 0; iteration < PQ_KMEANS_ITERATIONS; iteration++) {
+      memset(pq->sums, 0, n_centroids * sub_size * sizeof(double));
+      memset(pq->counts, 0, n_centroids * sizeof(long long));
+      for (b = 0; b < n_train; b++) {
+        const float *x = sub_matrix + (b * pq->words / n_train) * pq->size;
+        c = nearest_centroid(x, centroids, n_centroids, sub_size);
+        for (a = 0; a < sub_size; a++) pq->sums[c * sub_size + a] += x[a];
+        pq->counts[c]++;
+      }
+      /* an empty cluster keeps its previous centroid */
+      for (c = 0; c < n_centroids; c++) {
+        if (pq->counts[c] == 0) continue;
+        for (a = 0; a < sub_size; a++) {
+          centroids[c * sub_size + a] = pq->sums[c * sub_size + a] / pq->counts[c];
+        }
+      }
+    }
+    for (b = 0; b < pq->words; b++) {
+      pq->codes[b * pq->n_subspaces + m] =
+        nearest_centroid(sub_matrix + b * pq->size, centroids, n_centroids, sub_size);
+    }
+  }
+  return NULL;
+}
+
+/*
+  Train a product quantizer for matrix and encode its rows. Subspaces are
+  trained independently, so they are spread over n_threads threads.
+*/
+static grn_bool
+train_pq(grn_ctx *ctx, const float *matrix, long long words, long long size,
+         int n_subspaces, int n_threads, float *codebook, uint8_t *codes)
+{
+  pthread_t threads[MAX_LOAD_THREADS];
+  pq_train_arg args[MAX_LOAD_THREADS];
+  grn_bool started[MAX_LOAD_THREADS];
+  grn_bool succeeded = GRN_TRUE;
+  long long sub_size = size / n_subspaces;
+  int t;
+
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  if (n_threads > MAX_LOAD_THREADS) {
+    n_threads = MAX_LOAD_THREADS;
+  }
+  if (n_threads > n_subspaces) {
+    n_threads = n_subspaces;
+  }
+  for (t = 0; t < n_threads; t++) {
+    args[t].matrix = matrix;
+    args[t].words = words;
+    args[t].size = size;
+    args[t].n_subspaces = n_subspaces;
+    args[t].first_subspace = t;
+    args[t].subspace_step = n_threads;
+    args[t].codebook = codebook;
+    args[t].codes = codes;
+    args[t].sums = (double *)GRN_PLUGIN_MALLOC(ctx, PQ_N_CENTROIDS * sub_size * sizeof(double));
+    args[t].counts = (long long *)GRN_PLUGIN_MALLOC(ctx, PQ_N_CENTROIDS * sizeof(long long));
+    if (args[t].sums == NULL || args[t].counts == NULL) {
+      succeeded = GRN_FALSE;
+    }
+  }
+  if (succeeded) {
+    for (t = 0; t < n_threads; t++) {
+      started[t] = (pthread_create(&threads[t], NULL, train_pq_subspaces, &args[t]) == 0);
+    }
+    for (t = 0; t < n_threads; t++) {
+      if (started[t]) {
+        pthread_join(threads[t], NULL);
+      } else {
+        train_pq_subspaces(&args[t]);
+      }
+    }
+  } else {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] Cannot allocate k-means buffers");
+  }
+  for (t = 0; t < n_threads; t++) {
+    if (args[t].sums) {
+      GRN_PLUGIN_FREE(ctx, args[t].sums);
+    }
+    if (args[t].counts) {
+      GRN_PLUGIN_FREE(ctx, args[t].counts);
+    }
+  }
+  return succeeded;
+}
+
+/* Replace the fp32 matrix with PQ codes and a codebook trained on it. */
+static grn_bool
+pq_quantize_model(grn_ctx *ctx, word2vec_model *model, int n_subspaces, int n_threads)
+{
+  long long words = model->n_words, size = model->dim_size;
+  size_t codebook_size;
+  char *buffer;
+
+  n_subspaces = get_pq_subspaces(size, n_subspaces);
+  if (n_subspaces == 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "pq_subspaces must divide the dimension : %lld", size);
+    return GRN_FALSE;
+  }
+  codebook_size = PQ_N_CENTROIDS * size * sizeof(float);
+  buffer = (char *)GRN_PLUGIN_MALLOC(ctx, codebook_size + words * n_subspaces);
+  if (buffer == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot allocate matrix : %lld x %d", words, n_subspaces);
+    return GRN_FALSE;
+  }
+  if (!train_pq(ctx, model->M, words, size, n_subspaces, n_threads,
+                (float *)buffer, (uint8_t *)(buffer + codebook_size))) {
+    GRN_PLUGIN_FREE(ctx, buffer);
+    return GRN_FALSE;
+  }
+  model->pq_codebook = (float *)buffer;
+  model->pq_codes = (uint8_t *)(buffer + codebook_size);
+  model->pq_subspaces = n_subspaces;
+  model->quantized_buffer = buffer;
+
+  release_fp32_matrix(ctx, model);
+  model->precision = MODEL_PRECISION_PQ;
+  return GRN_TRUE;
+}
+
+/* replace the fp32 matrix of a loaded model by 16-bit or int8 rows */
+static grn_bool
+reduce_model_precision(grn_ctx *ctx, word2vec_model *model, load_option option)
+{
+  model_precision new_precision = option.precision;
+  long long i, n_elements;
+  uint16_t *matrix;
+
+  if (new_precision == MODEL_PRECISION_FP32) {
+    return GRN_TRUE;
+  }
+  if (model->precision != MODEL_PRECISION_FP32) {
+    /* already quantized by word2vec_convert */
+    return GRN_TRUE;
+  }
+  if (new_precision == MODEL_PRECISION_INT8) {
+    return quantize_model(ctx, model);
+  }
+  if (new_precision == MODEL_PRECISION_PQ) {
+    return pq_quantize_model(ctx, model, option.pq_subspaces, option.n_threads);
+  }
+  n_elements = model->n_words * model->dim_size;
+  matrix = (uint16_t *)GRN_PLUGIN_MALLOC(ctx, n_elements * sizeof(uint16_t));
+  if (matrix == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot allocate matrix : %lld x %lld",
+                   model->n_words, model->dim_size);
+    return GRN_FALSE;
+  }
+  if (new_precision == MODEL_PRECISION_FP16) {
+    for (i = 0; i < n_elements; i++) matrix[i] = float_to_half(model->M[i]);
+  } else {
+    for (i = 0; i < n_elements; i++) matrix[i] = float_to_bf16(model->M[i]);
+  }
+
+  if (model->map != NULL) {
+    munmap(model->map, model->map_size);
+    model->map = NULL;
+    model->map_size = 0;
+  } else {
+    GRN_PLUGIN_FREE(ctx, model->M);
+  }
+  model->M = NULL;
+  model->M16 = matrix;
+  model->precision = new_precision;
+  return GRN_TRUE;
+}
+
+/* bytes of rows held in memory; the vocab is not counted */
+static size_t
+get_model_memory_size(const word2vec_model *model)
+{
+  size_t n_elements = model->n_words * model->dim_size;
+
+  switch (model->precision) {
+  case MODEL_PRECISION_FP16 :
+  case MODEL_PRECISION_BF16 :
+    return n_elements * sizeof(uint16_t);
+  case MODEL_PRECISION_INT8 :
+    return n_elements + model->n_words * sizeof(float);
+  case MODEL_PRECISION_PQ :
+    return PQ_N_CENTROIDS * model->dim_size * sizeof(float) +
+      model->n_words * model->pq_subspaces;
+  default :
+    return n_elements * sizeof(float);
+  }
+}
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/*
+  Anonymous mapping for rows. MODEL_PAGES_HUGETLB falls back to
+  transparent huge pages when no huge page is reserved, and
+  MODEL_PAGES_TRANSPARENT to normal pages when THP is disabled; *pages is
+  set to what was used. With huge pages *map_size is rounded up to
+  HUGE_PAGE_SIZE whatever the fallback, so copies of the same rows can
+  share one size.
+*/
+static void *
+map_rows(size_t size, model_pages *pages, size_t *map_size)
+{
+  void *map;
+
+  *map_size = size;
+  if (*pages != MODEL_PAGES_NORMAL) {
+    *map_size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+  }
+  if (*pages == MODEL_PAGES_HUGETLB) {
+#ifdef MAP_HUGETLB
+    map = mmap(NULL, *map_size, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    if (map != MAP_FAILED) {
+      return map;
+    }
+#endif
+    *pages = MODEL_PAGES_TRANSPARENT;
+  }
+  map = mmap(NULL, *map_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  if (*pages == MODEL_PAGES_TRANSPARENT) {
+    /* only the 2MB aligned part can get huge pages; it is most of a large matrix */
+#ifdef MADV_HUGEPAGE
+    if (madvise(map, *map_size, MADV_HUGEPAGE) != 0) {
+      *pages = MODEL_PAGES_NORMAL;
+    }
+#else
+    *pages = MODEL_PAGES_NORMAL;
+#endif
+  }
+  return map;
+}
+
+/*
+  NUMA nodes read from sysfs (GRN_WORD2VEC_NUMA_NODE_DIR overrides
+  /sys/devices/system/node). Only nodes with CPUs are listed;
+  numa_cpu_nodes[cpu] is the index of the node of a CPU in numa_node_cpus.
+*/
+#define NUMA_MAX_NODES 64
+#define NUMA_STRIPE_SIZE HUGE_PAGE_SIZE
+
+static int n_numa_nodes = 0;
+static cpu_set_t numa_node_cpus[NUMA_MAX_NODES];
+static int numa_cpu_nodes[CPU_SETSIZE];
+static pthread_once_t numa_nodes_once = PTHREAD_ONCE_INIT;
+
+/* parse a sysfs list such as "0-3,8-11" */
+static grn_bool
+read_sysfs_list(const char *path, cpu_set_t *set)
+{
+  FILE *f;
+  char list[4096];
+  char *p, *end;
+  long first, last;
+
+  CPU_ZERO(set);
+  f = fopen(path, "r");
+  if (f == NULL) {
+    return GRN_FALSE;
+  }
+  p = fgets(list, sizeof(list), f);
+  fclose(f);
+  while (p != NULL && *p != '\0' && *p != '\n') {
+    first = strtol(p, &end, 10);
+    if (end == p || first < 0) {
+      return GRN_FALSE;
+    }
+    last = first;
+    if (*end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first) {
+        return GRN_FALSE;
+      }
+    }
+    for (; first <= last && first < CPU_SETSIZE; first++) {
+      CPU_SET(first, set);
+    }
+    p = (*end == ',') ? end + 1 : end;
+  }
+  return GRN_TRUE;
+}
+
+static void
+discover_numa_nodes(void)
+{
+  const char *dir;
+  char path[PATH_MAX];
+  cpu_set_t online;
+  int node, cpu;
+
+  dir = getenv("GRN_WORD2VEC_NUMA_NODE_DIR");
+  if (dir == NULL) {
+    dir = "/sys/devices/system/node";
+  }
+  snprintf(path, sizeof(path), "%s/online", dir);
+  if (!read_sysfs_list(path, &online)) {
+    return;
+  }
+  for (node = 0; node < CPU_SETSIZE && n_numa_nodes < NUMA_MAX_NODES; node++) {
+    cpu_set_t *cpus = &numa_node_cpus[n_numa_nodes];
+    if (!CPU_ISSET(node, &online)) {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/node%d/cpulist", dir, node);
+    if (!read_sysfs_list(path, cpus) || CPU_COUNT(cpus) == 0) {
+      continue;
+    }
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+      if (CPU_ISSET(cpu, cpus)) {
+        numa_cpu_nodes[cpu] = n_numa_nodes;
+      }
+    }
+    n_numa_nodes++;
+  }
+}
+
+/* the rows word2vec_distance scans, in the precision of the model */
+static void *
+get_scan_rows(const word2vec_model *model, size_t *size)
+{
+  size_t n_elements = model->n_candidates * model->dim_size;
+
+  switch (model->precision) {
+  case MODEL_PRECISION_FP16 :
+  case MODEL_PRECISION_BF16 :
+    *size = n_elements * sizeof(uint16_t);
+    return model->M16;
+  case MODEL_PRECISION_INT8 :
+    *size = n_elements;
+    return model->M8;
+  case MODEL_PRECISION_PQ :
+    *size = model->n_candidates * model->pq_subspaces;
+    return model->pq_codes;
+  default :
+    *size = n_elements * sizeof(float);
+    return model->M;
+  }
+}
+
+static void
+set_scan_rows(word2vec_model *model, void *rows)
+{
+  switch (model->precision) {
+  case MODEL_PRECISION_FP16 :
+  case MODEL_PRECISION_BF16 :
+    model->M16 = (uint16_t *)rows;
+    break;
+  case MODEL_PRECISION_INT8 :
+    model->M8 = (int8_t *)rows;
+    break;
+  case MODEL_PRECISION_PQ :
+    model->pq_codes = (uint8_t *)rows;
+    break;
+  default :
+    model->M = (float *)rows;
+    break;
+  }
+}
+
+/* the copy of rows (see copy_numa_rows) nearest to the CPU of the calling thread */
+static void *
+get_local_numa_rows(void **copies, int n_copies)
+{
+  int cpu, node = 0;
+
+  if (n_copies > 1) {
+    cpu = sched_getcpu();
+    if (cpu >= 0 && cpu < CPU_SETSIZE) {
+      node = numa_cpu_nodes[cpu];
+    }
+  }
+  return copies[node];
+}
+
+typedef struct {
+  const char *src;
+  char *dest;
+  size_t size;
+  int node;
+  /* copy every n_stripe_nodes-th stripe starting at stripe node (1: all) */
+  int n_stripe_nodes;
+} numa_copy_arg;
+
+static void
+copy_rows(const numa_copy_arg *copy)
+{
+  size_t offset, length;
+
+  if (copy->n_stripe_nodes == 1) {
+    memcpy(copy->dest, copy->src, copy->size);
+    return;
+  }
+  for (offset = (size_t)copy->node * NUMA_STRIPE_SIZE; offset < copy->size;
+       offset += (size_t)copy->n_stripe_nodes * NUMA_STRIPE_SIZE) {
+    length = copy->size - offset;
+    if (length > NUMA_STRIPE_SIZE) {
+      length = NUMA_STRIPE_SIZE;
+    }
+    memcpy(copy->dest + offset, copy->src + offset, length);
+  }
+}
+
+/*
+  Copy from a thread bound to the CPUs of the node, so that the default
+  first-touch policy allocates the pages on that node.
+*/
+static void *
+copy_rows_on_node(void *arg)
+{
+  numa_copy_arg *copy = (numa_copy_arg *)arg;
+
+  pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+                         &numa_node_cpus[copy->node]);
+  copy_rows(copy);
+  return NULL;
+}
+
+/*
+  Copy size bytes of rows to the NUMA nodes: replicate copies them once
+  per node, interleave copies them once in stripes spread over the
+  nodes. The copies are backed by *pages, which is set to the smallest
+  pages used. Returns NULL with *n_copies 0 on a single node machine or
+  when the copies cannot be allocated.
+*/
+static void **
+copy_numa_rows(grn_ctx *ctx, const char *rows, size_t size, numa_mode mode,
+               model_pages *pages, int *n_copies, size_t *copy_size)
+{
+  pthread_t threads[NUMA_MAX_NODES];
+  numa_copy_arg args[NUMA_MAX_NODES];
+  grn_bool started[NUMA_MAX_NODES];
+  void **copies;
+  size_t map_size = 0;
+  model_pages copy_pages = *pages;
+  int i, n;
+
+  *n_copies = 0;
+  pthread_once(&numa_nodes_once, discover_numa_nodes);
+  if (n_numa_nodes < 2 || rows == NULL || size == 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_DEBUG,
+                   "[word2vec_load] "
+                   "NUMA placement is skipped: %d node(s)", n_numa_nodes);
+    return NULL;
+  }
+
+  n = (mode == NUMA_MODE_REPLICATE) ? n_numa_nodes : 1;
+  copies = (void **)GRN_PLUGIN_MALLOC(ctx, n * sizeof(void *));
+  if (copies == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] "
+                   "Cannot allocate NUMA copies of rows");
+    return NULL;
+  }
+  for (i = 0; i < n; i++) {
+    model_pages used_pages = *pages;
+    void *copy = map_rows(size, &used_pages, &map_size);
+    if (copy == NULL) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                     "[word2vec_load] "
+                     "Cannot allocate NUMA copies of rows : %s", strerror(errno));
+      for (i--; i >= 0; i--) {
+        munmap(copies[i], map_size);
+      }
+      GRN_PLUGIN_FREE(ctx, copies);
+      return NULL;
+    }
+    if (used_pages < copy_pages) {
+      copy_pages = used_pages;
+    }
+    copies[i] = copy;
+  }
+  *n_copies = n;
+  *copy_size = map_size;
+  *pages = copy_pages;
+
+  for (i = 0; i < n_numa_nodes; i++) {
+    args[i].src = rows;
+    args[i].dest = (char *)copies[mode == NUMA_MODE_REPLICATE ? i : 0];
+    args[i].size = size;
+    args[i].node = i;
+    args[i].n_stripe_nodes = (mode == NUMA_MODE_REPLICATE) ? 1 : n_numa_nodes;
+    started[i] = (pthread_create(&threads[i], NULL, copy_rows_on_node, &args[i]) == 0);
+  }
+  for (i = 0; i < n_numa_nodes; i++) {
+    if (started[i]) {
+      pthread_join(threads[i], NULL);
+    } else {
+      copy_rows(&args[i]);
+    }
+  }
+  return copies;
+}
+
+/*
+  Place the scanned rows on the NUMA nodes (see copy_numa_rows);
+  word2vec_distance scans the copy of the node it runs on. Nothing is
+  done on a single node machine. The original rows stay for query
+  vectors and reranking. The copies are backed by the given pages.
+*/
+static void
+place_model_rows(grn_ctx *ctx, word2vec_model *model, numa_mode mode, model_pages pages)
+{
+  const char *rows;
+  size_t size;
+
+  if (mode == NUMA_MODE_NONE) {
+    return;
+  }
+  rows = (const char *)get_scan_rows(model, &size);
+  model->numa_rows = copy_numa_rows(ctx, rows, size, mode, &pages,
+                                    &(model->n_numa_rows), &(model->numa_rows_size));
+  if (model->numa_rows != NULL) {
+    model->pages = pages;
+  }
+}
+
+/* the heap allocation holding the scanned rows, or NULL when they are mapped */
+static void *
+get_heap_rows(const word2vec_model *model)
+{
+  if (model->quantized_buffer != NULL) {
+    return model->quantized_buffer;
+  }
+  if (model->map != NULL) {
+    return NULL;
+  }
+  if (model->M16 != NULL) {
+    return model->M16;
+  }
+  return model->M;
+}
+
+#define REBASE_ROWS(pointer, type) do {                                  \
+  if ((char *)(pointer) >= (char *)heap_rows &&                          \
+      (char *)(pointer) < (char *)heap_rows + size) {                    \
+    (pointer) = (type)(map + ((char *)(pointer) - (char *)heap_rows));   \
+  }                                                                      \
+} while (0)
+
+/*
+  Move the heap rows to a mapping backed by huge pages (see map_rows).
+  Rows mapped from a native model file or shared memory stay in the
+  page cache with normal pages.
+*/
+static void
+back_model_rows(grn_ctx *ctx, word2vec_model *model, model_pages pages)
+{
+  void *heap_rows;
+  char *map;
+  size_t size;
+
+  if (pages == MODEL_PAGES_NORMAL) {
+    return;
+  }
+  heap_rows = get_heap_rows(model);
+  if (heap_rows == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_INFO,
+                   "[word2vec_load] "
+                   "Mapped rows are kept on normal pages");
+    return;
+  }
+  size = get_model_memory_size(model);
+  map = (char *)map_rows(size, &pages, &(model->rows_map_size));
+  if (map == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] "
+                   "Cannot map rows on huge pages : %s", strerror(errno));
+    return;
+  }
+  memcpy(map, heap_rows, size);
+  REBASE_ROWS(model->M, float *);
+  REBASE_ROWS(model->M16, uint16_t *);
+  REBASE_ROWS(model->M8, int8_t *);
+  REBASE_ROWS(model->row_scale, float *);
+  REBASE_ROWS(model->pq_codes, uint8_t *);
+  REBASE_ROWS(model->pq_codebook, float *);
+  GRN_PLUGIN_FREE(ctx, heap_rows);
+  if (heap_rows == model->quantized_buffer) {
+    model->quantized_buffer = NULL;
+  }
+  model->rows_map = map;
+  model->pages = pages;
+}
+
+#undef REBASE_ROWS
+
+/*
+  mlock() the scanned rows (and the NUMA copies) so that they are never
+  swapped out. Fails without CAP_IPC_LOCK when RLIMIT_MEMLOCK is too low.
+*/
+static void
+lock_model_rows(grn_ctx *ctx, word2vec_model *model)
+{
+  size_t size;
+  void *rows;
+  int i;
+  grn_bool locked;
+
+  rows = get_scan_rows(model, &size);
+  locked = (rows != NULL && mlock(rows, size) == 0);
+  if (locked && model->precision == MODEL_PRECISION_INT8) {
+    locked = (mlock(model->row_scale, model->n_words * sizeof(float)) == 0);
+  } else if (locked && model->precision == MODEL_PRECISION_PQ) {
+    locked = (mlock(model->pq_codebook,
+                    PQ_N_CENTROIDS * model->dim_size * sizeof(float)) == 0);
+  }
+  for (i = 0; locked && i < model->n_numa_rows; i++) {
+    locked = (mlock(model->numa_rows[i], model->numa_rows_size) == 0);
+  }
+  if (!locked) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] "
+                   "Cannot lock rows in memory : %s", strerror(errno));
+  }
+  model->locked = locked;
+}
+
+static grn_pat *
+create_vocab(grn_ctx *ctx)
+{
+  grn_pat *model_vocab;
+  model_vocab = grn_pat_create(ctx, NULL,
+                               GRN_TABLE_MAX_KEY_SIZE,
+                               0,
+                               GRN_OBJ_TABLE_PAT_KEY|GRN_OBJ_KEY_VAR_SIZE);
+  if (model_vocab == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot create vocab table");
+  }
+  return model_vocab;
+}
+
+/* a words x size header is accepted only if the float matrix size fits in size_t */
+static grn_bool
+model_size_is_valid(long long words, long long size)
+{
+  return words > 0 && size > 0 &&
+         (unsigned long long)words <= SIZE_MAX / sizeof(float) / (unsigned long long)size;
+}
+
+/*
+  Rows of a words-row model to hold in the matrix: the first max_rows
+  (word2vec_load --max_words) or all of them when max_rows is 0.
+*/
+static long long
+get_matrix_rows(long long words, long long max_rows)
+{
+  return (max_rows > 0 && max_rows < words) ? max_rows : words;
+}
+
+/*
+  Read a model in the original word2vec text format with fscanf(). Kept for
+  comparison with read_text_model(); set GRN_WORD2VEC_TEXT_LOADER=fscanf to
+  use it.
+*/
+static grn_bool
+read_text_model_fscanf(grn_ctx *ctx, FILE *f, grn_pat *model_vocab, long long max_rows,
+                       long long *n_words_p, long long *dim_size_p,
+                       float **matrix_p)
+{
+  long long a, b;
+  long long words = 0, size = 0, matrix_rows;
+  float *matrix;
+
+  *matrix_p = NULL;
+
+  if (fscanf(f, "%lld", &words) != 1 || fscanf(f, "%lld", &size) != 1 ||
+      !model_size_is_valid(words, size)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Broken model header");
+    return GRN_FALSE;
+  }
+  matrix_rows = get_matrix_rows(words, max_rows);
+  matrix = (float *)GRN_PLUGIN_MALLOC(ctx, matrix_rows * size * sizeof(float));
+  if (matrix == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot allocate matrix : %lld x %lld", words, size);
+    return GRN_FALSE;
+  }
+
+  for (b = 0; b < words; b++) {
+    char format[20];
+    char word[max_length_of_vocab_word];
+    if (b >= matrix_rows && !model_vocab) {
+      break;
+    }
+    sprintf(format,"%%%llds",max_length_of_vocab_word - 1);
+    fscanf(f, format, word);
+    if (model_vocab &&
+        !grn_pat_add(ctx, model_vocab, word, strlen(word), NULL, NULL)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Faild load vocab");
+      GRN_PLUGIN_FREE(ctx, matrix);
+      return GRN_FALSE;
+    }
+    if (b >= matrix_rows) {
+      /* only the key of a row beyond max_rows is needed */
+      fscanf(f, "%*[^\n]");
+      continue;
+    }
+    for (a = 0; a < size; a++) {
+      fscanf(f, "%f", &matrix[a + b * size]);
+    }
+    normalize_row(matrix + b * size, size);
+  }
+
+  *n_words_p = matrix_rows;
+  *dim_size_p = size;
+  *matrix_p = matrix;
+  return GRN_TRUE;
+}
+
+typedef struct {
+  const char *data;
+  const uint64_t *key_starts;
+  const uint32_t *key_lens;
+  float *matrix;
+  long long size;
+  long long start;
+  long long end;
+} binary_rows_arg;
+
+static void *
+copy_binary_rows(void *arg)
+{
+  binary_rows_arg *rows = (binary_rows_arg *)arg;
+  long long b;
+  for (b = rows->start; b < rows->end; b++) {
+    float *row = rows->matrix + b * rows->size;
+    memcpy(row,
+           rows->data + rows->key_starts[b] + rows->key_lens[b] + 1,
+           rows->size * sizeof(float));
+    normalize_row(row, rows->size);
+  }
+  return NULL;
+}
+
+static const char *
+parse_header_number(const char *p, const char *end, long long *value)
+{
+  *value = 0;
+  while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+  if (p == end || *p < '0' || *p > '9') {
+    return NULL;
+  }
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (*value > (LLONG_MAX - (*p - '0')) / 10) {
+      return NULL;
+    }
+    *value = *value * 10 + (*p - '0');
+    p++;
+  }
+  return p;
+}
+
+/*
+  Read a model in the original word2vec binary format. The file is mapped
+  and record boundaries ("key" ' ' float[size]) are found in one pass, then
+  rows are copied and normalized by n_threads threads while this thread
+  fills model_vocab (if given) in row order.
+*/
+static grn_bool
+read_binary_model(grn_ctx *ctx, FILE *f, int n_threads, grn_pat *model_vocab,
+                  long long max_rows, long long *n_words_p, long long *dim_size_p,
+                  float **matrix_p)
+{
+  struct stat st;
+  void *map;
+  const char *data, *p, *end;
+  long long words = 0, size = 0, matrix_rows, n_keys;
+  long long b, rows_per_thread;
+  uint64_t *key_starts = NULL;
+  uint32_t *key_lens = NULL;
+  float *matrix = NULL;
+  pthread_t threads[MAX_LOAD_THREADS];
+  binary_rows_arg args[MAX_LOAD_THREADS];
+  grn_bool started[MAX_LOAD_THREADS];
+  grn_bool succeeded = GRN_FALSE;
+  int t;
+
+  *matrix_p = NULL;
+
+  if (fstat(fileno(f), &st) == -1 || st.st_size == 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Cannot stat model file");
+    return GRN_FALSE;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (map == MAP_FAILED) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Cannot mmap model file");
+    return GRN_FALSE;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  data = (const char *)map;
+  end = data + st.st_size;
+
+  p = parse_header_number(data, end, &words);
+  if (p) {
+    p = parse_header_number(p, end, &size);
+  }
+  if (!p || !model_size_is_valid(words, size)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Broken model header");
+    goto exit;
+  }
+  matrix_rows = get_matrix_rows(words, max_rows);
+  /* keys beyond matrix_rows are only read to fill model_vocab */
+  n_keys = model_vocab ? words : matrix_rows;
+
+  key_starts = (uint64_t *)GRN_PLUGIN_MALLOC(ctx, n_keys * sizeof(uint64_t));
+  key_lens = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, n_keys * sizeof(uint32_t));
+  matrix = (float *)GRN_PLUGIN_MALLOC(ctx, matrix_rows * size * sizeof(float));
+  if (key_starts == NULL || key_lens == NULL || matrix == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot allocate matrix : %lld x %lld", words, size);
+    goto exit;
+  }
+
+  for (b = 0; b < n_keys; b++) {
+    const char *key_end;
+    while (p < end && *p == '\n') p++;
+    key_end = (const char *)memchr(p, ' ', end - p);
+    if (key_end == NULL || (uint64_t)(end - key_end - 1) < size * sizeof(float)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_load] "
+                     "Truncated model file at row %lld", b);
+      goto exit;
+    }
+    key_starts[b] = p - data;
+    key_lens[b] = key_end - p;
+    p = key_end + 1 + size * sizeof(float);
+  }
+
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  if (n_threads > MAX_LOAD_THREADS) {
+    n_threads = MAX_LOAD_THREADS;
+  }
+  if (n_threads > matrix_rows) {
+    n_threads = matrix_rows;
+  }
+  rows_per_thread = (matrix_rows + n_threads - 1) / n_threads;
+  for (t = 0; t < n_threads; t++) {
+    args[t].data = data;
+    args[t].key_starts = key_starts;
+    args[t].key_lens = key_lens;
+    args[t].matrix = matrix;
+    args[t].size = size;
+    args[t].start = t * rows_per_thread;
+    args[t].end = (t + 1) * rows_per_thread < matrix_rows ?
+      (t + 1) * rows_per_thread : matrix_rows;
+    started[t] = (pthread_create(&threads[t], NULL, copy_binary_rows, &args[t]) == 0);
+  }
+
+  succeeded = GRN_TRUE;
+  for (b = 0; model_vocab && b < words; b++) {
+    if (!grn_pat_add(ctx, model_vocab, data + key_starts[b], key_lens[b], NULL, NULL)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Faild load vocab");
+      succeeded = GRN_FALSE;
+      break;
+    }
+  }
+
+  for (t = 0; t < n_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      copy_binary_rows(&args[t]);
+    }
+  }
+
+exit :
+  munmap(map, st.st_size);
+  if (key_starts) {
+    GRN_PLUGIN_FREE(ctx, key_starts);
+  }
+  if (key_lens) {
+    GRN_PLUGIN_FREE(ctx, key_lens);
+  }
+  if (!succeeded) {
+    if (matrix) {
+      GRN_PLUGIN_FREE(ctx, matrix);
+    }
+    return GRN_FALSE;
+  }
+
+  *n_words_p = matrix_rows;
+  *dim_size_p = size;
+  *matrix_p = matrix;
+  return GRN_TRUE;
+}
+
+static inline grn_bool
+is_text_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static const float float_powers_of_ten[] = {
+  1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+/*
+  Parse a decimal float such as "-0.012345" or "1.5e-3". Values with up to
+  24 bits of mantissa and an exponent within 1e10 are exact in float, so
+  one float multiply or divide rounds correctly; anything else falls back
+  to strtof() to keep results identical to fscanf("%f").
+*/
+static const char *
+parse_text_float(const char *p, const char *end, float *value)
+{
+  const char *start;
+  grn_bool negative = GRN_FALSE;
+  uint64_t mantissa = 0;
+  int n_digits = 0;
+  int exponent = 0;
+
+  while (p < end && (*p == ' ' || *p == '\t')) p++;
+  start = p;
+  if (p < end && (*p == '-' || *p == '+')) {
+    negative = (*p == '-');
+    p++;
+  }
+  while (p < end && *p >= '0' && *p <= '9') {
+    if (mantissa < ((uint64_t)1 << 60)) {
+      mantissa = mantissa * 10 + (*p - '0');
+    } else {
+      exponent++;
+    }
+    n_digits++;
+    p++;
+  }
+  if (p < end && *p == '.') {
+    p++;
+    while (p < end && *p >= '0' && *p <= '9') {
+      if (mantissa < ((uint64_t)1 << 60)) {
+        mantissa = mantissa * 10 + (*p - '0');
+        exponent--;
+      }
+      n_digits++;
+      p++;
+    }
+  }
+  if (n_digits == 0) {
+    return NULL;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    const char *q = p + 1;
+    grn_bool negative_exponent = GRN_FALSE;
+    int e = 0;
+    if (q < end && (*q == '-' || *q == '+')) {
+      negative_exponent = (*q == '-');
+      q++;
+    }
+    if (q < end && *q >= '0' && *q <= '9') {
+      while (q < end && *q >= '0' && *q <= '9') {
+        if (e < 10000) {
+          e = e * 10 + (*q - '0');
+        }
+        q++;
+      }
+      exponent += negative_exponent ? -e : e;
+      p = q;
+    }
+  }
+
+  if (mantissa <= ((uint64_t)1 << 24) && exponent >= -10 && exponent <= 10) {
+    float f = (float)mantissa;
+    if (exponent < 0) {
+      f /= float_powers_of_ten[-exponent];
+    } else {
+      f *= float_powers_of_ten[exponent];
+    }
+    *value = negative ? -f : f;
+  } else {
+    char buf[64];
+    size_t len = p - start;
+    if (len >= sizeof(buf)) {
+      return NULL;
+    }
+    memcpy(buf, start, len);
+    buf[len] = '\0';
+    *value = strtof(buf, NULL);
+  }
+  return p;
+}
+
+typedef struct {
+  const char *begin;
+  const char *end;
+  long long first_row;
+  long long n_rows;
+  /* rows to read: all of them when keys is set, else matrix_rows */
+  long long words;
+  /* rows parsed into matrix; only the keys of the others are recorded */
+  long long matrix_rows;
+  long long size;
+  /* keys of every row for a vocab being filled, or NULL */
+  const char **keys;
+  uint32_t *key_lens;
+  float *matrix;
+  grn_bool failed;
+} text_chunk_arg;
+
+static const char *
+next_text_row(const char *p, const char *end)
+{
+  while (p < end && is_text_space(*p)) p++;
+  return p;
+}
+
+static void *
+count_text_rows(void *arg)
+{
+  text_chunk_arg *chunk = (text_chunk_arg *)arg;
+  const char *p = chunk->begin;
+  long long n_rows = 0;
+  while ((p = next_text_row(p, chunk->end)) < chunk->end) {
+    const char *eol = (const char *)memchr(p, '\n', chunk->end - p);
+    n_rows++;
+    p = eol ? eol + 1 : chunk->end;
+  }
+  chunk->n_rows = n_rows;
+  return NULL;
+}
+
+static void *
+parse_text_rows(void *arg)
+{
+  text_chunk_arg *chunk = (text_chunk_arg *)arg;
+  const char *p = chunk->begin;
+  long long b = chunk->first_row;
+  long long a;
+
+  while (b < chunk->words && (p = next_text_row(p, chunk->end)) < chunk->end) {
+    const char *key = p;
+    float *row = chunk->matrix + b * chunk->size;
+    while (p < chunk->end && !is_text_space(*p)) p++;
+    if (chunk->keys) {
+      chunk->keys[b] = key;
+      chunk->key_lens[b] = p - key;
+      if (chunk->key_lens[b] > max_length_of_vocab_word - 1) {
+        chunk->key_lens[b] = max_length_of_vocab_word - 1;
+      }
+    }
+    if (b >= chunk->matrix_rows) {
+      p = (const char *)memchr(p, '\n', chunk->end - p);
+      p = p ? p + 1 : chunk->end;
+      b++;
+      continue;
+    }
+    for (a = 0; a < chunk->size; a++) {
+      p = parse_text_float(p, chunk->end, &row[a]);
+      if (p == NULL) {
+        chunk->failed = GRN_TRUE;
+        return NULL;
+      }
+    }
+    normalize_row(row, chunk->size);
+    p = (const char *)memchr(p, '\n', chunk->end - p);
+    p = p ? p + 1 : chunk->end;
+    b++;
+  }
+  return NULL;
+}
+
+/*
+  Read a model in the original word2vec text format. The body is split
+  into n_threads chunks on line boundaries; rows are counted per chunk to
+  get each chunk's first row index, then the chunks are parsed straight
+  into the matrix in parallel. model_vocab (if given) is filled in row
+  order afterwards; without it, the rows past max_rows are not read.
+*/
+static grn_bool
+read_text_model(grn_ctx *ctx, FILE *f, int n_threads, grn_pat *model_vocab,
+                long long max_rows, long long *n_words_p, long long *dim_size_p,
+                float **matrix_p)
+{
+  struct stat st;
+  void *map;
+  const char *data, *p, *end;
+  long long words = 0, size = 0, matrix_rows = 0, read_rows;
+  long long b, n_rows;
+  const char **keys = NULL;
+  uint32_t *key_lens = NULL;
+  float *matrix = NULL;
+  pthread_t threads[MAX_LOAD_THREADS];
+  text_chunk_arg args[MAX_LOAD_THREADS];
+  grn_bool started[MAX_LOAD_THREADS];
+  grn_bool succeeded = GRN_FALSE;
+  int t;
+
+  *matrix_p = NULL;
+
+  if (fstat(fileno(f), &st) == -1 || st.st_size == 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Cannot stat model file");
+    return GRN_FALSE;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+  if (map == MAP_FAILED) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Cannot mmap model file");
+    return GRN_FALSE;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  data = (const char *)map;
+  end = data + st.st_size;
+
+  p = parse_header_number(data, end, &words);
+  if (p) {
+    p = parse_header_number(p, end, &size);
+  }
+  if (!p || !model_size_is_valid(words, size)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Broken model header");
+    goto exit;
+  }
+
+  matrix_rows = get_matrix_rows(words, max_rows);
+  /* a new vocab takes the keys of every row; otherwise end at matrix_rows */
+  read_rows = model_vocab ? words : matrix_rows;
+  if (model_vocab) {
+    keys = (const char **)GRN_PLUGIN_MALLOC(ctx, words * sizeof(const char *));
+    key_lens = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, words * sizeof(uint32_t));
+  }
+  matrix = (float *)GRN_PLUGIN_MALLOC(ctx, matrix_rows * size * sizeof(float));
+  if ((model_vocab && (keys == NULL || key_lens == NULL)) || matrix == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot allocate matrix : %lld x %lld", words, size);
+    goto exit;
+  }
+
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  if (n_threads > MAX_LOAD_THREADS) {
+    n_threads = MAX_LOAD_THREADS;
+  }
+  if (read_rows < words) {
+    const char *row_end = p;
+    for (b = 0; b < read_rows && (row_end = next_text_row(row_end, end)) < end; b++) {
+      row_end = (const char *)memchr(row_end, '\n', end - row_end);
+      row_end = row_end ? row_end + 1 : end;
+    }
+    end = row_end;
+  }
+  for (t = 0; t < n_threads; t++) {
+    const char *begin = p + (end - p) * t / n_threads;
+    if (t > 0 && begin[-1] != '\n') {
+      begin = (const char *)memchr(begin, '\n', end - begin);
+      begin = begin ? begin + 1 : end;
+    }
+    memset(&args[t], 0, sizeof(args[t]));
+    args[t].begin = begin;
+    args[t].words = read_rows;
+    args[t].matrix_rows = matrix_rows;
+    args[t].size = size;
+    args[t].keys = keys;
+    args[t].key_lens = key_lens;
+    args[t].matrix = matrix;
+  }
+  for (t = 0; t < n_threads; t++) {
+    args[t].end = (t + 1 < n_threads) ? args[t + 1].begin : end;
+    if (args[t].end < args[t].begin) {
+      args[t].end = args[t].begin;
+    }
+  }
+
+  for (t = 0; t < n_threads; t++) {
+    started[t] = (pthread_create(&threads[t], NULL, count_text_rows, &args[t]) == 0);
+  }
+  n_rows = 0;
+  for (t = 0; t < n_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      count_text_rows(&args[t]);
+    }
+    args[t].first_row = n_rows;
+    n_rows += args[t].n_rows;
+  }
+  if (n_rows < read_rows) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Truncated model file : %lld of %lld rows", n_rows, read_rows);
+    goto exit;
+  }
+
+  for (t = 0; t < n_threads; t++) {
+    started[t] = (pthread_create(&threads[t], NULL, parse_text_rows, &args[t]) == 0);
+  }
+  succeeded = GRN_TRUE;
+  for (t = 0; t < n_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      parse_text_rows(&args[t]);
+    }
+    if (args[t].failed) {
+      succeeded = GRN_FALSE;
+    }
+  }
+  if (!succeeded) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Broken vector in model file");
+    goto exit;
+  }
+
+  for (b = 0; model_vocab && b < words; b++) {
+    if (!grn_pat_add(ctx, model_vocab, keys[b], key_lens[b], NULL, NULL)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Faild load vocab");
+      succeeded = GRN_FALSE;
+      break;
+    }
+  }
+
+exit :
+  munmap(map, st.st_size);
+  if (keys) {
+    GRN_PLUGIN_FREE(ctx, keys);
+  }
+  if (key_lens) {
+    GRN_PLUGIN_FREE(ctx, key_lens);
+  }
+  if (!succeeded) {
+    if (matrix) {
+      GRN_PLUGIN_FREE(ctx, matrix);
+    }
+    return GRN_FALSE;
+  }
+
+  *n_words_p = matrix_rows;
+  *dim_size_p = size;
+  *matrix_p = matrix;
+  return GRN_TRUE;
+}
+
+#ifdef GRN_WITH_ZLIB
+#define GZIP_STREAM_BLOCK_SIZE (4 * 1024 * 1024)
+#define GZIP_STREAM_N_BLOCKS 4
+
+/*
+  A gzip-compressed model file. A reader thread inflates it into a ring of
+  blocks while the loading thread parses and normalizes rows from the
+  blocks already inflated. Without the thread, blocks are inflated on
+  demand.
+*/
+typedef struct {
+  gzFile gz;
+  char *blocks;
+  size_t block_lens[GZIP_STREAM_N_BLOCKS];
+  /* blocks filled by the reader and consumed by the parser so far */
+  long long n_filled;
+  long long n_consumed;
+  grn_bool eof;
+  grn_bool failed;
+  grn_bool stopped;
+  grn_bool threaded;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  /* unread bytes of the block being parsed */
+  const char *p;
+  const char *end;
+  grn_bool has_block;
+} gzip_stream;
+
+static void *
+inflate_gzip_blocks(void *arg)
+{
+  gzip_stream *stream = (gzip_stream *)arg;
+
+  for (;;) {
+    int i, n;
+    pthread_mutex_lock(&stream->mutex);
+    while (stream->n_filled - stream->n_consumed == GZIP_STREAM_N_BLOCKS &&
+           !stream->stopped) {
+      pthread_cond_wait(&stream->cond, &stream->mutex);
+    }
+    if (stream->stopped) {
+      pthread_mutex_unlock(&stream->mutex);
+      break;
+    }
+    i = stream->n_filled % GZIP_STREAM_N_BLOCKS;
+    pthread_mutex_unlock(&stream->mutex);
+
+    n = gzread(stream->gz, stream->blocks + (size_t)i * GZIP_STREAM_BLOCK_SIZE,
+               GZIP_STREAM_BLOCK_SIZE);
+
+    pthread_mutex_lock(&stream->mutex);
+    if (n > 0) {
+      stream->block_lens[i] = n;
+      stream->n_filled++;
+    } else {
+      stream->failed = (n < 0);
+      stream->eof = GRN_TRUE;
+    }
+    pthread_cond_broadcast(&stream->cond);
+    pthread_mutex_unlock(&stream->mutex);
+    if (stream->eof) {
+      break;
+    }
+  }
+  return NULL;
+}
+
+/* hand the current block back to the reader and move to the next one */
+static grn_bool
+next_gzip_block(gzip_stream *stream)
+{
+  int i;
+
+  if (!stream->threaded) {
+    int n;
+    if (stream->eof) {
+      return GRN_FALSE;
+    }
+    n = gzread(stream->gz, stream->blocks, GZIP_STREAM_BLOCK_SIZE);
+    if (n <= 0) {
+      stream->failed = (n < 0);
+      stream->eof = GRN_TRUE;
+      return GRN_FALSE;
+    }
+    stream->p = stream->blocks;
+    stream->end = stream->blocks + n;
+    return GRN_TRUE;
+  }
+
+  pthread_mutex_lock(&stream->mutex);
+  if (stream->has_block) {
+    stream->n_consumed++;
+    stream->has_block = GRN_FALSE;
+    pthread_cond_broadcast(&stream->cond);
+  }
+  while (stream->n_filled == stream->n_consumed && !stream->eof) {
+    pthread_cond_wait(&stream->cond, &stream->mutex);
+  }
+  if (stream->n_filled > stream->n_consumed) {
+    i = stream->n_consumed % GZIP_STREAM_N_BLOCKS;
+    stream->p = stream->blocks + (size_t)i * GZIP_STREAM_BLOCK_SIZE;
+    stream->end = stream->p + stream->block_lens[i];
+    stream->has_block = GRN_TRUE;
+  }
+  pthread_mutex_unlock(&stream->mutex);
+  return stream->has_block;
+}
+
+/* the next byte, or -1 at the end of the stream */
+static inline int
+gzip_stream_getc(gzip_stream *stream)
+{
+  if (stream->p == stream->end && !next_gzip_block(stream)) {
+    return -1;
+  }
+  return (unsigned char)*(stream->p++);
+}
+
+static grn_bool
+gzip_stream_read(gzip_stream *stream, void *buffer, size_t len)
+{
+  char *dest = (char *)buffer;
+  while (len > 0) {
+    size_t n;
+    if (stream->p == stream->end && !next_gzip_block(stream)) {
+      return GRN_FALSE;
+    }
+    n = stream->end - stream->p;
+    if (n > len) {
+      n = len;
+    }
+    memcpy(dest, stream->p, n);
+    stream->p += n;
+    dest += n;
+    len -= n;
+  }
+  return GRN_TRUE;
+}
+
+/* a whitespace separated token; longer tokens are truncated to max_len - 1 bytes */
+static int
+gzip_stream_read_token(gzip_stream *stream, char *token, int max_len)
+{
+  int c, len = 0;
+  while ((c = gzip_stream_getc(stream)) != -1 && is_text_space(c)) {
+  }
+  while (c != -1 && !is_text_space(c)) {
+    if (len < max_len - 1) {
+      token[len++] = c;
+    }
+    c = gzip_stream_getc(stream);
+  }
+  token[len] = '\0';
+  return len;
+}
+
+/* the rest of the line (without '\n') in *line, grown as needed */
+static grn_bool
+gzip_stream_read_line(grn_ctx *ctx, gzip_stream *stream,
+                      char **line, size_t *line_size, size_t *line_len)
+{
+  int c;
+  *line_len = 0;
+  while ((c = gzip_stream_getc(stream)) != -1 && c != '\n') {
+    if (*line_len + 1 >= *line_size) {
+      size_t new_size = *line_size > 0 ? *line_size * 2 : 4096;
+      char *new_line = (char *)GRN_PLUGIN_REALLOC(ctx, *line, new_size);
+      if (new_line == NULL) {
+        return GRN_FALSE;
+      }
+      *line = new_line;
+      *line_size = new_size;
+    }
+    (*line)[(*line_len)++] = c;
+  }
+  return c != -1 || *line_len > 0;
+}
+
+/*
+  Read a gzip-compressed model in the original word2vec text or binary
+  format, streaming it into the matrix without a decompressed copy on
+  disk. Keys are added to model_vocab (if given) in row order.
+*/
+static grn_bool
+read_gzip_model(grn_ctx *ctx, FILE *f, int binary, grn_pat *model_vocab,
+                long long max_rows, long long *n_words_p, long long *dim_size_p,
+                float **matrix_p)
+{
+  gzip_stream stream;
+  pthread_t thread;
+  char key[max_length_of_vocab_word];
+  char *line = NULL;
+  size_t line_size = 0, line_len;
+  long long words = 0, size = 0, matrix_rows = 0;
+  long long a, b;
+  float *matrix = NULL;
+  float *skipped_row = NULL;
+  grn_bool succeeded = GRN_FALSE;
+  int fd;
+
+  *matrix_p = NULL;
+
+  memset(&stream, 0, sizeof(stream));
+  fd = dup(fileno(f));
+  if (fd == -1 || lseek(fd, 0, SEEK_SET) == -1 ||
+      (stream.gz = gzdopen(fd, "rb")) == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Cannot open gzip model file");
+    if (fd != -1) {
+      close(fd);
+    }
+    return GRN_FALSE;
+  }
+  gzbuffer(stream.gz, 256 * 1024);
+  stream.blocks = (char *)GRN_PLUGIN_MALLOC(ctx, (size_t)GZIP_STREAM_N_BLOCKS *
+                                                 GZIP_STREAM_BLOCK_SIZE);
+  if (stream.blocks == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Cannot allocate gzip buffer");
+    gzclose(stream.gz);
+    return GRN_FALSE;
+  }
+  pthread_mutex_init(&stream.mutex, NULL);
+  pthread_cond_init(&stream.cond, NULL);
+  stream.threaded = (pthread_create(&thread, NULL, inflate_gzip_blocks, &stream) == 0);
+
+  if (gzip_stream_read_token(&stream, key, sizeof(key)) > 0) {
+    words = atoll(key);
+  }
+  if (gzip_stream_read_token(&stream, key, sizeof(key)) > 0) {
+    size = atoll(key);
+  }
+  if (!model_size_is_valid(words, size)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Broken model header");
+    goto exit;
+  }
+  matrix_rows = get_matrix_rows(words, max_rows);
+  matrix = (float *)GRN_PLUGIN_MALLOC(ctx, matrix_rows * size * sizeof(float));
+  /* rows beyond matrix_rows are read into one buffer for their keys */
+  if (matrix_rows < words && model_vocab) {
+    skipped_row = (float *)GRN_PLUGIN_MALLOC(ctx, size * sizeof(float));
+  }
+  if (matrix == NULL || (matrix_rows < words && model_vocab && skipped_row == NULL)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot allocate matrix : %lld x %lld", words, size);
+    goto exit;
+  }
+
+  for (b = 0; b < words; b++) {
+    float *row;
+    int key_len;
+    if (b >= matrix_rows && !model_vocab) {
+      break;
+    }
+    row = (b < matrix_rows) ? matrix + b * size : skipped_row;
+    key_len = gzip_stream_read_token(&stream, key, sizeof(key));
+    if (key_len == 0) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_load] "
+                     "Truncated model file : %lld of %lld rows", b, words);
+      goto exit;
+    }
+    if (binary) {
+      if (!gzip_stream_read(&stream, row, size * sizeof(float))) {
+        GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                       "[word2vec_load] "
+                       "Truncated model file at row %lld", b);
+        goto exit;
+      }
+    } else {
+      const char *p, *end;
+      if (!gzip_stream_read_line(ctx, &stream, &line, &line_size, &line_len)) {
+        GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                       "[word2vec_load] "
+                       "Truncated model file : %lld of %lld rows", b, words);
+        goto exit;
+      }
+      p = line;
+      end = line + line_len;
+      for (a = 0; a < size && p; a++) {
+        p = parse_text_float(p, end, &row[a]);
+      }
+      if (p == NULL) {
+        GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Broken vector in model file");
+        goto exit;
+      }
+    }
+    normalize_row(row, size);
+    if (model_vocab &&
+        !grn_pat_add(ctx, model_vocab, key, key_len, NULL, NULL)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Faild load vocab");
+      goto exit;
+    }
+  }
+  succeeded = GRN_TRUE;
+
+exit :
+  if (stream.threaded) {
+    pthread_mutex_lock(&stream.mutex);
+    stream.stopped = GRN_TRUE;
+    pthread_cond_broadcast(&stream.cond);
+    pthread_mutex_unlock(&stream.mutex);
+    pthread_join(thread, NULL);
+  }
+  if (stream.failed) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Broken gzip model file");
+    succeeded = GRN_FALSE;
+  }
+  pthread_cond_destroy(&stream.cond);
+  pthread_mutex_destroy(&stream.mutex);
+  gzclose(stream.gz);
+  GRN_PLUGIN_FREE(ctx, stream.blocks);
+  if (line) {
+    GRN_PLUGIN_FREE(ctx, line);
+  }
+  if (skipped_row) {
+    GRN_PLUGIN_FREE(ctx, skipped_row);
+  }
+  if (!succeeded) {
+    if (matrix) {
+      GRN_PLUGIN_FREE(ctx, matrix);
+    }
+    return GRN_FALSE;
+  }
+
+  *n_words_p = matrix_rows;
+  *dim_size_p = size;
+  *matrix_p = matrix;
+  return GRN_TRUE;
+}
+#endif
+
+/*
+  Read a model in the original word2vec text or binary format, possibly
+  gzip-compressed. Keys are added to model_vocab in row order so that
+  row = id - 1; pass NULL when the vocab is already available. Only the
+  first max_rows rows (all when 0) are read into the matrix and counted
+  in *n_words_p; model_vocab still gets every key.
+*/
+static grn_bool
+read_model(grn_ctx *ctx, FILE *f, int binary, int n_threads, grn_pat *model_vocab,
+           long long max_rows, long long *n_words_p, long long *dim_size_p,
+           float **matrix_p)
+{
+  if (is_gzip_file(f)) {
+#ifdef GRN_WITH_ZLIB
+    return read_gzip_model(ctx, f, binary, model_vocab, max_rows,
+                           n_words_p, dim_size_p, matrix_p);
+#else
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "gzip-compressed model files need zlib");
+    return GRN_FALSE;
+#endif
+  }
+  if (binary == 0) {
+    const char *loader = getenv("GRN_WORD2VEC_TEXT_LOADER");
+    if (loader && strcmp(loader, "fscanf") == 0) {
+      return read_text_model_fscanf(ctx, f, model_vocab, max_rows,
+                                    n_words_p, dim_size_p, matrix_p);
+    }
+    return read_text_model(ctx, f, n_threads, model_vocab, max_rows,
+                           n_words_p, dim_size_p, matrix_p);
+  }
+  return read_binary_model(ctx, f, n_threads, model_vocab, max_rows,
+                           n_words_p, dim_size_p, matrix_p);
+}
+
+/* the number of rows from the "words size" header line */
+static long long
+read_model_n_words(FILE *f)
+{
+  long long words = 0;
+#ifdef GRN_WITH_ZLIB
+  if (is_gzip_file(f)) {
+    char header[64];
+    int fd = dup(fileno(f));
+    gzFile gz = (fd == -1) ? NULL : gzdopen(fd, "rb");
+    if (gz == NULL) {
+      if (fd != -1) {
+        close(fd);
+      }
+      return 0;
+    }
+    if (gzgets(gz, header, sizeof(header)) != NULL) {
+      words = atoll(header);
+    }
+    gzclose(gz);
+    rewind(f);
+    return words;
+  }
+#endif
+  if (fscanf(f, "%lld", &words) != 1) {
+    words = 0;
+  }
+  rewind(f);
+  return words;
+}
+
+static void
+get_vocab_file_path(const char *file_name, char *vocab_file_name)
+{
+  snprintf(vocab_file_name, max_size, "%s%s", file_name, VOCAB_FILE_SUFFIX);
+}
+
+static int
+lock_vocab_file(const char *vocab_file_name, int operation)
+{
+  char lock_file_name[max_size];
+  int fd;
+
+  snprintf(lock_file_name, max_size, "%s.lock", vocab_file_name);
+  fd = open(lock_file_name, O_RDWR|O_CREAT, 0644);
+  if (fd == -1) {
+    return -1;
+  }
+  if (flock(fd, operation) == -1) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static void
+unlock_vocab_file(int fd)
+{
+  if (fd != -1) {
+    flock(fd, LOCK_UN);
+    close(fd);
+  }
+}
+
+static grn_bool
+is_newer_or_same(const struct stat *a, const struct stat *b)
+{
+  if (a->st_mtim.tv_sec != b->st_mtim.tv_sec) {
+    return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+  }
+  return a->st_mtim.tv_nsec >= b->st_mtim.tv_nsec;
+}
+
+/* a persisted vocab is reused only if it is not older than the model and has one key per row */
+static grn_pat *
+open_vocab_file(grn_ctx *ctx, const char *file_name, const char *vocab_file_name,
+                long long words)
+{
+  struct stat model_st, vocab_st;
+  grn_pat *model_vocab;
+
+  if (stat(file_name, &model_st) == -1 || stat(vocab_file_name, &vocab_st) == -1 ||
+      !is_newer_or_same(&vocab_st, &model_st)) {
+    return NULL;
+  }
+  model_vocab = grn_pat_open(ctx, vocab_file_name);
+  if (model_vocab && grn_pat_size(ctx, model_vocab) != (unsigned int)words) {
+    grn_pat_close(ctx, model_vocab);
+    model_vocab = NULL;
+  }
+  return model_vocab;
+}
+
+static void
+get_vocab_temp_file_path(const char *vocab_file_name, char *temp_file_name)
+{
+  snprintf(temp_file_name, max_size, "%s.tmp", vocab_file_name);
+}
+
+/* a grn_pat may span "<path>.001", "<path>.002", ... besides <path> itself */
+static grn_bool
+rename_vocab_file(const char *from, const char *to)
+{
+  char from_part[max_size], to_part[max_size];
+  int i;
+
+  if (rename(from, to) == -1) {
+    return GRN_FALSE;
+  }
+  for (i = 1; i < 1000; i++) {
+    snprintf(from_part, max_size, "%s.%03d", from, i);
+    snprintf(to_part, max_size, "%s.%03d", to, i);
+    if (rename(from_part, to_part) == -1) {
+      unlink(to_part);
+      break;
+    }
+  }
+  return GRN_TRUE;
+}
+
+/*
+  Get the vocab of a model. The vocab is persisted as a grn_pat next to the
+  model ("<model>.vocab") and opened without per-key work. When it is
+  missing or stale, an empty one is created under an exclusive lock and
+  *is_new is set; the caller adds keys in row order and then calls
+  finish_vocab(). A rebuilt vocab is written to "<model>.vocab.tmp" so that
+  a model published from the previous file keeps using it during a reload.
+  If the model directory is not writable, an in-memory vocab is used
+  instead.
+*/
+static grn_pat *
+prepare_vocab(grn_ctx *ctx, const char *file_name, long long words,
+              grn_bool *is_new, int *lock_fd)
+{
+  char vocab_file_name[max_size];
+  char temp_file_name[max_size];
+  struct stat st;
+  grn_pat *model_vocab = NULL;
+
+  *is_new = GRN_FALSE;
+  get_vocab_file_path(file_name, vocab_file_name);
+  *lock_fd = lock_vocab_file(vocab_file_name, LOCK_SH);
+  if (*lock_fd == -1) {
+    *is_new = GRN_TRUE;
+    return create_vocab(ctx);
+  }
+  model_vocab = open_vocab_file(ctx, file_name, vocab_file_name, words);
+  if (model_vocab == NULL && flock(*lock_fd, LOCK_EX) == 0) {
+    /* another process may have built it while we waited */
+    model_vocab = open_vocab_file(ctx, file_name, vocab_file_name, words);
+    if (model_vocab == NULL) {
+      get_vocab_temp_file_path(vocab_file_name, temp_file_name);
+      if (stat(temp_file_name, &st) == 0) {
+        grn_pat_remove(ctx, temp_file_name);
+      }
+      model_vocab = grn_pat_create(ctx, temp_file_name,
+                                   GRN_TABLE_MAX_KEY_SIZE,
+                                   0,
+                                   GRN_OBJ_TABLE_PAT_KEY|GRN_OBJ_KEY_VAR_SIZE);
+      if (model_vocab) {
+        *is_new = GRN_TRUE;
+        return model_vocab;
+      }
+    }
+  }
+  unlock_vocab_file(*lock_fd);
+  *lock_fd = -1;
+  if (model_vocab == NULL) {
+    *is_new = GRN_TRUE;
+    model_vocab = create_vocab(ctx);
+  }
+  return model_vocab;
+}
+
+/*
+  Release the build lock. A vocab built under the temporary name is renamed
+  over "<model>.vocab" and reopened there; the rename leaves the previous
+  file alive for models that still have it open. A partially built vocab is
+  removed. Returns the vocab to use, or NULL on failure.
+*/
+static grn_pat *
+finish_vocab(grn_ctx *ctx, const char *file_name, grn_pat *model_vocab,
+             grn_bool is_new, int lock_fd, grn_bool succeeded)
+{
+  char vocab_file_name[max_size];
+  char temp_file_name[max_size];
+
+  if (lock_fd == -1 || !is_new) {
+    if (!succeeded) {
+      grn_pat_close(ctx, model_vocab);
+      model_vocab = NULL;
+    }
+    unlock_vocab_file(lock_fd);
+    return model_vocab;
+  }
+  get_vocab_file_path(file_name, vocab_file_name);
+  get_vocab_temp_file_path(vocab_file_name, temp_file_name);
+  grn_pat_close(ctx, model_vocab);
+  model_vocab = NULL;
+  if (!succeeded) {
+    grn_pat_remove(ctx, temp_file_name);
+  } else if (rename_vocab_file(temp_file_name, vocab_file_name)) {
+    model_vocab = grn_pat_open(ctx, vocab_file_name);
+  } else {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot rename vocab : %s", vocab_file_name);
+    grn_pat_remove(ctx, temp_file_name);
+  }
+  unlock_vocab_file(lock_fd);
+  return model_vocab;
+}
+
+static grn_bool
+native_model_header_is_valid(const native_model_header *header, uint64_t file_size)
+{
+  uint32_t precision_flags = header->flags & NATIVE_MODEL_PRECISION_FLAGS;
+  uint64_t matrix_size;
+
+  if (memcmp(header->magic, NATIVE_MODEL_MAGIC, NATIVE_MODEL_MAGIC_LEN) != 0 ||
+      header->version != NATIVE_MODEL_VERSION ||
+      (header->flags & ~(uint32_t)NATIVE_MODEL_FLAGS) != 0 ||
+      (precision_flags & (precision_flags - 1)) != 0) {
+    return GRN_FALSE;
+  }
+  /* n_words * dim_size floats must not overflow before the sizes are compared */
+  if (header->dim_size == 0 || header->n_words > file_size || header->dim_size > file_size ||
+      header->n_words > UINT64_MAX / sizeof(float) / header->dim_size) {
+    return GRN_FALSE;
+  }
+  if (header->flags & NATIVE_MODEL_FLAG_PQ &&
+      (header->pq_subspaces == 0 || header->pq_subspaces > header->dim_size ||
+       header->dim_size % header->pq_subspaces != 0)) {
+    return GRN_FALSE;
+  }
+  matrix_size = native_model_matrix_size(header->n_words, header->dim_size,
+                                         header->flags, header->pq_subspaces);
+  if (header->matrix_offset % NATIVE_MODEL_ALIGNMENT != 0 ||
+      header->matrix_offset > file_size || matrix_size > file_size - header->matrix_offset) {
+    return GRN_FALSE;
+  }
+  if (header->vocab_offset % sizeof(uint64_t) != 0 ||
+      header->vocab_size < (header->n_words + 1) * sizeof(uint64_t) ||
+      header->vocab_offset > file_size || header->vocab_size > file_size - header->vocab_offset) {
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+/* mmap a native model: the matrix is used in place, the vocab is built only once */
+static grn_bool
+word2vec_load_native(grn_ctx *ctx, const char *file_name, word2vec_model *model)
+{
+  int fd;
+  struct stat st;
+  void *map;
+  const native_model_header *header;
+  const uint64_t *key_offsets;
+  const char *keys;
+  uint64_t keys_size;
+  grn_pat *model_vocab;
+  grn_bool is_new;
+  int lock_fd;
+  uint64_t i;
+
+  fd = open(file_name, O_RDONLY);
+  if (fd == -1) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Input file not found : %s",
+                   file_name);
+    return GRN_FALSE;
+  }
+  if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(native_model_header)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Broken native model : %s",
+                   file_name);
+    close(fd);
+    return GRN_FALSE;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot mmap native model : %s",
+                   file_name);
+    return GRN_FALSE;
+  }
+
+  header = (const native_model_header *)map;
+  if (!native_model_header_is_valid(header, st.st_size)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Broken native model : %s",
+                   file_name);
+    munmap(map, st.st_size);
+    return GRN_FALSE;
+  }
+
+  key_offsets = (const uint64_t *)((const char *)map + header->vocab_offset);
+  keys = (const char *)(key_offsets + header->n_words + 1);
+  keys_size = header->vocab_size - (header->n_words + 1) * sizeof(uint64_t);
+
+  model_vocab = prepare_vocab(ctx, file_name, header->n_words, &is_new, &lock_fd);
+  if (model_vocab == NULL) {
+    munmap(map, st.st_size);
+    return GRN_FALSE;
+  }
+  for (i = 0; is_new && i < header->n_words; i++) {
+    if (key_offsets[i] > key_offsets[i + 1] || key_offsets[i + 1] > keys_size ||
+        !grn_pat_add(ctx, model_vocab, keys + key_offsets[i],
+                     key_offsets[i + 1] - key_offsets[i], NULL, NULL)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_load] Faild load vocab");
+      finish_vocab(ctx, file_name, model_vocab, is_new, lock_fd, GRN_FALSE);
+      munmap(map, st.st_size);
+      return GRN_FALSE;
+    }
+  }
+  model_vocab = finish_vocab(ctx, file_name, model_vocab, is_new, lock_fd, GRN_TRUE);
+  if (model_vocab == NULL) {
+    munmap(map, st.st_size);
+    return GRN_FALSE;
+  }
+
+  model->n_words = header->n_words;
+  model->dim_size = header->dim_size;
+  if (header->flags & NATIVE_MODEL_FLAG_INT8) {
+    model->M8 = (int8_t *)((char *)map + header->matrix_offset);
+    model->row_scale = (float *)((char *)map + header->matrix_offset +
+                                     native_model_matrix_size(header->n_words,
+                                                              header->dim_size,
+                                                              header->flags, 0) -
+                                     header->n_words * sizeof(float));
+    model->precision = MODEL_PRECISION_INT8;
+  } else if (header->flags & NATIVE_MODEL_FLAG_PQ) {
+    model->pq_codebook = (float *)((char *)map + header->matrix_offset);
+    model->pq_codes = (uint8_t *)((char *)map + header->matrix_offset +
+                                      PQ_N_CENTROIDS * header->dim_size * sizeof(float));
+    model->pq_subspaces = header->pq_subspaces;
+    model->precision = MODEL_PRECISION_PQ;
+  } else if (header->flags & (NATIVE_MODEL_FLAG_FP16|NATIVE_MODEL_FLAG_BF16)) {
+    model->M16 = (uint16_t *)((char *)map + header->matrix_offset);
+    model->precision = (header->flags & NATIVE_MODEL_FLAG_FP16) ?
+      MODEL_PRECISION_FP16 : MODEL_PRECISION_BF16;
+  } else {
+    model->M = (float *)((char *)map + header->matrix_offset);
+  }
+  model->key_order = (header->flags & NATIVE_MODEL_FLAG_KEY_ORDER) != 0;
+  model->vocab = model_vocab;
+  model->map = map;
+  model->map_size = st.st_size;
+
+  return GRN_TRUE;
+}
+
+/* write to a temporary file and rename it so mapped readers keep the old inode */
+static grn_bool
+save_native_model(grn_ctx *ctx, const char *file_name,
+                  long long words, long long size,
+                  const float *matrix, grn_pat *model_vocab, uint32_t flags,
+                  int n_subspaces, int n_threads)
+{
+  char tmp_file_name[max_size];
+  char key_name[GRN_TABLE_MAX_KEY_SIZE];
+  native_model_header header;
+  uint64_t *key_offsets;
+  long long i;
+  int key_len;
+  FILE *fo;
+  grn_bool succeeded;
+
+  key_offsets = (uint64_t *)GRN_PLUGIN_MALLOC(ctx, (words + 1) * sizeof(uint64_t));
+  if (key_offsets == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] Cannot allocate vocab offsets");
+    return GRN_FALSE;
+  }
+  key_offsets[0] = 0;
+  for (i = 0; i < words; i++) {
+    key_len = grn_pat_get_key(ctx, model_vocab, i + 1, key_name, GRN_TABLE_MAX_KEY_SIZE);
+    key_offsets[i + 1] = key_offsets[i] + key_len;
+  }
+
+  native_model_init_header(&header, words, size, flags, n_subspaces, key_offsets[words]);
+
+  snprintf(tmp_file_name, max_size, "%s.tmp", file_name);
+  fo = fopen(tmp_file_name, "wb");
+  if (fo == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] Cannot create output file : %s", tmp_file_name);
+    GRN_PLUGIN_FREE(ctx, key_offsets);
+    return GRN_FALSE;
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  if (flags & NATIVE_MODEL_FLAG_PQ) {
+    float *codebook = (float *)GRN_PLUGIN_MALLOC(ctx, PQ_N_CENTROIDS * size * sizeof(float));
+    uint8_t *codes = (uint8_t *)GRN_PLUGIN_MALLOC(ctx, words * n_subspaces);
+    if (codebook && codes &&
+        train_pq(ctx, matrix, words, size, n_subspaces, n_threads, codebook, codes)) {
+      fseeko(fo, header.matrix_offset, SEEK_SET);
+      fwrite(codebook, sizeof(float), PQ_N_CENTROIDS * size, fo);
+      fwrite(codes, 1, words * n_subspaces, fo);
+    } else {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_convert] Cannot build product quantizer");
+      fclose(fo);
+      unlink(tmp_file_name);
+      if (codebook) {
+        GRN_PLUGIN_FREE(ctx, codebook);
+      }
+      if (codes) {
+        GRN_PLUGIN_FREE(ctx, codes);
+      }
+      GRN_PLUGIN_FREE(ctx, key_offsets);
+      return GRN_FALSE;
+    }
+    GRN_PLUGIN_FREE(ctx, codebook);
+    GRN_PLUGIN_FREE(ctx, codes);
+  } else if (!native_model_write_rows(fo, &header, matrix)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] Cannot allocate conversion buffer");
+    fclose(fo);
+    unlink(tmp_file_name);
+    GRN_PLUGIN_FREE(ctx, key_offsets);
+    return GRN_FALSE;
+  }
+  fseeko(fo, header.vocab_offset, SEEK_SET);
+  fwrite(key_offsets, sizeof(uint64_t), words + 1, fo);
+  for (i = 0; i < words; i++) {
+    key_len = grn_pat_get_key(ctx, model_vocab, i + 1, key_name, GRN_TABLE_MAX_KEY_SIZE);
+    fwrite(key_name, 1, key_len, fo);
+  }
+  succeeded = !ferror(fo);
+  if (fclose(fo) != 0) {
+    succeeded = GRN_FALSE;
+  }
+  GRN_PLUGIN_FREE(ctx, key_offsets);
+
+  if (!succeeded || rename(tmp_file_name, file_name) != 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] Cannot write output file : %s", file_name);
+    unlink(tmp_file_name);
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+/* write a model in the original word2vec text or binary format */
+static grn_bool
+save_model(grn_ctx *ctx, const char *file_name, long long words, long long size,
+           const float *matrix, grn_pat *model_vocab, int binary)
+{
+  char tmp_file_name[max_size];
+  char key_name[GRN_TABLE_MAX_KEY_SIZE];
+  long long a, b;
+  int key_len;
+  FILE *fo;
+  grn_bool succeeded;
+
+  snprintf(tmp_file_name, max_size, "%s.tmp", file_name);
+  fo = fopen(tmp_file_name, "wb");
+  if (fo == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] Cannot create output file : %s", tmp_file_name);
+    return GRN_FALSE;
+  }
+  fprintf(fo, "%lld %lld\n", words, size);
+  for (b = 0; b < words; b++) {
+    const float *row = matrix + b * size;
+    key_len = grn_pat_get_key(ctx, model_vocab, b + 1, key_name, GRN_TABLE_MAX_KEY_SIZE);
+    fwrite(key_name, 1, key_len, fo);
+    fputc(' ', fo);
+    if (binary) {
+      fwrite(row, sizeof(float), size, fo);
+    } else {
+      for (a = 0; a < size; a++) fprintf(fo, "%lf ", row[a]);
+    }
+    fputc('\n', fo);
+  }
+  succeeded = !ferror(fo);
+  if (fclose(fo) != 0) {
+    succeeded = GRN_FALSE;
+  }
+  if (!succeeded || rename(tmp_file_name, file_name) != 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] Cannot write output file : %s", file_name);
+    unlink(tmp_file_name);
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+/* fp32 rows and the vocab of a native model of any precision */
+static grn_bool
+read_native_model(grn_ctx *ctx, const char *file_name, grn_pat **model_vocab_p,
+                  long long *n_words_p, long long *dim_size_p, float **matrix_p,
+                  grn_bool *key_order_p)
+{
+  word2vec_model *model;
+  float *matrix;
+  long long a, b;
+
+  model = create_model(ctx);
+  if (model == NULL) {
+    return GRN_FALSE;
+  }
+  if (!word2vec_load_native(ctx, file_name, model)) {
+    close_model(ctx, model);
+    return GRN_FALSE;
+  }
+  matrix = (float *)GRN_PLUGIN_MALLOC(ctx, model->n_words * model->dim_size * sizeof(float));
+  if (matrix == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] "
+                   "Cannot allocate matrix : %lld x %lld",
+                   model->n_words, model->dim_size);
+    close_model(ctx, model);
+    return GRN_FALSE;
+  }
+  for (b = 0; b < model->n_words; b++) {
+    float *row = matrix + b * model->dim_size;
+    for (a = 0; a < model->dim_size; a++) row[a] = model_value(model, b, a);
+    normalize_row(row, model->dim_size);
+  }
+  *model_vocab_p = model->vocab;
+  *n_words_p = model->n_words;
+  *dim_size_p = model->dim_size;
+  *matrix_p = matrix;
+  *key_order_p = model->key_order;
+  model->vocab = NULL;
+  close_model(ctx, model);
+  return GRN_TRUE;
+}
+
+/*
+  Reorder rows by key so that the rows under a prefix_filter are
+  contiguous. The vocab and the matrix are replaced.
+*/
+static grn_bool
+reorder_rows_by_key(grn_ctx *ctx, grn_pat **model_vocab_p, float **matrix_p,
+                    long long words, long long size)
+{
+  grn_pat *sorted_vocab;
+  grn_pat_cursor *pc;
+  float *sorted_matrix;
+  grn_id id;
+  long long b = 0;
+
+  sorted_vocab = create_vocab(ctx);
+  sorted_matrix = (float *)GRN_PLUGIN_MALLOC(ctx, words * size * sizeof(float));
+  pc = grn_pat_cursor_open(ctx, *model_vocab_p, NULL, 0, NULL, 0, 0, -1,
+                           GRN_CURSOR_ASCENDING);
+  if (sorted_vocab == NULL || sorted_matrix == NULL || pc == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] "
+                   "Cannot allocate matrix : %lld x %lld", words, size);
+    goto exit;
+  }
+  while (b < words && (id = grn_pat_cursor_next(ctx, pc)) != GRN_ID_NIL) {
+    char key[GRN_TABLE_MAX_KEY_SIZE];
+    int key_len = grn_pat_get_key(ctx, *model_vocab_p, id, key, GRN_TABLE_MAX_KEY_SIZE);
+    if (!grn_pat_add(ctx, sorted_vocab, key, key_len, NULL, NULL)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec_convert] Faild load vocab");
+      goto exit;
+    }
+    memcpy(sorted_matrix + b * size, *matrix_p + (id - 1) * size, size * sizeof(float));
+    b++;
+  }
+
+exit :
+  if (pc) {
+    grn_pat_cursor_close(ctx, pc);
+  }
+  if (b != words) {
+    if (sorted_vocab) {
+      grn_pat_close(ctx, sorted_vocab);
+    }
+    if (sorted_matrix) {
+      GRN_PLUGIN_FREE(ctx, sorted_matrix);
+    }
+    return GRN_FALSE;
+  }
+  grn_pat_close(ctx, *model_vocab_p);
+  GRN_PLUGIN_FREE(ctx, *matrix_p);
+  *model_vocab_p = sorted_vocab;
+  *matrix_p = sorted_matrix;
+  return GRN_TRUE;
+}
+
+static void
+get_shm_model_file_path(const char *file_name, char *shm_file_name)
+{
+  char real_file_name[PATH_MAX];
+  const char *dir;
+  const char *p;
+  uint64_t hash = 14695981039346656037ULL;
+
+  if (realpath(file_name, real_file_name) == NULL) {
+    snprintf(real_file_name, PATH_MAX, "%s", file_name);
+  }
+  for (p = real_file_name; *p; p++) {
+    hash ^= (unsigned char)*p;
+    hash *= 1099511628211ULL;
+  }
+  dir = getenv("GRN_WORD2VEC_SHM_DIR");
+  if (dir == NULL || dir[0] == '\0') {
+    dir = SHM_MODEL_DIR;
+  }
+  snprintf(shm_file_name, max_size, "%s/%s%016llx.native",
+           dir, SHM_MODEL_PREFIX, (unsigned long long)hash);
+}
+
+/*
+  Lock "<shm model>.lock". A detaching process unlinks the lock file while
+  holding it exclusively, so retry until the locked file is still the one
+  at the path.
+*/
+static int
+lock_shm_model(const char *shm_file_name, int operation)
+{
+  char lock_file_name[max_size];
+  struct stat fd_st, path_st;
+  int fd;
+
+  snprintf(lock_file_name, max_size, "%s.lock", shm_file_name);
+  for (;;) {
+    fd = open(lock_file_name, O_RDWR|O_CREAT, 0600);
+    if (fd == -1) {
+      return -1;
+    }
+    if (flock(fd, operation) == -1) {
+      close(fd);
+      return -1;
+    }
+    if (fstat(fd, &fd_st) == 0 && stat(lock_file_name, &path_st) == 0 &&
+        fd_st.st_dev == path_st.st_dev && fd_st.st_ino == path_st.st_ino) {
+      return fd;
+    }
+    close(fd);
+  }
+}
+
+/*
+  Load a model through a native copy in shared memory. The first process
+  materializes the normalized matrix and vocab under SHM_MODEL_DIR and the
+  others map the same pages read-only. A shared flock on "<shm model>.lock"
+  is held while attached; the copy is (re)built under "<shm model>.build"
+  and replaced by rename, so attached processes keep their pages.
+*/
+static grn_bool
+word2vec_load_shared(grn_ctx *ctx, FILE *f, const char *file_name, word2vec_model *model,
+                     int binary, int n_threads)
+{
+  char shm_file_name[max_size];
+  char build_file_name[max_size];
+  struct stat model_st, shm_st;
+  long long words, size;
+  float *matrix;
+  grn_pat *model_vocab;
+  grn_bool succeeded = GRN_TRUE;
+  int lock_fd, build_fd;
+
+  get_shm_model_file_path(file_name, shm_file_name);
+  lock_fd = lock_shm_model(shm_file_name, LOCK_SH);
+  if (lock_fd == -1 || fstat(fileno(f), &model_st) == -1) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Cannot lock shared model : %s",
+                   shm_file_name);
+    if (lock_fd != -1) {
+      close(lock_fd);
+    }
+    return GRN_FALSE;
+  }
+
+  if (stat(shm_file_name, &shm_st) == -1 || !is_newer_or_same(&shm_st, &model_st)) {
+    snprintf(build_file_name, max_size, "%s.build", shm_file_name);
+    build_fd = open(build_file_name, O_RDWR|O_CREAT, 0600);
+    if (build_fd != -1) {
+      flock(build_fd, LOCK_EX);
+    }
+    /* another process may have built it while we waited */
+    if (stat(shm_file_name, &shm_st) == -1 || !is_newer_or_same(&shm_st, &model_st)) {
+      model_vocab = create_vocab(ctx);
+      succeeded = (model_vocab != NULL);
+      if (succeeded) {
+        succeeded = read_model(ctx, f, binary, n_threads, model_vocab, 0, &words, &size, &matrix);
+        if (succeeded) {
+          succeeded = save_native_model(ctx, shm_file_name, words, size, matrix, model_vocab,
+                                        0, 0, 0);
+          GRN_PLUGIN_FREE(ctx, matrix);
+        }
+        grn_pat_close(ctx, model_vocab);
+      }
+    }
+    if (build_fd != -1) {
+      close(build_fd);
+    }
+  }
+  if (succeeded) {
+    succeeded = word2vec_load_native(ctx, shm_file_name, model);
+  }
+  if (succeeded) {
+    model->shm_path = (char *)GRN_PLUGIN_MALLOC(ctx, strlen(shm_file_name) + 1);
+    succeeded = (model->shm_path != NULL);
+  }
+  if (!succeeded) {
+    close(lock_fd);
+    return GRN_FALSE;
+  }
+  strcpy(model->shm_path, shm_file_name);
+  model->shm_lock = lock_fd;
+
+  GRN_PLUGIN_LOG(ctx, GRN_LOG_NOTICE,
+                 "[word2vec_load] %s is shared as %s", file_name, shm_file_name);
+  return GRN_TRUE;
+}
+
+static grn_bool
+word2vec_load_model(grn_ctx *ctx, const char *file_name, word2vec_model *model, int binary,
+                    int n_threads, grn_bool shared, long long max_rows)
+{
+  FILE *f;
+  grn_pat *model_vocab;
+  grn_bool is_new, succeeded;
+  int lock_fd;
+
+  f = fopen(file_name, "rb");
+  if (f == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Input file not found : %s",
+                   file_name);
+    return GRN_FALSE;
+  }
+
+  if (is_native_model_file(f)) {
+    fclose(f);
+    return word2vec_load_native(ctx, file_name, model);
+  }
+
+  if (shared) {
+    succeeded = word2vec_load_shared(ctx, f, file_name, model, binary, n_threads);
+    fclose(f);
+    return succeeded;
+  }
+
+  model_vocab = prepare_vocab(ctx, file_name, read_model_n_words(f), &is_new, &lock_fd);
+  if (model_vocab == NULL) {
+    fclose(f);
+    return GRN_FALSE;
+  }
+  succeeded = read_model(ctx, f, binary, n_threads, is_new ? model_vocab : NULL, max_rows,
+                         &model->n_words, &model->dim_size, &model->M);
+  fclose(f);
+  model_vocab = finish_vocab(ctx, file_name, model_vocab, is_new, lock_fd, succeeded);
+  if (model_vocab == NULL) {
+    return GRN_FALSE;
+  }
+  model->vocab = model_vocab;
+
+  return GRN_TRUE;
+}
+
+/*
+  Keep the first max_words rows, the most frequent words in the order the
+  trainer writes them. With query_only_tail the other rows stay loaded so
+  that they can be query terms, but they are not scanned as candidates.
+  Text and binary models are already read only up to max_words; the vocab
+  keeps every key either way.
+*/
+static void
+limit_model_words(grn_ctx *ctx, word2vec_model *model, load_option option)
+{
+  model->n_candidates = model->n_words;
+  if (option.max_words <= 0 || option.max_words >= model->n_words) {
+    return;
+  }
+  model->n_candidates = option.max_words;
+  if (option.query_only_tail) {
+    return;
+  }
+  model->n_words = option.max_words;
+  if (model->M != NULL && model->map == NULL) {
+    /* pages of a mapped model beyond n_words are simply never touched */
+    float *matrix = (float *)GRN_PLUGIN_REALLOC(ctx, model->M,
+                                                model->n_words * model->dim_size *
+                                                sizeof(float));
+    if (matrix != NULL) {
+      model->M = matrix;
+    }
+  }
+}
+
+/* a row turned into a scan_query; vec, query_int8 and pq_table are owned buffers */
+typedef struct {
+  float *vec;
+  int8_t *query_int8;
+  float *pq_table;
+  scan_query query;
+} row_query;
+
+/* floats of a row_query's buffers, laid out by init_row_query() */
+static long long
+get_row_query_size(const word2vec_model *model)
+{
+  long long size = model->dim_size + (model->dim_size + sizeof(float) - 1) / sizeof(float);
+  if (model->precision == MODEL_PRECISION_PQ) {
+    size += model->pq_subspaces * PQ_N_CENTROIDS;
+  }
+  return size;
+}
+
+static void
+init_row_query(const word2vec_model *model, row_query *query, float *buffer)
+{
+  query->vec = buffer;
+  query->query_int8 = (int8_t *)(buffer + model->dim_size);
+  query->pq_table = model->precision == MODEL_PRECISION_PQ ?
+    buffer + get_row_query_size(model) - model->pq_subspaces * PQ_N_CENTROIDS : NULL;
+}
+
+/*
+  Score other rows against row the way word2vec_distance scores them
+  against a query: fp32 rows are used in place, the others are decoded
+  and requantized or, if with_pq_table, turned into a PQ table (which
+  only pays off when many rows are scored).
+*/
+static const scan_query *
+set_row_query(const word2vec_model *model, long long row, row_query *query,
+              grn_bool with_pq_table)
+{
+  long long a;
+
+  query->query.query_int8 = NULL;
+  query->query.query_scale = 0;
+  query->query.pq_table = NULL;
+  if (model->precision == MODEL_PRECISION_FP32) {
+    query->query.vec = model->M + row * model->dim_size;
+    return &(query->query);
+  }
+  if (model->precision == MODEL_PRECISION_PQ) {
+    long long m, sub_size = model->dim_size / model->pq_subspaces;
+    const uint8_t *code = model->pq_codes + row * model->pq_subspaces;
+    for (m = 0; m < model->pq_subspaces; m++) {
+      memcpy(query->vec + m * sub_size,
+             model->pq_codebook + (m * PQ_N_CENTROIDS + code[m]) * sub_size,
+             sub_size * sizeof(float));
+    }
+  } else {
+    for (a = 0; a < model->dim_size; a++) query->vec[a] = model_value(model, row, a);
+  }
+  query->query.vec = query->vec;
+  if (model->precision == MODEL_PRECISION_INT8) {
+    query->query.query_scale = quantize_row(query->vec, model->dim_size, query->query_int8);
+    query->query.query_int8 = query->query_int8;
+  } else if (model->precision == MODEL_PRECISION_PQ && with_pq_table) {
+    build_pq_table(model, query->vec, query->pq_table);
+    query->query.pq_table = query->pq_table;
+  }
+  return &(query->query);
+}
+
+/* (dot product with the query, row); std::pair orders ties by row */
+typedef std::pair<float, uint32_t> hnsw_candidate;
+/* nearest on top */
+typedef std::priority_queue<hnsw_candidate> hnsw_nearest_queue;
+/* farthest on top */
+typedef std::priority_queue<hnsw_candidate, std::vector<hnsw_candidate>,
+                            std::greater<hnsw_candidate> > hnsw_farthest_queue;
+
+typedef struct {
+  char magic[HNSW_MAGIC_LEN];
+  uint32_t version;
+  uint32_t m;
+  uint64_t n_rows;
+  uint64_t dim_size;
+  /* size and mtime of the model file the graph was built from */
+  uint64_t model_size;
+  int64_t model_mtime;
+  int64_t model_mtime_nsec;
+  uint64_t n_upper_links;
+  uint32_t max_level;
+  uint32_t entry_point;
+} hnsw_file_header;
+
+/*
+  .hnsw file layout (host byte order):
+
+    hnsw_file_header
+    uint8_t levels[n_rows]               padded to 8 bytes
+    uint32_t links0[n_rows][m0 + 1]
+    uint32_t upper_links[n_upper_links]
+*/
+static void
+get_hnsw_file_path(const char *file_name, char *hnsw_file_name)
+{
+  snprintf(hnsw_file_name, max_size, "%s%s", file_name, HNSW_FILE_SUFFIX);
+}
+
+static inline uint32_t *
+hnsw_links(const hnsw_index *index, uint32_t row, int level)
+{
+  if (level == 0) {
+    return index->links0 + (uint64_t)row * (index->m0 + 1);
+  }
+  return index->upper_links + index->upper_offsets[row] +
+    (uint64_t)(level - 1) * (index->m + 1);
+}
+
+/* the i-th value of the splitmix64 sequence */
+static inline uint64_t
+splitmix64(uint64_t i)
+{
+  uint64_t h = i + 0x9e3779b97f4a7c15ULL;
+
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+/* deterministic level of a row: floor(-ln(u) / ln(m)) for u uniform in (0, 1] */
+static int
+hnsw_row_level(long long row, int m)
+{
+  double u;
+  int level;
+
+  u = ((splitmix64((uint64_t)row) >> 11) + 1) * (1.0 / 9007199254740992.0);
+  level = (int)(-log(u) / log((double)m));
+  return level < HNSW_MAX_LEVEL ? level : HNSW_MAX_LEVEL;
+}
+
+static hnsw_index *
+create_hnsw_index(grn_ctx *ctx, long long n_rows, int m)
+{
+  hnsw_index *index;
+
+  index = (hnsw_index *)GRN_PLUGIN_MALLOC(ctx, sizeof(hnsw_index));
+  if (index == NULL) {
+    return NULL;
+  }
+  memset(index, 0, sizeof(hnsw_index));
+  index->n_rows = n_rows;
+  index->m = m;
+  index->m0 = 2 * m;
+  pthread_mutex_init(&(index->visited_mutex), NULL);
+  return index;
+}
+
+/* upper_offsets from levels; returns the number of upper links, or -1 */
+static long long
+hnsw_compute_offsets(grn_ctx *ctx, hnsw_index *index)
+{
+  long long i;
+  uint64_t offset = 0;
+
+  index->upper_offsets = (uint64_t *)GRN_PLUGIN_MALLOC(ctx, index->n_rows * sizeof(uint64_t));
+  if (index->upper_offsets == NULL) {
+    return -1;
+  }
+  for (i = 0; i < index->n_rows; i++) {
+    index->upper_offsets[i] = offset;
+    offset += (uint64_t)index->levels[i] * (index->m + 1);
+  }
+  return offset;
+}
+
+static void
+hnsw_next_visit(hnsw_visited *visited, long long n_rows)
+{
+  if (++visited->tag == 0) {
+    memset(visited->marks, 0, n_rows * sizeof(uint16_t));
+    visited->tag = 1;
+  }
+}
+
+/* visited marks for one search, reused across queries */
+static hnsw_visited *
+hnsw_acquire_visited(grn_ctx *ctx, hnsw_index *index)
+{
+  hnsw_visited *visited;
+
+  pthread_mutex_lock(&(index->visited_mutex));
+  visited = index->free_visited;
+  if (visited) {
+    index->free_visited = visited->next;
+  }
+  pthread_mutex_unlock(&(index->visited_mutex));
+  if (visited == NULL) {
+    visited = (hnsw_visited *)GRN_PLUGIN_MALLOC(ctx, sizeof(hnsw_visited));
+    if (visited == NULL) {
+      return NULL;
+    }
+    visited->marks = (uint16_t *)GRN_PLUGIN_MALLOC(ctx, index->n_rows * sizeof(uint16_t));
+    if (visited->marks == NULL) {
+      GRN_PLUGIN_FREE(ctx, visited);
+      return NULL;
+    }
+    memset(visited->marks, 0, index->n_rows * sizeof(uint16_t));
+    visited->tag = 0;
+  }
+  hnsw_next_visit(visited, index->n_rows);
+  return visited;
+}
+
+static void
+hnsw_release_visited(hnsw_index *index, hnsw_visited *visited)
+{
+  pthread_mutex_lock(&(index->visited_mutex));
+  visited->next = index->free_visited;
+  index->free_visited = visited;
+  pthread_mutex_unlock(&(index->visited_mutex));
+}
+
+/* copy the links of row on level; locks is NULL once the graph is built */
+static int
+hnsw_copy_links(const hnsw_index *index, pthread_mutex_t *locks,
+                uint32_t row, int level, long long *links)
+{
+  const uint32_t *list = hnsw_links(index, row, level);
+  int i, n;
+
+  if (locks) {
+    pthread_mutex_lock(&locks[row % HNSW_N_LOCKS]);
+  }
+  n = list[0];
+  for (i = 0; i < n; i++) links[i] = list[i + 1];
+  if (locks) {
+    pthread_mutex_unlock(&locks[row % HNSW_N_LOCKS]);
+  }
+  return n;
+}
+
+/* walk to the nearest row on each level from from_level down to to_level + 1 */
+static hnsw_candidate
+hnsw_greedy_search(const hnsw_index *index, const word2vec_model *model,
+                   const scan_query *query, pthread_mutex_t *locks,
+                   hnsw_candidate entry, int from_level, int to_level)
+{
+  long long links[HNSW_M0];
+  float dists[HNSW_M0];
+  int level, i, n;
+  grn_bool changed;
+
+  for (level = from_level; level > to_level; level--) {
+    do {
+      changed = GRN_FALSE;
+      n = hnsw_copy_links(index, locks, entry.second, level, links);
+      score_rows(model, query, links, 0, n, dists);
+      for (i = 0; i < n; i++) {
+        if (dists[i] > entry.first) {
+          entry.first = dists[i];
+          entry.second = links[i];
+          changed = GRN_TRUE;
+        }
+      }
+    } while (changed);
+  }
+  return entry;
+}
+
+/*
+  Beam search of ef rows on level from entry; found gets them nearest
+  first. Every scored row is offered to scan if it is not NULL; rows
+  scan->row_filter excludes are still traversed.
+*/
+static void
+hnsw_search_layer(const hnsw_index *index, const word2vec_model *model,
+                  const scan_query *query, pthread_mutex_t *locks,
+                  hnsw_visited *visited, hnsw_candidate entry, int level, int ef,
+                  scan_arg *scan, std::vector<hnsw_candidate> *found)
+{
+  hnsw_nearest_queue candidates;
+  hnsw_farthest_queue nearest;
+  long long links[HNSW_M0];
+  float dists[HNSW_M0];
+  int i, n, n_new;
+
+  visited->marks[entry.second] = visited->tag;
+  candidates.push(entry);
+  nearest.push(entry);
+  if (scan) {
+    offer_scan_result(scan, entry.first, entry.second, entry.second);
+  }
+  while (!candidates.empty()) {
+    hnsw_candidate candidate = candidates.top();
+    if ((long long)nearest.size() >= ef && candidate.first < nearest.top().first) {
+      break;
+    }
+    candidates.pop();
+    n = hnsw_copy_links(index, locks, candidate.second, level, links);
+    for (i = 0, n_new = 0; i < n; i++) {
+      if (visited->marks[links[i]] != visited->tag) {
+        visited->marks[links[i]] = visited->tag;
+        links[n_new++] = links[i];
+      }
+    }
+    score_rows(model, query, links, 0, n_new, dists);
+    for (i = 0; i < n_new; i++) {
+      hnsw_candidate neighbor(dists[i], (uint32_t)links[i]);
+      if (scan) {
+        offer_scan_result(scan, neighbor.first, neighbor.second, neighbor.second);
+      }
+      if ((long long)nearest.size() < ef || neighbor.first > nearest.top().first) {
+        candidates.push(neighbor);
+        nearest.push(neighbor);
+        if ((long long)nearest.size() > ef) {
+          nearest.pop();
+        }
+      }
+    }
+  }
+  found->clear();
+  while (!nearest.empty()) {
+    found->push_back(nearest.top());
+    nearest.pop();
+  }
+  std::reverse(found->begin(), found->end());
+}
+
+/*
+  Pick up to max_links of candidates (nearest first) skipping those that
+  are nearer to an already picked row than to the query, so that links
+  point in different directions.
+*/
+static int
+hnsw_select_neighbors(const word2vec_model *model,
+                      const std::vector<hnsw_candidate> &candidates, uint32_t self,
+                      int max_links, uint32_t *selected, row_query *query)
+{
+  long long kept[HNSW_M0];
+  float dists[HNSW_M0];
+  size_t i;
+  int j, n = 0;
+
+  for (i = 0; i < candidates.size() && n < max_links; i++) {
+    if (candidates[i].second == self) {
+      continue;
+    }
+    if (n > 0) {
+      score_rows(model, set_row_query(model, candidates[i].second, query, GRN_FALSE),
+                 kept, 0, n, dists);
+    }
+    for (j = 0; j < n && dists[j] <= candidates[i].first; j++) ;
+    if (j == n) {
+      kept[n] = candidates[i].second;
+      selected[n++] = candidates[i].second;
+    }
+  }
+  return n;
+}
+
+typedef struct {
+  hnsw_index *index;
+  const word2vec_model *model;
+  /* striped locks of the link lists; only one is held at a time */
+  pthread_mutex_t *locks;
+  /* held while a row above max_level is inserted */
+  pthread_mutex_t entry_mutex;
+  long long next_row;
+} hnsw_build;
+
+typedef struct {
+  hnsw_build *build;
+  hnsw_visited visited;
+  /* the inserted row, a linked row and a candidate link */
+  row_query queries[3];
+  float *buffers;
+} hnsw_build_arg;
+
+/* link from to to on level, pruning the links of from when it is full */
+static void
+hnsw_connect(hnsw_build_arg *arg, uint32_t from, uint32_t to, int level)
+{
+  hnsw_index *index = arg->build->index;
+  const word2vec_model *model = arg->build->model;
+  pthread_mutex_t *lock = &(arg->build->locks[from % HNSW_N_LOCKS]);
+  int max_links = level == 0 ? index->m0 : index->m;
+  uint32_t *list = hnsw_links(index, from, level);
+  uint32_t i, n;
+
+  pthread_mutex_lock(lock);
+  n = list[0];
+  for (i = 0; i < n && list[i + 1] != to; i++) ;
+  if (i == n) {
+    if ((int)n < max_links) {
+      list[n + 1] = to;
+      list[0] = n + 1;
+    } else {
+      std::vector<hnsw_candidate> candidates;
+      long long links[HNSW_M0 + 1];
+      float dists[HNSW_M0 + 1];
+      for (i = 0; i < n; i++) links[i] = list[i + 1];
+      links[n] = to;
+      score_rows(model, set_row_query(model, from, &(arg->queries[1]), GRN_FALSE), links, 0, n + 1, dists);
+      for (i = 0; i <= n; i++) {
+        candidates.push_back(hnsw_candidate(dists[i], (uint32_t)links[i]));
+      }
+      std::sort(candidates.begin(), candidates.end(), std::greater<hnsw_candidate>());
+      list[0] = hnsw_select_neighbors(model, candidates, from, max_links, list + 1,
+                                      &(arg->queries[2]));
+    }
+  }
+  pthread_mutex_unlock(lock);
+}
+
+static void
+hnsw_insert(hnsw_build_arg *arg, uint32_t row)
+{
+  hnsw_build *build = arg->build;
+  hnsw_index *index = build->index;
+  const word2vec_model *model = build->model;
+  pthread_mutex_t *lock = &(build->locks[row % HNSW_N_LOCKS]);
+  std::vector<hnsw_candidate> found;
+  uint32_t selected[HNSW_M0];
+  hnsw_candidate entry;
+  const scan_query *query = set_row_query(model, row, &(arg->queries[0]), GRN_TRUE);
+  int level = index->levels[row], max_level, l, i, n;
+
+  pthread_mutex_lock(&(build->entry_mutex));
+  entry.second = index->entry_point;
+  max_level = index->max_level;
+  if (level <= max_level) {
+    pthread_mutex_unlock(&(build->entry_mutex));
+  }
+  score_rows(model, query, NULL, entry.second, entry.second + 1, &entry.first);
+  entry = hnsw_greedy_search(index, model, query, build->locks, entry, max_level, level);
+  for (l = level < max_level ? level : max_level; l >= 0; l--) {
+    hnsw_next_visit(&(arg->visited), index->n_rows);
+    hnsw_search_layer(index, model, query, build->locks, &(arg->visited), entry, l,
+                      HNSW_EF_CONSTRUCTION, NULL, &found);
+    n = hnsw_select_neighbors(model, found, row, index->m, selected, &(arg->queries[2]));
+    pthread_mutex_lock(lock);
+    memcpy(hnsw_links(index, row, l) + 1, selected, n * sizeof(uint32_t));
+    hnsw_links(index, row, l)[0] = n;
+    pthread_mutex_unlock(lock);
+    for (i = 0; i < n; i++) {
+      hnsw_connect(arg, selected[i], row, l);
+    }
+    entry = found[0];
+  }
+  if (level > max_level) {
+    index->entry_point = row;
+    index->max_level = level;
+    pthread_mutex_unlock(&(build->entry_mutex));
+  }
+}
+
+static void *
+hnsw_build_rows(void *arg)
+{
+  hnsw_build_arg *build_arg = (hnsw_build_arg *)arg;
+  hnsw_build *build = build_arg->build;
+  long long row;
+
+  while ((row = __atomic_fetch_add(&(build->next_row), 1, __ATOMIC_RELAXED)) <
+         build->index->n_rows) {
+    hnsw_insert(build_arg, (uint32_t)row);
+  }
+  return NULL;
+}
+
+static size_t
+get_hnsw_memory_size(const hnsw_index *index, long long n_upper_links)
+{
+  return index->n_rows * (sizeof(uint8_t) + sizeof(uint64_t) +
+                          (index->m0 + 1) * sizeof(uint32_t)) +
+    n_upper_links * sizeof(uint32_t);
+}
+
+/*
+  Build the graph over the candidates of model with n_threads threads
+  inserting rows concurrently. Which links survive depends on the order
+  of insertion, so graphs built with different n_threads may differ.
+*/
+static hnsw_index *
+build_hnsw_index(grn_ctx *ctx, const char *file_name, const word2vec_model *model,
+                 int n_threads)
+{
+  pthread_t threads[MAX_LOAD_THREADS];
+  hnsw_build_arg args[MAX_LOAD_THREADS];
+  grn_bool started[MAX_LOAD_THREADS];
+  hnsw_build build;
+  hnsw_index *index;
+  long long i, n_rows = model->n_candidates, n_upper_links;
+  struct timespec start, end;
+  grn_bool succeeded = GRN_TRUE;
+  int t;
+
+  if (n_rows < 1 || n_rows > UINT32_MAX) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] "
+                   "Cannot build HNSW index over %lld rows : %s", n_rows, file_name);
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  index = create_hnsw_index(ctx, n_rows, HNSW_M);
+  if (index == NULL) {
+    return NULL;
+  }
+  index->levels = (uint8_t *)GRN_PLUGIN_MALLOC(ctx, n_rows);
+  if (index->levels == NULL) {
+    close_hnsw_index(ctx, index);
+    return NULL;
+  }
+  for (i = 0; i < n_rows; i++) {
+    index->levels[i] = hnsw_row_level(i, index->m);
+  }
+  n_upper_links = hnsw_compute_offsets(ctx, index);
+  index->links0 = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, n_rows * (index->m0 + 1) *
+                                                     sizeof(uint32_t));
+  index->upper_links = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, (n_upper_links + 1) *
+                                                          sizeof(uint32_t));
+  build.locks = (pthread_mutex_t *)GRN_PLUGIN_MALLOC(ctx, HNSW_N_LOCKS *
+                                                          sizeof(pthread_mutex_t));
+  if (n_upper_links < 0 || index->links0 == NULL || index->upper_links == NULL ||
+      build.locks == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] Cannot allocate HNSW index : %s", file_name);
+    if (build.locks) {
+      GRN_PLUGIN_FREE(ctx, build.locks);
+    }
+    close_hnsw_index(ctx, index);
+    return NULL;
+  }
+  memset(index->links0, 0, n_rows * (index->m0 + 1) * sizeof(uint32_t));
+  memset(index->upper_links, 0, (n_upper_links + 1) * sizeof(uint32_t));
+  index->entry_point = 0;
+  index->max_level = index->levels[0];
+
+  for (t = 0; t < HNSW_N_LOCKS; t++) {
+    pthread_mutex_init(&(build.locks[t]), NULL);
+  }
+  pthread_mutex_init(&(build.entry_mutex), NULL);
+  build.index = index;
+  build.model = model;
+  build.next_row = 1;
+
+  if (n_threads > MAX_LOAD_THREADS) {
+    n_threads = MAX_LOAD_THREADS;
+  }
+  if (n_threads > n_rows) {
+    n_threads = n_rows;
+  }
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  for (t = 0; t < n_threads; t++) {
+    args[t].build = &build;
+    args[t].visited.marks = (uint16_t *)GRN_PLUGIN_MALLOC(ctx, n_rows * sizeof(uint16_t));
+    args[t].visited.tag = 0;
+    args[t].buffers = (float *)GRN_PLUGIN_MALLOC(ctx, 3 * get_row_query_size(model) *
+                                                      sizeof(float));
+    if (args[t].visited.marks == NULL || args[t].buffers == NULL) {
+      if (args[t].visited.marks) {
+        GRN_PLUGIN_FREE(ctx, args[t].visited.marks);
+      }
+      if (args[t].buffers) {
+        GRN_PLUGIN_FREE(ctx, args[t].buffers);
+      }
+      if (t == 0) {
+        succeeded = GRN_FALSE;
+      }
+      n_threads = t;
+      break;
+    }
+    memset(args[t].visited.marks, 0, n_rows * sizeof(uint16_t));
+    for (i = 0; i < 3; i++) {
+      init_row_query(model, &(args[t].queries[i]),
+                     args[t].buffers + i * get_row_query_size(model));
+    }
+  }
+  for (t = 0; t < n_threads; t++) {
+    /* this thread inserts rows too */
+    started[t] = t > 0 && (pthread_create(&threads[t], NULL, hnsw_build_rows, &args[t]) == 0);
+  }
+  if (succeeded) {
+    hnsw_build_rows(&args[0]);
+  }
+  for (t = 0; t < n_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    }
+    GRN_PLUGIN_FREE(ctx, args[t].visited.marks);
+    GRN_PLUGIN_FREE(ctx, args[t].buffers);
+  }
+  for (t = 0; t < HNSW_N_LOCKS; t++) {
+    pthread_mutex_destroy(&(build.locks[t]));
+  }
+  pthread_mutex_destroy(&(build.entry_mutex));
+  GRN_PLUGIN_FREE(ctx, build.locks);
+
+  if (!succeeded) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] Cannot allocate HNSW index : %s", file_name);
+    close_hnsw_index(ctx, index);
+    return NULL;
+  }
+  index->memory_size = get_hnsw_memory_size(index, n_upper_links);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  GRN_PLUGIN_LOG(ctx, GRN_LOG_INFO,
+                 "[word2vec_load] "
+                 "Built HNSW index of %s : %lld rows with %d threads in %.3f sec",
+                 file_name, n_rows, n_threads,
+                 (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  return index;
+}
+
+static grn_bool
+save_hnsw_index(grn_ctx *ctx, const char *file_name, const hnsw_index *index,
+                const word2vec_model *model)
+{
+  char hnsw_file_name[max_size];
+  char tmp_file_name[max_size];
+  hnsw_file_header header;
+  struct stat st;
+  uint64_t padding = 0;
+  long long n_upper_links;
+  FILE *fo;
+  grn_bool succeeded;
+
+  if (stat(file_name, &st) == -1) {
+    return GRN_FALSE;
+  }
+  n_upper_links = index->n_rows > 0 ?
+    index->upper_offsets[index->n_rows - 1] +
+    (uint64_t)index->levels[index->n_rows - 1] * (index->m + 1) : 0;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, HNSW_MAGIC, HNSW_MAGIC_LEN);
+  header.version = HNSW_VERSION;
+  header.m = index->m;
+  header.n_rows = index->n_rows;
+  header.dim_size = model->dim_size;
+  header.model_size = st.st_size;
+  header.model_mtime = st.st_mtim.tv_sec;
+  header.model_mtime_nsec = st.st_mtim.tv_nsec;
+  header.n_upper_links = n_upper_links;
+  header.max_level = index->max_level;
+  header.entry_point = index->entry_point;
+
+  get_hnsw_file_path(file_name, hnsw_file_name);
+  snprintf(tmp_file_name, max_size, "%s.tmp", hnsw_file_name);
+  fo = fopen(tmp_file_name, "wb");
+  if (fo == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] Cannot create HNSW index file : %s", tmp_file_name);
+    return GRN_FALSE;
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  fwrite(index->levels, 1, index->n_rows, fo);
+  fwrite(&padding, 1, (8 - index->n_rows % 8) % 8, fo);
+  fwrite(index->links0, sizeof(uint32_t), index->n_rows * (index->m0 + 1), fo);
+  fwrite(index->upper_links, sizeof(uint32_t), n_upper_links, fo);
+  succeeded = !ferror(fo);
+  if (fclose(fo) != 0) {
+    succeeded = GRN_FALSE;
+  }
+  if (!succeeded || rename(tmp_file_name, hnsw_file_name) != 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] Cannot write HNSW index file : %s", hnsw_file_name);
+    unlink(tmp_file_name);
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+/* every link count and target is in range */
+static grn_bool
+hnsw_links_are_valid(const hnsw_index *index)
+{
+  long long i;
+  int level, j;
+
+  if (index->entry_point >= index->n_rows ||
+      index->levels[index->entry_point] != index->max_level) {
+    return GRN_FALSE;
+  }
+  for (i = 0; i < index->n_rows; i++) {
+    if (index->levels[i] > index->max_level) {
+      return GRN_FALSE;
+    }
+    for (level = 0; level <= index->levels[i]; level++) {
+      const uint32_t *list = hnsw_links(index, i, level);
+      if ((int)list[0] > (level == 0 ? index->m0 : index->m)) {
+        return GRN_FALSE;
+      }
+      for (j = 1; j <= (int)list[0]; j++) {
+        if (list[j] >= index->n_rows || index->levels[list[j]] < level) {
+          return GRN_FALSE;
+        }
+      }
+    }
+  }
+  return GRN_TRUE;
+}
+
+/* map the .hnsw file of file_name if it was built from this model file and rows */
+static hnsw_index *
+open_hnsw_index(grn_ctx *ctx, const char *file_name, const word2vec_model *model)
+{
+  char hnsw_file_name[max_size];
+  const hnsw_file_header *header;
+  struct stat model_st, st;
+  hnsw_index *index;
+  uint64_t levels_size, links0_size;
+  void *map;
+  int fd;
+
+  get_hnsw_file_path(file_name, hnsw_file_name);
+  if (stat(file_name, &model_st) == -1) {
+    return NULL;
+  }
+  fd = open(hnsw_file_name, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(hnsw_file_header)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  header = (const hnsw_file_header *)map;
+  levels_size = (header->n_rows + 7) & ~(uint64_t)7;
+  links0_size = header->n_rows * (2 * HNSW_M + 1) * sizeof(uint32_t);
+  if (memcmp(header->magic, HNSW_MAGIC, HNSW_MAGIC_LEN) != 0 ||
+      header->version != HNSW_VERSION || header->m != HNSW_M ||
+      header->n_rows != (uint64_t)model->n_candidates ||
+      header->dim_size != (uint64_t)model->dim_size ||
+      header->model_size != (uint64_t)model_st.st_size ||
+      header->model_mtime != (int64_t)model_st.st_mtim.tv_sec ||
+      header->model_mtime_nsec != (int64_t)model_st.st_mtim.tv_nsec ||
+      header->max_level > HNSW_MAX_LEVEL ||
+      (uint64_t)st.st_size != sizeof(hnsw_file_header) + levels_size + links0_size +
+      header->n_upper_links * sizeof(uint32_t)) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  index = create_hnsw_index(ctx, header->n_rows, header->m);
+  if (index == NULL) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  index->map = map;
+  index->map_size = st.st_size;
+  index->max_level = header->max_level;
+  index->entry_point = header->entry_point;
+  index->levels = (uint8_t *)map + sizeof(hnsw_file_header);
+  index->links0 = (uint32_t *)(index->levels + levels_size);
+  index->upper_links = (uint32_t *)((char *)index->links0 + links0_size);
+  if (hnsw_compute_offsets(ctx, index) != (long long)header->n_upper_links ||
+      !hnsw_links_are_valid(index)) {
+    close_hnsw_index(ctx, index);
+    return NULL;
+  }
+  index->memory_size = get_hnsw_memory_size(index, header->n_upper_links);
+  return index;
+}
+
+/*
+  Search the graph for the rows nearest to query, offering every row
+  scored on the bottom level to scan. Returns GRN_FALSE if no visited
+  marks could be allocated.
+*/
+static grn_bool
+hnsw_search_rows(grn_ctx *ctx, const word2vec_model *model, const scan_query *query,
+                 int ef, scan_arg *scan)
+{
+  hnsw_index *index = model->hnsw;
+  std::vector<hnsw_candidate> found;
+  hnsw_visited *visited;
+  hnsw_candidate entry;
+
+  visited = hnsw_acquire_visited(ctx, index);
+  if (visited == NULL) {
+    return GRN_FALSE;
+  }
+  entry.second = index->entry_point;
+  score_rows(model, query, NULL, entry.second, entry.second + 1, &entry.first);
+  entry = hnsw_greedy_search(index, model, query, NULL, entry, index->max_level, 0);
+  hnsw_search_layer(index, model, query, NULL, visited, entry, 0, ef,
+                    scan, &found);
+  hnsw_release_visited(index, visited);
+  return GRN_TRUE;
+}
+
+typedef struct {
+  char magic[IVF_MAGIC_LEN];
+  uint32_t version;
+  uint32_t n_lists;
+  uint64_t n_rows;
+  uint64_t dim_size;
+  /* size and mtime of the model file the lists were built from */
+  uint64_t model_size;
+  int64_t model_mtime;
+  int64_t model_mtime_nsec;
+  /* precision of the grouped rows (PQ with pq_subspaces), none if rows_size is 0 */
+  uint32_t precision;
+  uint32_t pq_subspaces;
+  uint64_t rows_size;
+} ivf_file_header;
+
+/*
+  .ivf file layout (host byte order):
+
+    ivf_file_header
+    uint64_t list_offsets[n_lists + 1]
+    float centroids[n_lists][dim_size]   L2-normalized
+    uint32_t list_rows[n_rows]
+    float row_scale[n_rows]              int8 rows only, in list order
+    rows[rows_size]                      M, M16, M8 or pq_codes in list order
+*/
+static void
+get_ivf_file_path(const char *file_name, char *ivf_file_name)
+{
+  snprintf(ivf_file_name, max_size, "%s%s", file_name, IVF_FILE_SUFFIX);
+}
+
+static ivf_index *
+create_ivf_index(grn_ctx *ctx, long long n_rows, int n_lists, long long dim_size)
+{
+  ivf_index *index;
+
+  index = (ivf_index *)GRN_PLUGIN_MALLOC(ctx, sizeof(ivf_index));
+  if (index == NULL) {
+    return NULL;
+  }
+  memset(index, 0, sizeof(ivf_index));
+  index->n_rows = n_rows;
+  index->n_lists = n_lists;
+  index->dim_size = dim_size;
+  return index;
+}
+
+typedef struct {
+  const word2vec_model *model;
+  const float *centroids;
+  int n_lists;
+  const long long *rows;              /* NULL to assign rows start..end - 1 */
+  long long start;
+  long long end;
+  /* lists[p]: the centroid nearest to the p-th row, similarities[p]: its score */
+  uint32_t *lists;
+  float *similarities;
+  row_query query;
+} ivf_assign_arg;
+
+static void *
+ivf_assign_rows(void *arg)
+{
+  ivf_assign_arg *assign = (ivf_assign_arg *)arg;
+  const word2vec_model *model = assign->model;
+  long long p, size = model->dim_size;
+  int l;
+
+  for (p = assign->start; p < assign->end; p++) {
+    const float *vec = set_row_query(model, assign->rows ? assign->rows[p] : p,
+                                     &(assign->query), GRN_FALSE)->vec;
+    float best = dot_f32(vec, assign->centroids, size);
+    uint32_t best_list = 0;
+    for (l = 1; l < assign->n_lists; l++) {
+      float dist = dot_f32(vec, assign->centroids + l * size, size);
+      if (dist > best) {
+        best = dist;
+        best_list = l;
+      }
+    }
+    assign->lists[p] = best_list;
+    if (assign->similarities) {
+      assign->similarities[p] = best;
+    }
+  }
+  return NULL;
+}
+
+/* assign rows[0..n_rows) (rows 0..n_rows - 1 if rows is NULL) to their nearest centroids */
+static grn_bool
+ivf_assign(grn_ctx *ctx, const word2vec_model *model, const float *centroids, int n_lists,
+           const long long *rows, long long n_rows, int n_threads,
+           uint32_t *lists, float *similarities)
+{
+  pthread_t threads[MAX_LOAD_THREADS];
+  ivf_assign_arg args[MAX_LOAD_THREADS];
+  grn_bool started[MAX_LOAD_THREADS];
+  long long rows_per_thread, query_size = get_row_query_size(model);
+  float *buffers;
+  int t;
+
+  if (n_threads > MAX_LOAD_THREADS) {
+    n_threads = MAX_LOAD_THREADS;
+  }
+  if (n_threads > n_rows) {
+    n_threads = n_rows;
+  }
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  buffers = (float *)GRN_PLUGIN_MALLOC(ctx, n_threads * query_size * sizeof(float));
+  if (buffers == NULL) {
+    return GRN_FALSE;
+  }
+  rows_per_thread = (n_rows + n_threads - 1) / n_threads;
+  for (t = 0; t < n_threads; t++) {
+    args[t].model = model;
+    args[t].centroids = centroids;
+    args[t].n_lists = n_lists;
+    args[t].rows = rows;
+    args[t].start = t * rows_per_thread < n_rows ? t * rows_per_thread : n_rows;
+    args[t].end = (t + 1) * rows_per_thread < n_rows ? (t + 1) * rows_per_thread : n_rows;
+    args[t].lists = lists;
+    args[t].similarities = similarities;
+    init_row_query(model, &(args[t].query), buffers + t * query_size);
+    /* this thread assigns the first range */
+    started[t] = t > 0 && (pthread_create(&threads[t], NULL, ivf_assign_rows, &args[t]) == 0);
+  }
+  for (t = 0; t < n_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      ivf_assign_rows(&args[t]);
+    }
+  }
+  GRN_PLUGIN_FREE(ctx, buffers);
+  return GRN_TRUE;
+}
+
+/*
+  Spherical k-means over evenly spaced sample rows, then every candidate
+  goes to its nearest centroid. Sums are accumulated on this thread, so
+  the lists do not depend on n_threads. A list left empty is reseeded
+  with the sample its centroid fits worst. n_lists 0 picks about
+  sqrt(candidates) lists.
+*/
+static ivf_index *
+build_ivf_index(grn_ctx *ctx, const char *file_name, const word2vec_model *model,
+                int n_lists, int n_threads)
+{
+  ivf_index *index;
+  long long n_rows = model->n_candidates, size = model->dim_size, n_samples, i;
+  long long *samples = NULL, *counts = NULL;
+  uint32_t *lists = NULL;
+  float *similarities = NULL, *buffer = NULL;
+  row_query query;
+  struct timespec start, end;
+  grn_bool succeeded = GRN_FALSE;
+  int iteration, l;
+
+  if (n_rows < 1 || n_rows > UINT32_MAX) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] "
+                   "Cannot build IVF index over %lld rows : %s", n_rows, file_name);
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (n_lists <= 0) {
+    n_lists = (int)sqrt((double)n_rows);
+  }
+  if (n_lists < 1) {
+    n_lists = 1;
+  }
+  if (n_lists > n_rows) {
+    n_lists = n_rows;
+  }
+  n_samples = (long long)n_lists * IVF_TRAIN_SAMPLE_PER_LIST;
+  if (n_samples > n_rows) {
+    n_samples = n_rows;
+  }
+  index = create_ivf_index(ctx, n_rows, n_lists, size);
+  if (index == NULL) {
+    return NULL;
+  }
+  index->centroids = (float *)GRN_PLUGIN_MALLOC(ctx, n_lists * size * sizeof(float));
+  index->list_offsets = (uint64_t *)GRN_PLUGIN_MALLOC(ctx, (n_lists + 1) * sizeof(uint64_t));
+  index->list_rows = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, n_rows * sizeof(uint32_t));
+  samples = (long long *)GRN_PLUGIN_MALLOC(ctx, n_samples * sizeof(long long));
+  counts = (long long *)GRN_PLUGIN_MALLOC(ctx, n_lists * sizeof(long long));
+  lists = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, n_rows * sizeof(uint32_t));
+  similarities = (float *)GRN_PLUGIN_MALLOC(ctx, n_samples * sizeof(float));
+  buffer = (float *)GRN_PLUGIN_MALLOC(ctx, get_row_query_size(model) * sizeof(float));
+  if (index->centroids == NULL || index->list_offsets == NULL || index->list_rows == NULL ||
+      samples == NULL || counts == NULL || lists == NULL || similarities == NULL ||
+      buffer == NULL) {
+    goto exit;
+  }
+  init_row_query(model, &query, buffer);
+
+  for (i = 0; i < n_samples; i++) {
+    samples[i] = i * n_rows / n_samples;
+  }
+  for (l = 0; l < n_lists; l++) {
+    memcpy(index->centroids + l * size,
+           set_row_query(model, samples[l * n_samples / n_lists], &query, GRN_FALSE)->vec,
+           size * sizeof(float));
+  }
+  for (iteration = 0; iteration < IVF_KMEANS_ITERATIONS; iteration++) {
+    std::vector<std::pair<float, long long> > worst;
+    if (!ivf_assign(ctx, model, index->centroids, n_lists, samples, n_samples, n_threads,
+                    lists, similarities)) {
+      goto exit;
+    }
+    memset(index->centroids, 0, n_lists * size * sizeof(float));
+    memset(counts, 0, n_lists * sizeof(long long));
+    for (i = 0; i < n_samples; i++) {
+      const float *vec = set_row_query(model, samples[i], &query, GRN_FALSE)->vec;
+      float *centroid = index->centroids + lists[i] * size;
+      long long a;
+      for (a = 0; a < size; a++) centroid[a] += vec[a];
+      counts[lists[i]]++;
+    }
+    for (l = 0; l < n_lists; l++) {
+      float *centroid = index->centroids + l * size;
+      if (counts[l] == 0) {
+        /* n_samples >= n_lists, so there are enough samples to reseed with */
+        if (worst.empty()) {
+          for (i = 0; i < n_samples; i++) {
+            worst.push_back(std::pair<float, long long>(similarities[i], samples[i]));
+          }
+          std::sort(worst.begin(), worst.end(), std::greater<std::pair<float, long long> >());
+        }
+        memcpy(centroid, set_row_query(model, worst.back().second, &query, GRN_FALSE)->vec,
+               size * sizeof(float));
+        worst.pop_back();
+      }
+      if (dot_f32(centroid, centroid, size) > 0) {
+        normalize_row(centroid, size);
+      }
+    }
+  }
+
+  if (!ivf_assign(ctx, model, index->centroids, n_lists, NULL, n_rows, n_threads,
+                  lists, NULL)) {
+    goto exit;
+  }
+  memset(counts, 0, n_lists * sizeof(long long));
+  for (i = 0; i < n_rows; i++) {
+    counts[lists[i]]++;
+  }
+  index->list_offsets[0] = 0;
+  for (l = 0; l < n_lists; l++) {
+    index->list_offsets[l + 1] = index->list_offsets[l] + counts[l];
+    counts[l] = index->list_offsets[l];
+  }
+  for (i = 0; i < n_rows; i++) {
+    index->list_rows[counts[lists[i]]++] = (uint32_t)i;
+  }
+  succeeded = GRN_TRUE;
+
+exit :
+  if (samples) {
+    GRN_PLUGIN_FREE(ctx, samples);
+  }
+  if (counts) {
+    GRN_PLUGIN_FREE(ctx, counts);
+  }
+  if (lists) {
+    GRN_PLUGIN_FREE(ctx, lists);
+  }
+  if (similarities) {
+    GRN_PLUGIN_FREE(ctx, similarities);
+  }
+  if (buffer) {
+    GRN_PLUGIN_FREE(ctx, buffer);
+  }
+  if (!succeeded) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] Cannot allocate IVF index : %s", file_name);
+    close_ivf_index(ctx, index);
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  GRN_PLUGIN_LOG(ctx, GRN_LOG_INFO,
+                 "[word2vec_load] "
+                 "Built IVF index of %s : %lld rows in %d lists with %d threads in %.3f sec",
+                 file_name, n_rows, n_lists, n_threads,
+                 (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+  return index;
+}
+
+/*
+  Write the lists of index and, unless model is NULL, the scanned rows of
+  model in list order, so that a load maps them instead of grouping them.
+*/
+static grn_bool
+save_ivf_index(grn_ctx *ctx, const char *file_name, const ivf_index *index,
+               const word2vec_model *model)
+{
+  char ivf_file_name[max_size];
+  char tmp_file_name[max_size];
+  ivf_file_header header;
+  struct stat st;
+  FILE *fo;
+  const char *rows = NULL;
+  size_t rows_size = 0, row_size = 0;
+  long long p;
+  grn_bool succeeded;
+
+  if (stat(file_name, &st) == -1) {
+    return GRN_FALSE;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, IVF_MAGIC, IVF_MAGIC_LEN);
+  header.version = IVF_VERSION;
+  header.n_lists = index->n_lists;
+  header.n_rows = index->n_rows;
+  header.dim_size = index->dim_size;
+  header.model_size = st.st_size;
+  header.model_mtime = st.st_mtim.tv_sec;
+  header.model_mtime_nsec = st.st_mtim.tv_nsec;
+  if (model != NULL) {
+    rows = (const char *)get_scan_rows(model, &rows_size);
+    row_size = rows_size / index->n_rows;
+    header.precision = model->precision;
+    header.pq_subspaces = model->precision == MODEL_PRECISION_PQ ? model->pq_subspaces : 0;
+    header.rows_size = rows_size;
+  }
+
+  get_ivf_file_path(file_name, ivf_file_name);
+  snprintf(tmp_file_name, max_size, "%s.tmp", ivf_file_name);
+  fo = fopen(tmp_file_name, "wb");
+  if (fo == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] Cannot create IVF index file : %s", tmp_file_name);
+    return GRN_FALSE;
+  }
+  fwrite(&header, sizeof(header), 1, fo);
+  fwrite(index->list_offsets, sizeof(uint64_t), index->n_lists + 1, fo);
+  fwrite(index->centroids, sizeof(float), index->n_lists * index->dim_size, fo);
+  fwrite(index->list_rows, sizeof(uint32_t), index->n_rows, fo);
+  if (rows != NULL && model->precision == MODEL_PRECISION_INT8) {
+    for (p = 0; p < index->n_rows; p++) {
+      fwrite(model->row_scale + index->list_rows[p], sizeof(float), 1, fo);
+    }
+  }
+  for (p = 0; rows != NULL && p < index->n_rows; p++) {
+    fwrite(rows + index->list_rows[p] * row_size, row_size, 1, fo);
+  }
+  succeeded = !ferror(fo);
+  if (fclose(fo) != 0) {
+    succeeded = GRN_FALSE;
+  }
+  if (!succeeded || rename(tmp_file_name, ivf_file_name) != 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] Cannot write IVF index file : %s", ivf_file_name);
+    unlink(tmp_file_name);
+    return GRN_FALSE;
+  }
+  return GRN_TRUE;
+}
+
+/* the lists partition the rows: offsets ascend to n_rows and every row is listed once */
+static grn_bool
+ivf_lists_are_valid(grn_ctx *ctx, const ivf_index *index)
+{
+  uint8_t *listed;
+  long long i;
+  int l;
+  grn_bool valid = GRN_TRUE;
+
+  if (index->list_offsets[0] != 0 ||
+      index->list_offsets[index->n_lists] != (uint64_t)index->n_rows) {
+    return GRN_FALSE;
+  }
+  for (l = 0; l < index->n_lists; l++) {
+    if (index->list_offsets[l] > index->list_offsets[l + 1]) {
+      return GRN_FALSE;
+    }
+  }
+  listed = (uint8_t *)GRN_PLUGIN_MALLOC(ctx, (index->n_rows + 7) / 8);
+  if (listed == NULL) {
+    return GRN_FALSE;
+  }
+  memset(listed, 0, (index->n_rows + 7) / 8);
+  for (i = 0; i < index->n_rows && valid; i++) {
+    uint32_t row = index->list_rows[i];
+    if (row >= index->n_rows || (listed[row >> 3] & (1 << (row & 7)))) {
+      valid = GRN_FALSE;
+    } else {
+      listed[row >> 3] |= 1 << (row & 7);
+    }
+  }
+  GRN_PLUGIN_FREE(ctx, listed);
+  return valid;
+}
+
+/*
+  map the .ivf file of file_name if it was built from this model file
+  and rows with n_lists lists (any number if 0). The grouped rows are
+  used only if they are in the precision of model; otherwise rows is NULL.
+*/
+static ivf_index *
+open_ivf_index(grn_ctx *ctx, const char *file_name, const word2vec_model *model,
+               int n_lists)
+{
+  char ivf_file_name[max_size];
+  const ivf_file_header *header;
+  struct stat model_st, st;
+  ivf_index *index;
+  uint64_t offsets_size, centroids_size, list_rows_size, scales_size;
+  size_t rows_size;
+  void *map;
+  int fd;
+
+  get_ivf_file_path(file_name, ivf_file_name);
+  if (stat(file_name, &model_st) == -1) {
+    return NULL;
+  }
+  fd = open(ivf_file_name, O_RDONLY);
+  if (fd == -1) {
+    return NULL;
+  }
+  if (fstat(fd, &st) == -1 || (uint64_t)st.st_size < sizeof(ivf_file_header)) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  header = (const ivf_file_header *)map;
+  offsets_size = ((uint64_t)header->n_lists + 1) * sizeof(uint64_t);
+  centroids_size = (uint64_t)header->n_lists * header->dim_size * sizeof(float);
+  list_rows_size = header->n_rows * sizeof(uint32_t);
+  scales_size = (header->rows_size > 0 && header->precision == MODEL_PRECISION_INT8) ?
+    header->n_rows * sizeof(float) : 0;
+  if (memcmp(header->magic, IVF_MAGIC, IVF_MAGIC_LEN) != 0 ||
+      header->version != IVF_VERSION || header->n_lists < 1 ||
+      header->n_lists > header->n_rows ||
+      (n_lists > 0 && header->n_lists != (uint32_t)n_lists) ||
+      header->n_rows != (uint64_t)model->n_candidates ||
+      header->dim_size != (uint64_t)model->dim_size ||
+      header->model_size != (uint64_t)model_st.st_size ||
+      header->model_mtime != (int64_t)model_st.st_mtim.tv_sec ||
+      header->model_mtime_nsec != (int64_t)model_st.st_mtim.tv_nsec ||
+      (uint64_t)st.st_size != sizeof(ivf_file_header) + offsets_size + centroids_size +
+      list_rows_size + scales_size + header->rows_size) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  index = create_ivf_index(ctx, header->n_rows, header->n_lists, header->dim_size);
+  if (index == NULL) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  index->map = map;
+  index->map_size = st.st_size;
+  index->list_offsets = (uint64_t *)((char *)map + sizeof(ivf_file_header));
+  index->centroids = (float *)((char *)index->list_offsets + offsets_size);
+  index->list_rows = (uint32_t *)((char *)index->centroids + centroids_size);
+  if (!ivf_lists_are_valid(ctx, index)) {
+    close_ivf_index(ctx, index);
+    return NULL;
+  }
+  get_scan_rows(model, &rows_size);
+  if (header->rows_size > 0 && header->rows_size == rows_size &&
+      header->precision == (uint32_t)model->precision &&
+      (model->precision != MODEL_PRECISION_PQ ||
+       header->pq_subspaces == (uint32_t)model->pq_subspaces)) {
+    if (scales_size > 0) {
+      index->row_scale = (float *)((char *)index->list_rows + list_rows_size);
+    }
+    index->rows = (char *)index->list_rows + list_rows_size + scales_size;
+  }
+  return index;
+}
+
+/*
+  Group the scanned rows of model (and int8 scales) in list order in
+  memory, on the pages the options of the model ask for. Only used when
+  the grouped rows cannot be mapped from the .ivf file.
+*/
+static grn_bool
+group_ivf_rows(grn_ctx *ctx, ivf_index *index, word2vec_model *model)
+{
+  const char *rows;
+  char *grouped;
+  size_t rows_size, row_size, map_size;
+  model_pages pages = model->option.pages;
+  long long p;
+
+  rows = (const char *)get_scan_rows(model, &rows_size);
+  row_size = rows_size / index->n_rows;
+  grouped = (char *)map_rows(rows_size, &pages, &map_size);
+  if (grouped == NULL) {
+    return GRN_FALSE;
+  }
+  for (p = 0; p < index->n_rows; p++) {
+    memcpy(grouped + p * row_size, rows + index->list_rows[p] * row_size, row_size);
+  }
+  index->rows = grouped;
+  index->rows_map_size = map_size;
+  if (model->precision == MODEL_PRECISION_INT8) {
+    index->row_scale = (float *)GRN_PLUGIN_MALLOC(ctx, index->n_rows * sizeof(float));
+    if (index->row_scale == NULL) {
+      return GRN_FALSE;
+    }
+    for (p = 0; p < index->n_rows; p++) {
+      index->row_scale[p] = model->row_scale[index->list_rows[p]];
+    }
+  }
+  return GRN_TRUE;
+}
+
+/*
+  Place the grouped rows as the options of the model ask (NUMA copies,
+  mlock), like the rows in finish_model. Rows mapped from the .ivf file
+  stay in the page cache with normal pages.
+*/
+static grn_bool
+place_ivf_rows(grn_ctx *ctx, ivf_index *index, word2vec_model *model)
+{
+  size_t rows_size;
+  model_pages pages = model->option.pages;
+  int i;
+
+  get_scan_rows(model, &rows_size);
+  if (index->rows == NULL && !group_ivf_rows(ctx, index, model)) {
+    return GRN_FALSE;
+  }
+  if (model->option.numa != NUMA_MODE_NONE) {
+    index->numa_rows = copy_numa_rows(ctx, (const char *)index->rows, rows_size,
+                                      model->option.numa, &pages,
+                                      &(index->n_numa_rows), &(index->numa_rows_size));
+  }
+  /* unlike the rows of the model, the rows in list order are only scanned */
+  if (index->numa_rows != NULL) {
+    if (index->rows_map_size > 0) {
+      munmap(index->rows, index->rows_map_size);
+    }
+    index->rows = NULL;
+  }
+  if (model->locked) {
+    grn_bool locked = (index->rows == NULL || mlock(index->rows, rows_size) == 0);
+    for (i = 0; locked && i < index->n_numa_rows; i++) {
+      locked = (mlock(index->numa_rows[i], index->numa_rows_size) == 0);
+    }
+    if (!locked) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                     "[word2vec_load] "
+                     "Cannot lock IVF rows in memory : %s", strerror(errno));
+      model->locked = GRN_FALSE;
+    }
+  }
+  index->memory_size = (index->rows ? rows_size : 0) +
+    index->n_numa_rows * index->numa_rows_size +
+    (index->row_scale ? index->n_rows * sizeof(float) : 0) +
+    (index->n_lists + 1) * sizeof(uint64_t) +
+    index->n_lists * index->dim_size * sizeof(float) +
+    index->n_rows * sizeof(uint32_t);
+  return GRN_TRUE;
+}
+
+/*
+  Scan the nprobe lists whose centroids are nearest to query, offering
+  their rows to scan in list order. Returns GRN_FALSE if the lists could
+  not be ranked.
+*/
+static grn_bool
+ivf_search_rows(grn_ctx *ctx, const word2vec_model *model, const scan_query *query,
+                int nprobe, scan_arg *scan)
+{
+  ivf_index *index = model->ivf;
+  word2vec_model view = *model;
+  top_k lists;
+  long long i;
+  int l;
+
+  if (nprobe > index->n_lists) {
+    nprobe = index->n_lists;
+  }
+  if (nprobe < 1) {
+    nprobe = 1;
+  }
+  if (!top_k_init(ctx, &lists, nprobe)) {
+    return GRN_FALSE;
+  }
+  for (l = 0; l < index->n_lists; l++) {
+    top_k_push(&lists, dot_f32(query->vec, index->centroids + l * index->dim_size,
+                               index->dim_size), l, l);
+  }
+  set_scan_rows(&view, index->n_numa_rows > 0 ?
+                get_local_numa_rows(index->numa_rows, index->n_numa_rows) : index->rows);
+  if (index->row_scale) {
+    view.row_scale = index->row_scale;
+  }
+  scan->model = &view;
+  scan->rows = NULL;
+  scan->row_ids = index->list_rows;
+  for (i = 0; i < lists.n; i++) {
+    scan->start = index->list_offsets[lists.results[i].row];
+    scan->end = index->list_offsets[lists.results[i].row + 1];
+    scan_partition(scan);
+  }
+  scan->model = model;
+  top_k_fin(ctx, &lists);
+  return GRN_TRUE;
+}
+
+/* deterministic standard normal numbers: Box-Muller over two splitmix64 values */
+static float
+lsh_random_normal(uint64_t i)
+{
+  double u1 = ((splitmix64(2 * i) >> 11) + 1) * (1.0 / 9007199254740992.0);
+  double u2 = (splitmix64(2 * i + 1) >> 11) * (1.0 / 9007199254740992.0);
+  return (float)(sqrt(-2 * log(u1)) * cos(2 * M_PI * u2));
+}
+
+static inline uint32_t
+lsh_signature(const lsh_index *index, int table, const float *vec)
+{
+  const float *plane = index->planes + (long long)table * index->n_bits * index->dim_size;
+  uint32_t signature = 0;
+  int b;
+
+  for (b = 0; b < index->n_bits; b++, plane += index->dim_size) {
+    if (dot_f32(vec, plane, index->dim_size) >= 0) {
+      signature |= 1U << b;
+    }
+  }
+  return signature;
+}
+
+typedef struct {
+  const lsh_index *index;
+  const word2vec_model *model;
+  long long start;
+  long long end;
+  uint16_t *signatures;               /* [n_rows][n_tables] */
+  row_query query;
+} lsh_sign_arg;
+
+static void *
+lsh_sign_rows(void *arg)
+{
+  lsh_sign_arg *sign = (lsh_sign_arg *)arg;
+  const lsh_index *index = sign->index;
+  long long row;
+  int t;
+
+  for (row = sign->start; row < sign->end; row++) {
+    const float *vec = set_row_query(sign->model, row, &(sign->query), GRN_FALSE)->vec;
+    for (t = 0; t < index->n_tables; t++) {
+      sign->signatures[row * index->n_tables + t] = lsh_signature(index, t, vec);
+    }
+  }
+  return NULL;
+}
+
+/*
+  Hash every candidate into n_tables tables (LSH_N_TABLES if 0) with
+  n_threads threads. Buckets hold about LSH_BUCKET_ROWS rows, and the
+  hyperplanes are the same on every load, so the tables only depend on
+  the rows.
+*/
+static lsh_index *
+build_lsh_index(grn_ctx *ctx, const char *file_name, const word2vec_model *model,
+                int n_tables, int n_threads)
+{
+  pthread_t threads[MAX_LOAD_THREADS];
+  lsh_sign_arg args[MAX_LOAD_THREADS];
+  grn_bool started[MAX_LOAD_THREADS];
+  lsh_index *index;
+  long long n_rows = model->n_candidates, size = model->dim_size, i, query_size;
+  long long n_planes, rows_per_thread;
+  uint16_t *signatures = NULL;
+  uint32_t *cursors = NULL;
+  float *buffers = NULL;
+  struct timespec start, end;
+  int n_bits, n_buckets, t;
+
+  if (n_rows < 1 || n_rows > UINT32_MAX) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] "
+                   "Cannot build LSH index over %lld rows : %s", n_rows, file_name);
+    return NULL;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (n_tables <= 0) {
+    n_tables = LSH_N_TABLES;
+  }
+  if (n_tables > LSH_MAX_TABLES) {
+    n_tables = LSH_MAX_TABLES;
+  }
+  for (n_bits = 1;
+       n_bits < LSH_MAX_BITS && ((long long)LSH_BUCKET_ROWS << (n_bits + 1)) <= n_rows;
+       n_bits++) ;
+  n_buckets = 1 << n_bits;
+  n_planes = (long long)n_tables * n_bits;
+
+  index = (lsh_index *)GRN_PLUGIN_MALLOC(ctx, sizeof(lsh_index));
+  if (index == NULL) {
+    return NULL;
+  }
+  memset(index, 0, sizeof(lsh_index));
+  index->n_rows = n_rows;
+  index->n_tables = n_tables;
+  index->n_bits = n_bits;
+  index->dim_size = size;
+
+  if (n_threads > MAX_LOAD_THREADS) {
+    n_threads = MAX_LOAD_THREADS;
+  }
+  if (n_threads > n_rows) {
+    n_threads = n_rows;
+  }
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  query_size = get_row_query_size(model);
+  index->planes = (float *)GRN_PLUGIN_MALLOC(ctx, n_planes * size * sizeof(float));
+  index->bucket_offsets = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, (long long)n_tables *
+                                                             (n_buckets + 1) * sizeof(uint32_t));
+  index->bucket_rows = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, n_tables * n_rows * sizeof(uint32_t));
+  signatures = (uint16_t *)GRN_PLUGIN_MALLOC(ctx, n_rows * n_tables * sizeof(uint16_t));
+  cursors = (uint32_t *)GRN_PLUGIN_MALLOC(ctx, n_buckets * sizeof(uint32_t));
+  buffers = (float *)GRN_PLUGIN_MALLOC(ctx, n_threads * query_size * sizeof(float));
+  if (index->planes == NULL || index->bucket_offsets == NULL || index->bucket_rows == NULL ||
+      signatures == NULL || cursors == NULL || buffers == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] Cannot allocate LSH index : %s", file_name);
+    close_lsh_index(ctx, index);
+    index = NULL;
+    goto exit;
+  }
+  for (i = 0; i < n_planes * size; i++) {
+    index->planes[i] = lsh_random_normal(i);
+  }
+
+  rows_per_thread = (n_rows + n_threads - 1) / n_threads;
+  for (t = 0; t < n_threads; t++) {
+    args[t].index = index;
+    args[t].model = model;
+    args[t].start = t * rows_per_thread < n_rows ? t * rows_per_thread : n_rows;
+    args[t].end = (t + 1) * rows_per_thread < n_rows ? (t + 1) * rows_per_thread : n_rows;
+    args[t].signatures = signatures;
+    init_row_query(model, &(args[t].query), buffers + t * query_size);
+    /* this thread signs the first range */
+    started[t] = t > 0 && (pthread_create(&threads[t], NULL, lsh_sign_rows, &args[t]) == 0);
+  }
+  for (t = 0; t < n_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      lsh_sign_rows(&args[t]);
+    }
+  }
+
+  for (t = 0; t < n_tables; t++) {
+    uint32_t *offsets = index->bucket_offsets + (long long)t * (n_buckets + 1);
+    uint32_t *rows = index->bucket_rows + t * n_rows;
+    int b;
+    memset(offsets, 0, (n_buckets + 1) * sizeof(uint32_t));
+    for (i = 0; i < n_rows; i++) {
+      offsets[signatures[i * n_tables + t] + 1]++;
+    }
+    for (b = 0; b < n_buckets; b++) {
+      offsets[b + 1] += offsets[b];
+      cursors[b] = offsets[b];
+    }
+    for (i = 0; i < n_rows; i++) {
+      rows[cursors[signatures[i * n_tables + t]]++] = (uint32_t)i;
+    }
+  }
+  index->memory_size = (n_planes * size + (long long)n_tables * (n_buckets + 1) +
+                        n_tables * n_rows) * sizeof(uint32_t);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  GRN_PLUGIN_LOG(ctx, GRN_LOG_INFO,
+                 "[word2vec_load] "
+                 "Built LSH index of %s : %lld rows in %d tables of %d bits "
+                 "with %d threads in %.3f sec",
+                 file_name, n_rows, n_tables, n_bits, n_threads,
+                 (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+
+exit :
+  if (signatures) {
+    GRN_PLUGIN_FREE(ctx, signatures);
+  }
+  if (cursors) {
+    GRN_PLUGIN_FREE(ctx, cursors);
+  }
+  if (buffers) {
+    GRN_PLUGIN_FREE(ctx, buffers);
+  }
+  return index;
+}
+
+static inline void
+lsh_mark_bucket(const uint32_t *offsets, const uint32_t *bucket_rows, uint32_t bucket,
+                uint64_t *marks)
+{
+  uint32_t p;
+
+  for (p = offsets[bucket]; p < offsets[bucket + 1]; p++) {
+    marks[bucket_rows[p] >> 6] |= 1ULL << (bucket_rows[p] & 63);
+  }
+}
+
+/*
+  The rows that share a bucket with vec in some table, probing also the
+  buckets whose signatures differ in up to probe bits. They are marked
+  in a bitmap so that they come out in row order without duplicates.
+*/
+static void
+lsh_collect_rows(const lsh_index *index, const float *vec, int probe,
+                 std::vector<long long> &rows)
+{
+  std::vector<uint64_t> marks((index->n_rows + 63) / 64, 0);
+  long long n_buckets = 1LL << index->n_bits, w;
+  int t, b, c;
+
+  for (t = 0; t < index->n_tables; t++) {
+    const uint32_t *offsets = index->bucket_offsets + t * (n_buckets + 1);
+    const uint32_t *bucket_rows = index->bucket_rows + t * index->n_rows;
+    uint32_t signature = lsh_signature(index, t, vec);
+    lsh_mark_bucket(offsets, bucket_rows, signature, &marks[0]);
+    for (b = 0; probe >= 1 && b < index->n_bits; b++) {
+      lsh_mark_bucket(offsets, bucket_rows, signature ^ (1U << b), &marks[0]);
+      for (c = 0; probe >= 2 && c < b; c++) {
+        lsh_mark_bucket(offsets, bucket_rows, signature ^ (1U << b) ^ (1U << c), &marks[0]);
+      }
+    }
+  }
+  for (w = 0; w < (long long)marks.size(); w++) {
+    uint64_t bits = marks[w];
+    while (bits) {
+      rows.push_back(w * 64 + __builtin_ctzll(bits));
+      bits &= bits - 1;
+    }
+  }
+}
+
+/*
+  Give a finished model the index its options ask for. word2vec_load
+  reuses or writes "<model>.hnsw" or "<model>.ivf"; a model built by
+  word2vec_apply_delta no longer matches the file, so its index is only
+  kept in memory. LSH tables take seconds to build and are never saved.
+*/
+static void
+prepare_model_index(grn_ctx *ctx, const char *file_name, word2vec_model *model,
+                    grn_bool persist)
+{
+  switch (model->option.index) {
+  case MODEL_INDEX_HNSW :
+    if (persist) {
+      model->hnsw = open_hnsw_index(ctx, file_name, model);
+    }
+    if (model->hnsw == NULL) {
+      model->hnsw = build_hnsw_index(ctx, file_name, model, model->option.n_threads);
+      if (model->hnsw != NULL && persist) {
+        save_hnsw_index(ctx, file_name, model->hnsw, model);
+      }
+    }
+    if (model->hnsw != NULL) {
+      model->memory_size += model->hnsw->memory_size;
+    }
+    break;
+  case MODEL_INDEX_IVF :
+    if (persist) {
+      model->ivf = open_ivf_index(ctx, file_name, model, model->option.ivf_lists);
+    }
+    if (model->ivf == NULL) {
+      model->ivf = build_ivf_index(ctx, file_name, model, model->option.ivf_lists,
+                                   model->option.n_threads);
+    }
+    /* lists without rows in this precision: write them with the rows and map them */
+    if (model->ivf != NULL && model->ivf->rows == NULL && persist &&
+        save_ivf_index(ctx, file_name, model->ivf, model)) {
+      ivf_index *mapped = open_ivf_index(ctx, file_name, model, model->ivf->n_lists);
+      if (mapped != NULL) {
+        close_ivf_index(ctx, model->ivf);
+        model->ivf = mapped;
+      }
+    }
+    if (model->ivf != NULL && !place_ivf_rows(ctx, model->ivf, model)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_load] Cannot allocate IVF index : %s", file_name);
+      close_ivf_index(ctx, model->ivf);
+      model->ivf = NULL;
+    }
+    if (model->ivf != NULL) {
+      model->memory_size += model->ivf->memory_size;
+    }
+    break;
+  case MODEL_INDEX_LSH :
+    model->lsh = build_lsh_index(ctx, file_name, model, model->option.lsh_tables,
+                                 model->option.n_threads);
+    if (model->lsh != NULL) {
+      model->memory_size += model->lsh->memory_size;
+    }
+    break;
+  default :
+    break;
+  }
+}
+
+/*
+  Place the rows of a built model as its options ask (huge pages, NUMA
+  copies, mlock) before it is published.
+*/
+static void
+finish_model(grn_ctx *ctx, const char *file_name, word2vec_model *model)
+{
+  back_model_rows(ctx, model, model->option.pages);
+  place_model_rows(ctx, model, model->option.numa, model->option.pages);
+  if (model->option.lock) {
+    lock_model_rows(ctx, model);
+  }
+  model->memory_size = get_model_memory_size(model) +
+    model->n_numa_rows * model->numa_rows_size;
+  GRN_PLUGIN_LOG(ctx, GRN_LOG_INFO,
+                 "[word2vec_load] "
+                 "Rows of %s are on %s pages%s", file_name,
+                 get_pages_name(model->pages), model->locked ? " (locked)" : "");
+}
+
+/*
+  Load file_name into a new model and publish it at model_idx. Queries
+  keep using the previous model until the new one is complete, and a
+  failed load leaves the previous model in place. Other models may be
+  evicted to stay within GRN_WORD2VEC_MEMORY_LIMIT.
+*/
+static grn_bool
+word2vec_load(grn_ctx *ctx, const char *file_name, int model_idx, load_option option)
+{
+  word2vec_model *model;
+
+  model = create_model(ctx);
+  if (model == NULL) {
+    return GRN_FALSE;
+  }
+  /* rows beyond max_words are not even read unless they are kept as query terms */
+  if (!word2vec_load_model(ctx, file_name, model, option.binary,
+                           option.n_threads, option.is_shared,
+                           option.query_only_tail ? 0 : option.max_words)) {
+    close_model(ctx, model);
+    return GRN_FALSE;
+  }
+  if (option.max_words > 0 && model->key_order) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] "
+                   "max_words is ignored for a model ordered by key : %s",
+                   file_name);
+    option.max_words = 0;
+  }
+  limit_model_words(ctx, model, option);
+  if (option.precision != MODEL_PRECISION_FP32 && model->shm_lock != -1) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_load] "
+                   "precision is ignored for a shared model : %s",
+                   file_name);
+  } else if (!reduce_model_precision(ctx, model, option)) {
+    close_model(ctx, model);
+    return GRN_FALSE;
+  }
+  model->option = option;
+  finish_model(ctx, file_name, model);
+  prepare_model_index(ctx, file_name, model, GRN_TRUE);
+  publish_model(ctx, model_idx, model);
+  evict_models(ctx, model_idx);
+  return GRN_TRUE;
+}
+
+/*
+  Allocate to->n_words rows in the precision of from and copy the rows of
+  from. Quantized rows keep the layout of quantize_model() and
+  pq_quantize_model().
+*/
+static grn_bool
+copy_model_rows(grn_ctx *ctx, const word2vec_model *from, word2vec_model *to)
+{
+  long long words = to->n_words, size = to->dim_size;
+  size_t from_elements = from->n_words * size;
+  char *buffer;
+
+  switch (from->precision) {
+  case MODEL_PRECISION_FP16 :
+  case MODEL_PRECISION_BF16 :
+    to->M16 = (uint16_t *)GRN_PLUGIN_MALLOC(ctx, words * size * sizeof(uint16_t));
+    if (to->M16 == NULL) {
+      return GRN_FALSE;
+    }
+    memcpy(to->M16, from->M16, from_elements * sizeof(uint16_t));
+    break;
+  case MODEL_PRECISION_INT8 :
+    buffer = (char *)GRN_PLUGIN_MALLOC(ctx, words * size + words * sizeof(float));
+    if (buffer == NULL) {
+      return GRN_FALSE;
+    }
+    to->quantized_buffer = buffer;
+    to->row_scale = (float *)buffer;
+    to->M8 = (int8_t *)(buffer + words * sizeof(float));
+    memcpy(to->row_scale, from->row_scale, from->n_words * sizeof(float));
+    memcpy(to->M8, from->M8, from_elements);
+    break;
+  case MODEL_PRECISION_PQ :
+    {
+      size_t codebook_size = PQ_N_CENTROIDS * size * sizeof(float);
+      buffer = (char *)GRN_PLUGIN_MALLOC(ctx, codebook_size + words * from->pq_subspaces);
+      if (buffer == NULL) {
+        return GRN_FALSE;
+      }
+      to->quantized_buffer = buffer;
+      to->pq_codebook = (float *)buffer;
+      to->pq_codes = (uint8_t *)(buffer + codebook_size);
+      memcpy(to->pq_codebook, from->pq_codebook, codebook_size);
+      memcpy(to->pq_codes, from->pq_codes, from->n_words * from->pq_subspaces);
+    }
+    break;
+  default :
+    to->M = (float *)GRN_PLUGIN_MALLOC(ctx, words * size * sizeof(float));
+    if (to->M == NULL) {
+      return GRN_FALSE;
+    }
+    memcpy(to->M, from->M, from_elements * sizeof(float));
+    break;
+  }
+  to->precision = from->precision;
+  to->pq_subspaces = from->pq_subspaces;
+  return GRN_TRUE;
+}
+
+/* store a normalized fp32 vector as row in the precision of the model */
+static void
+set_model_row(word2vec_model *model, long long row, const float *vec)
+{
+  long long a, size = model->dim_size;
+
+  switch (model->precision) {
+  case MODEL_PRECISION_FP16 :
+    for (a = 0; a < size; a++) model->M16[row * size + a] = float_to_half(vec[a]);
+    break;
+  case MODEL_PRECISION_BF16 :
+    for (a = 0; a < size; a++) model->M16[row * size + a] = float_to_bf16(vec[a]);
+    break;
+  case MODEL_PRECISION_INT8 :
+    model->row_scale[row] = quantize_row(vec, size, model->M8 + row * size);
+    break;
+  case MODEL_PRECISION_PQ :
+    {
+      int m, n_subspaces = model->pq_subspaces;
+      long long sub_size = size / n_subspaces;
+      for (m = 0; m < n_subspaces; m++) {
+        model->pq_codes[row * n_subspaces + m] =
+          nearest_centroid(vec + m * sub_size,
+                           model->pq_codebook + (long long)m * PQ_N_CENTROIDS * sub_size,
+                           PQ_N_CENTROIDS, sub_size);
+      }
+    }
+    break;
+  default :
+    memcpy(model->M + row * size, vec, size * sizeof(float));
+    break;
+  }
+}
+
+static pthread_mutex_t delta_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  A temporary vocab with the first n_words keys of vocab under the same
+  ids, for a model that adds keys without touching vocab.
+*/
+static grn_pat *
+copy_vocab(grn_ctx *ctx, grn_pat *vocab, long long n_words)
+{
+  grn_pat *new_vocab;
+  char key[GRN_TABLE_MAX_KEY_SIZE];
+  long long b;
+
+  new_vocab = create_vocab(ctx);
+  if (new_vocab == NULL) {
+    return NULL;
+  }
+  for (b = 0; b < n_words; b++) {
+    int key_len = grn_pat_get_key(ctx, vocab, b + 1, key, GRN_TABLE_MAX_KEY_SIZE);
+    if ((long long)grn_pat_add(ctx, new_vocab, key, key_len, NULL, NULL) != b + 1) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_apply_delta] "
+                     "Cannot copy %.*s to the vocab", key_len, key);
+      grn_pat_close(ctx, new_vocab);
+      return NULL;
+    }
+  }
+  return new_vocab;
+}
+
+/*
+  Apply a delta to the model published at model_idx. A delta is a model
+  file of the same dimension (binary, text or gzip-compressed): rows of
+  words already in the vocab replace theirs, other words are appended.
+  The rows are copied into a new model with the delta rows (normalized
+  when read) written over them, and the new model is published like a
+  reload, so running queries keep the old rows. New words go to a copy
+  of the vocab owned by the new model; the vocab of the running model
+  and its file are never modified. Deltas are applied one at a time.
+*/
+static grn_bool
+word2vec_apply_delta(grn_ctx *ctx, const char *file_name, int model_idx,
+                     const char *delta_file_name, int binary, int n_threads,
+                     long long *n_updated, long long *n_added)
+{
+  word2vec_model *model, *new_model = NULL;
+  grn_pat *delta_vocab = NULL;
+  long long delta_words = 0, delta_size = 0, b;
+  long long *rows = NULL;
+  float *delta_matrix = NULL;
+  grn_bool succeeded = GRN_FALSE;
+  FILE *f;
+
+  *n_updated = 0;
+  *n_added = 0;
+  pthread_mutex_lock(&delta_mutex);
+  model = acquire_model(model_idx);
+  if (model == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_apply_delta] "
+                   "Model is not loaded : %s", file_name);
+    goto exit;
+  }
+  if (model->shm_lock != -1 ||
+      grn_pat_size(ctx, model->vocab) != (unsigned int)model->n_words) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_apply_delta] "
+                   "Delta needs a model loaded without shared and max_words : %s",
+                   file_name);
+    goto exit;
+  }
+
+  f = fopen(delta_file_name, "rb");
+  if (f == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_apply_delta] "
+                   "Input file not found : %s", delta_file_name);
+    goto exit;
+  }
+  delta_vocab = create_vocab(ctx);
+  succeeded = (delta_vocab != NULL &&
+               read_model(ctx, f, binary, n_threads, delta_vocab, 0,
+                          &delta_words, &delta_size, &delta_matrix));
+  fclose(f);
+  if (!succeeded) {
+    goto exit;
+  }
+  succeeded = GRN_FALSE;
+  if (delta_size != model->dim_size) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_apply_delta] "
+                   "Dimension mismatch : %lld != %lld", delta_size, model->dim_size);
+    goto exit;
+  }
+
+  /* row of each delta word; new words get rows after the model's */
+  rows = (long long *)GRN_PLUGIN_MALLOC(ctx, delta_words * sizeof(long long));
+  if (rows == NULL) {
+    goto exit;
+  }
+  for (b = 0; b < delta_words; b++) {
+    char key[GRN_TABLE_MAX_KEY_SIZE];
+    int key_len = grn_pat_get_key(ctx, delta_vocab, b + 1, key, GRN_TABLE_MAX_KEY_SIZE);
+    grn_id id = grn_pat_get(ctx, model->vocab, key, key_len, NULL);
+    if (id != GRN_ID_NIL) {
+      rows[b] = id - 1;
+      (*n_updated)++;
+    } else {
+      rows[b] = model->n_words + *n_added;
+      (*n_added)++;
+    }
+  }
+
+  new_model = create_model(ctx);
+  if (new_model == NULL) {
+    goto exit;
+  }
+  new_model->n_words = model->n_words + *n_added;
+  new_model->n_candidates = (model->n_candidates == model->n_words) ?
+    new_model->n_words : model->n_candidates;
+  new_model->dim_size = model->dim_size;
+  new_model->option = model->option;
+  if (!copy_model_rows(ctx, model, new_model)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_apply_delta] "
+                   "Cannot allocate matrix : %lld x %lld",
+                   new_model->n_words, new_model->dim_size);
+    goto exit;
+  }
+  for (b = 0; b < delta_words; b++) {
+    set_model_row(new_model, rows[b], delta_matrix + b * delta_size);
+  }
+  new_model->vocab = copy_vocab(ctx, model->vocab, model->n_words);
+  if (new_model->vocab == NULL) {
+    goto exit;
+  }
+  for (b = 0; b < delta_words; b++) {
+    char key[GRN_TABLE_MAX_KEY_SIZE];
+    int key_len;
+    grn_id id;
+    if (rows[b] < model->n_words) {
+      continue;
+    }
+    key_len = grn_pat_get_key(ctx, delta_vocab, b + 1, key, GRN_TABLE_MAX_KEY_SIZE);
+    id = grn_pat_add(ctx, new_model->vocab, key, key_len, NULL, NULL);
+    if (id == GRN_ID_NIL || (long long)id != rows[b] + 1) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_apply_delta] "
+                     "Cannot add %.*s to the vocab", key_len, key);
+      goto exit;
+    }
+  }
+
+  finish_model(ctx, file_name, new_model);
+  prepare_model_index(ctx, file_name, new_model, GRN_FALSE);
+  publish_model(ctx, model_idx, new_model);
+  new_model = NULL;
+  evict_models(ctx, model_idx);
+  succeeded = GRN_TRUE;
+
+exit :
+  if (new_model != NULL) {
+    close_model(ctx, new_model);
+  }
+  if (model != NULL) {
+    release_model(ctx, model);
+  }
+  if (rows != NULL) {
+    GRN_PLUGIN_FREE(ctx, rows);
+  }
+  if (delta_matrix != NULL) {
+    GRN_PLUGIN_FREE(ctx, delta_matrix);
+  }
+  if (delta_vocab != NULL) {
+    grn_pat_close(ctx, delta_vocab);
+  }
+  pthread_mutex_unlock(&delta_mutex);
+  return succeeded;
+}
+
+typedef struct {
+  char file_name[max_size];
+  int model_idx;
+  load_option option;
+} async_load_arg;
+
+/*
+  The model is built on this thread's ctx, which is finalized right after
+  it is published, and freed later on the ctx of whichever query releases
+  it last. GRN_PLUGIN_MALLOC and grn_pat_create()/grn_pat_open() take
+  their memory from the process heap and mappings, not from the ctx (it
+  only carries the error state and logging), and grn_ctx_fin() frees
+  none of it, so the rows, indexes and vocab outlive this ctx. Models
+  loaded synchronously move between query ctxs in the same way.
+*/
+static void *
+load_model_in_background(void *arg)
+{
+  async_load_arg *load = (async_load_arg *)arg;
+  grn_ctx ctx;
+  grn_bool succeeded;
+  const char *env;
+
+  grn_ctx_init(&ctx, 0);
+  /* GRN_WORD2VEC_LOAD_DELAY msec holds the load back so that tests can see it in flight */
+  env = getenv("GRN_WORD2VEC_LOAD_DELAY");
+  if (env && atoi(env) > 0) {
+    struct timespec delay;
+    delay.tv_sec = atoi(env) / 1000;
+    delay.tv_nsec = (long)(atoi(env) % 1000) * 1000000;
+    nanosleep(&delay, NULL);
+  }
+  succeeded = word2vec_load(&ctx, load->file_name, load->model_idx, load->option);
+  if (!succeeded) {
+    GRN_PLUGIN_LOG(&ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Background load failed : %s",
+                   load->file_name);
+  }
+  pthread_mutex_lock(&models_mutex);
+  models[load->model_idx].n_loading--;
+  models[load->model_idx].failed = !succeeded;
+  n_background_loads--;
+  pthread_cond_broadcast(&models_cond);
+  pthread_mutex_unlock(&models_mutex);
+  free(load);
+  grn_ctx_fin(&ctx);
+  return NULL;
+}
+
+/*
+  Load file_name into model_idx on a detached thread. Falls back to a
+  synchronous load when the thread can't be started.
+*/
+static grn_bool
+start_background_load(grn_ctx *ctx, const char *file_name, int model_idx,
+                      load_option option)
+{
+  async_load_arg *load;
+  pthread_t thread;
+  pthread_attr_t attr;
+  int rc;
+
+  /* freed by the loader thread, which has its own ctx, so not GRN_PLUGIN_MALLOC */
+  load = (async_load_arg *)malloc(sizeof(async_load_arg));
+  if (load == NULL) {
+    return word2vec_load(ctx, file_name, model_idx, option);
+  }
+  strcpy(load->file_name, file_name);
+  load->model_idx = model_idx;
+  load->option = option;
+
+  pthread_mutex_lock(&models_mutex);
+  models[model_idx].n_loading++;
+  n_background_loads++;
+  pthread_mutex_unlock(&models_mutex);
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  rc = pthread_create(&thread, &attr, load_model_in_background, (void *)load);
+  pthread_attr_destroy(&attr);
+  if (rc != 0) {
+    pthread_mutex_lock(&models_mutex);
+    models[model_idx].n_loading--;
+    n_background_loads--;
+    pthread_cond_broadcast(&models_cond);
+    pthread_mutex_unlock(&models_mutex);
+    free(load);
+    return word2vec_load(ctx, file_name, model_idx, option);
+  }
+  return GRN_TRUE;
+}
+
+/*
+  Wait up to timeout_ms milliseconds (no limit if negative) for the
+  background loads of model_idx. Returns whether one is still in flight.
+*/
+static grn_bool
+wait_background_load(int model_idx, int timeout_ms)
+{
+  struct timespec deadline;
+  grn_bool is_loading;
+
+  if (timeout_ms > 0) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+  pthread_mutex_lock(&models_mutex);
+  while (models[model_idx].n_loading > 0 && timeout_ms != 0) {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&models_cond, &models_mutex);
+    } else if (pthread_cond_timedwait(&models_cond, &models_mutex, &deadline) == ETIMEDOUT) {
+      break;
+    }
+  }
+  is_loading = models[model_idx].n_loading > 0;
+  pthread_mutex_unlock(&models_mutex);
+  return is_loading;
+}
+
+/* start a background load of each path in a comma separated list */
+static void
+preload_models(grn_ctx *ctx, const char *paths)
+{
+  char file_name[max_size];
+  const char *start = paths, *end;
+  load_option option;
+  int model_idx;
+
+  init_load_option(&option);
+  while (*start != '\0') {
+    size_t len;
+    end = strchr(start, ',');
+    if (end == NULL) {
+      end = start + strlen(start);
+    }
+    len = end - start;
+    if (len > 0 && len < max_size) {
+      memcpy(file_name, start, len);
+      file_name[len] = '\0';
+      model_idx = get_model_idx(ctx, file_name, GRN_TRUE);
+      if (model_idx != -1) {
+        start_background_load(ctx, file_name, model_idx, option);
+      }
+    }
+    start = (*end == ',') ? end + 1 : end;
+  }
+}
+
+static grn_obj *
+command_word2vec_load(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
+                      grn_user_data *user_data)
+{
+  char file_name[max_size];
+  grn_obj *var;
+  load_option option;
+  grn_bool is_async = GRN_FALSE;
+  int model_idx;
+
+  init_load_option(&option);
+  var = grn_plugin_proc_get_var(ctx, user_data, "file_path", -1);
+  if (GRN_TEXT_LEN(var) == 0) {
+    get_load_model_file_path(ctx, file_name);
+  } else {
+    strcpy(file_name, GRN_TEXT_VALUE(var));
+    file_name[GRN_TEXT_LEN(var)] = '\0';
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "binary", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.binary = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "threads", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.n_threads = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "shared", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.is_shared = atoi(GRN_TEXT_VALUE(var)) ? GRN_TRUE : GRN_FALSE;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "precision", -1);
+  if (GRN_TEXT_LEN(var) != 0 &&
+      !parse_precision(GRN_TEXT_VALUE(var), GRN_TEXT_LEN(var), &(option.precision))) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Unknown precision : %.*s",
+                   (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "pq_subspaces", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.pq_subspaces = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "max_words", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.max_words = atoll(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "query_only_tail", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.query_only_tail = atoi(GRN_TEXT_VALUE(var)) ? GRN_TRUE : GRN_FALSE;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "numa", -1);
+  if (GRN_TEXT_LEN(var) != 0 &&
+      !parse_numa_mode(GRN_TEXT_VALUE(var), GRN_TEXT_LEN(var), &(option.numa))) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Unknown numa : %.*s",
+                   (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "pages", -1);
+  if (GRN_TEXT_LEN(var) != 0 &&
+      !parse_pages(GRN_TEXT_VALUE(var), GRN_TEXT_LEN(var), &(option.pages))) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Unknown pages : %.*s",
+                   (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "lock", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.lock = atoi(GRN_TEXT_VALUE(var)) ? GRN_TRUE : GRN_FALSE;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "index", -1);
+  if (GRN_TEXT_LEN(var) != 0 &&
+      !parse_index(GRN_TEXT_VALUE(var), GRN_TEXT_LEN(var), &(option.index))) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_load] "
+                   "Unknown index : %.*s",
+                   (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "ivf_lists", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.ivf_lists = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "lsh_tables", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    option.lsh_tables = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "async", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    is_async = atoi(GRN_TEXT_VALUE(var)) ? GRN_TRUE : GRN_FALSE;
+  }
+
+  model_idx = get_model_idx(ctx, file_name, GRN_TRUE);
+  if (model_idx != -1 && is_async) {
+    grn_ctx_output_bool(ctx, start_background_load(ctx, file_name, model_idx, option));
+    return NULL;
+  }
+  if (model_idx != -1 && word2vec_load(ctx, file_name, model_idx, option) == GRN_TRUE) {
+    grn_ctx_output_bool(ctx, GRN_TRUE);
+  } else {
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+  }
+  return NULL;
+}
+
+typedef enum {
+  MODEL_FORMAT_NATIVE,
+  MODEL_FORMAT_BINARY,
+  MODEL_FORMAT_TEXT
+} model_format;
+
+/*
+  Build the index of a converted model from its fp32 rows and write it
+  next to file_name, where word2vec_load --index finds it. The .ivf file
+  only holds the lists; the first load adds the rows in its precision.
+*/
+static grn_bool
+save_converted_model_index(grn_ctx *ctx, const char *file_name, model_index index,
+                           int n_lists, long long words, long long size, float *matrix,
+                           int n_threads)
+{
+  word2vec_model *model;
+  grn_bool succeeded = GRN_FALSE;
+
+  model = create_model(ctx);
+  if (model == NULL) {
+    return GRN_FALSE;
+  }
+  model->n_words = words;
+  model->n_candidates = words;
+  model->dim_size = size;
+  model->M = matrix;
+  if (index == MODEL_INDEX_HNSW) {
+    model->hnsw = build_hnsw_index(ctx, file_name, model, n_threads);
+    succeeded = model->hnsw != NULL && save_hnsw_index(ctx, file_name, model->hnsw, model);
+  } else if (index == MODEL_INDEX_IVF) {
+    model->ivf = build_ivf_index(ctx, file_name, model, n_lists, n_threads);
+    succeeded = model->ivf != NULL && save_ivf_index(ctx, file_name, model->ivf, NULL);
+  }
+  model->M = NULL;
+  close_model(ctx, model);
+  return succeeded;
+}
+
+/*
+  Convert a model offline: text, binary or native input (any precision)
+  to a native model of the given precision or to the text or binary
+  format, with rows normalized and optionally reordered by key. An HNSW
+  or IVF index of the output can be built at the same time.
+*/
+static grn_obj *
+command_word2vec_convert(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
+                         grn_user_data *user_data)
+{
+  char file_name[max_size], output_file[max_size];
+  grn_obj *var;
+  int binary = 1;
+  int n_threads = get_default_n_threads();
+  model_precision precision = MODEL_PRECISION_FP32;
+  model_format format = MODEL_FORMAT_NATIVE;
+  grn_bool reorder_by_key = GRN_FALSE;
+  grn_bool key_order = GRN_FALSE;
+  int n_subspaces = 0;
+  model_index index = MODEL_INDEX_NONE;
+  int n_lists = 0;
+  uint32_t flags = 0;
+  FILE *f;
+  long long words, size;
+  float *matrix;
+  grn_pat *model_vocab = NULL;
+  grn_bool succeeded;
+
+  var = grn_plugin_proc_get_var(ctx, user_data, "file_path", -1);
+  if (GRN_TEXT_LEN(var) == 0) {
+    get_model_file_path(ctx, file_name);
+  } else {
+    strcpy(file_name, GRN_TEXT_VALUE(var));
+    file_name[GRN_TEXT_LEN(var)] = '\0';
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "output_format", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    if (GRN_TEXT_LEN(var) == 6 && memcmp(GRN_TEXT_VALUE(var), "native", 6) == 0) {
+      format = MODEL_FORMAT_NATIVE;
+    } else if (GRN_TEXT_LEN(var) == 6 && memcmp(GRN_TEXT_VALUE(var), "binary", 6) == 0) {
+      format = MODEL_FORMAT_BINARY;
+    } else if (GRN_TEXT_LEN(var) == 4 && memcmp(GRN_TEXT_VALUE(var), "text", 4) == 0) {
+      format = MODEL_FORMAT_TEXT;
+    } else {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_convert] "
+                     "Unknown output format : %.*s",
+                     (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+      grn_ctx_output_bool(ctx, GRN_FALSE);
+      return NULL;
+    }
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "output_file", -1);
+  if (GRN_TEXT_LEN(var) == 0) {
+    if (format != MODEL_FORMAT_NATIVE) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_convert] "
+                     "output_file is required for the text and binary formats");
+      grn_ctx_output_bool(ctx, GRN_FALSE);
+      return NULL;
+    }
+    get_native_model_file_path(ctx, output_file);
+  } else {
+    strcpy(output_file, GRN_TEXT_VALUE(var));
+    output_file[GRN_TEXT_LEN(var)] = '\0';
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "binary", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    binary = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "threads", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    n_threads = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "precision", -1);
+  if (GRN_TEXT_LEN(var) != 0 &&
+      (!parse_precision(GRN_TEXT_VALUE(var), GRN_TEXT_LEN(var), &precision) ||
+       (format != MODEL_FORMAT_NATIVE && precision != MODEL_PRECISION_FP32))) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] "
+                   "Unsupported precision : %.*s",
+                   (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  switch (precision) {
+  case MODEL_PRECISION_FP16 :
+    flags = NATIVE_MODEL_FLAG_FP16;
+    break;
+  case MODEL_PRECISION_BF16 :
+    flags = NATIVE_MODEL_FLAG_BF16;
+    break;
+  case MODEL_PRECISION_INT8 :
+    flags = NATIVE_MODEL_FLAG_INT8;
+    break;
+  case MODEL_PRECISION_PQ :
+    flags = NATIVE_MODEL_FLAG_PQ;
+    break;
+  default :
+    break;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "pq_subspaces", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    n_subspaces = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "reorder", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    if (GRN_TEXT_LEN(var) == 3 && memcmp(GRN_TEXT_VALUE(var), "key", 3) == 0) {
+      reorder_by_key = GRN_TRUE;
+    } else if (!(GRN_TEXT_LEN(var) == 4 && memcmp(GRN_TEXT_VALUE(var), "none", 4) == 0)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_convert] "
+                     "Unknown reorder : %.*s",
+                     (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+      grn_ctx_output_bool(ctx, GRN_FALSE);
+      return NULL;
+    }
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "index", -1);
+  /* lsh tables are only built at load */
+  if (GRN_TEXT_LEN(var) != 0 &&
+      (!parse_index(GRN_TEXT_VALUE(var), GRN_TEXT_LEN(var), &index) ||
+       index == MODEL_INDEX_LSH)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] "
+                   "Unsupported index : %.*s",
+                   (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "ivf_lists", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    n_lists = atoi(GRN_TEXT_VALUE(var));
+  }
+
+  f = fopen(file_name, "rb");
+  if (f == NULL) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] "
+                   "Input file not found : %s",
+                   file_name);
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  if (is_native_model_file(f)) {
+    fclose(f);
+    succeeded = read_native_model(ctx, file_name, &model_vocab, &words, &size, &matrix,
+                                  &key_order);
+  } else {
+    model_vocab = create_vocab(ctx);
+    succeeded = (model_vocab != NULL);
+    if (succeeded) {
+      succeeded = read_model(ctx, f, binary, n_threads, model_vocab, 0, &words, &size, &matrix);
+    }
+    fclose(f);
+    if (!succeeded && model_vocab) {
+      grn_pat_close(ctx, model_vocab);
+    }
+  }
+  if (!succeeded) {
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+
+  if (reorder_by_key || key_order) {
+    flags |= NATIVE_MODEL_FLAG_KEY_ORDER;
+    if (format != MODEL_FORMAT_NATIVE) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                     "[word2vec_convert] "
+                     "key order is not recorded in a text or binary model : %s",
+                     output_file);
+    }
+  }
+  if (reorder_by_key &&
+      !reorder_rows_by_key(ctx, &model_vocab, &matrix, words, size)) {
+    succeeded = GRN_FALSE;
+  } else if (format != MODEL_FORMAT_NATIVE) {
+    succeeded = save_model(ctx, output_file, words, size, matrix, model_vocab,
+                           format == MODEL_FORMAT_BINARY);
+  } else if (flags & NATIVE_MODEL_FLAG_PQ &&
+             (n_subspaces = get_pq_subspaces(size, n_subspaces)) == 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_convert] "
+                   "pq_subspaces must divide the dimension : %lld", size);
+    succeeded = GRN_FALSE;
+  } else {
+    succeeded = save_native_model(ctx, output_file, words, size, matrix, model_vocab,
+                                  flags, n_subspaces, n_threads);
+  }
+  if (succeeded && index != MODEL_INDEX_NONE) {
+    succeeded = save_converted_model_index(ctx, output_file, index, n_lists,
+                                           words, size, matrix, n_threads);
+  }
+  grn_pat_close(ctx, model_vocab);
+  GRN_PLUGIN_FREE(ctx, matrix);
+  if (succeeded) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_NOTICE,
+                   "[word2vec_convert] %s -> %s (%lld words, %lld dims)",
+                   file_name, output_file, words, size);
+  }
+
+  grn_ctx_output_bool(ctx, succeeded);
+  return NULL;
+}
+
+static grn_obj *
+command_word2vec_apply_delta(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
+                             grn_user_data *user_data)
+{
+  char file_name[max_size];
+  char delta_file_name[max_size];
+  int binary = 1;
+  int n_threads = get_default_n_threads();
+  int model_idx;
+  long long n_updated, n_added;
+  grn_obj *var;
+
+  var = grn_plugin_proc_get_var(ctx, user_data, "delta_file", -1);
+  if (GRN_TEXT_LEN(var) == 0) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_apply_delta] "
+                   "delta_file is required");
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  strncpy(delta_file_name, GRN_TEXT_VALUE(var), GRN_TEXT_LEN(var));
+  delta_file_name[GRN_TEXT_LEN(var)] = '\0';
+  var = grn_plugin_proc_get_var(ctx, user_data, "file_path", -1);
+  if (GRN_TEXT_LEN(var) == 0) {
+    get_load_model_file_path(ctx, file_name);
+  } else {
+    strcpy(file_name, GRN_TEXT_VALUE(var));
+    file_name[GRN_TEXT_LEN(var)] = '\0';
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "binary", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    binary = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "threads", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    n_threads = atoi(GRN_TEXT_VALUE(var));
+  }
+
+  model_idx = get_model_idx(ctx, file_name, GRN_FALSE);
+  if (model_idx == -1 ||
+      !word2vec_apply_delta(ctx, file_name, model_idx, delta_file_name, binary, n_threads,
+                            &n_updated, &n_added)) {
+    if (model_idx == -1) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_apply_delta] "
+                     "Model is not loaded : %s", file_name);
+    }
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+  grn_ctx_output_map_open(ctx, "DELTA", 2);
+  grn_ctx_output_cstr(ctx, "n_updated");
+  grn_ctx_output_int64(ctx, n_updated);
+  grn_ctx_output_cstr(ctx, "n_added");
+  grn_ctx_output_int64(ctx, n_added);
+  grn_ctx_output_map_close(ctx);
+  return NULL;
+}
+
+static grn_obj *
+command_word2vec_unload(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
+                        grn_user_data *user_data)
+{
+  char file_name[max_size];
+  grn_obj *var;
+  int model_idx;
+
+  var = grn_plugin_proc_get_var(ctx, user_data, "file_path", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    strcpy(file_name, GRN_TEXT_VALUE(var));
+    file_name[GRN_TEXT_LEN(var)] = '\0';
+    model_idx = get_model_idx(ctx, file_name, GRN_FALSE);
+    if (model_idx == -1 || !word2vec_unload(ctx, model_idx)) {
+      grn_ctx_output_bool(ctx, GRN_FALSE);
+      return NULL;
+    }
+    grn_ctx_output_bool(ctx, GRN_TRUE);
+    return NULL;
+  }
+
+  for (int i = 0; i < n_model_slots; i++) {
+    word2vec_unload(ctx, i);
+  }
+  grn_ctx_output_bool(ctx, GRN_TRUE);
+  return NULL;
+}
+
+static grn_obj *
+command_word2vec_status(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
+                        GNUC_UNUSED grn_user_data *user_data)
+{
+  int n_models = 0;
+
+  pthread_mutex_lock(&models_mutex);
+  if (model_idxes) {
+    n_models = grn_hash_size(ctx, model_idxes);
+  }
+  grn_ctx_output_array_open(ctx, "MODELS", n_models);
+  for (int i = 0; i < n_models && i < n_model_slots; i++) {
+    char file_name[GRN_TABLE_MAX_KEY_SIZE];
+    int file_name_len;
+    const word2vec_model *model = models[i].model;
+    const char *status;
+
+    file_name_len = grn_hash_get_key(ctx, model_idxes, i + 1,
+                                     file_name, GRN_TABLE_MAX_KEY_SIZE);
+    if (models[i].n_loading > 0) {
+      status = "loading";
+    } else if (model != NULL) {
+      status = "loaded";
+    } else if (models[i].failed) {
+      status = "failed";
+    } else {
+      status = "unloaded";
+    }
+    grn_ctx_output_map_open(ctx, "MODEL", 12);
+    grn_ctx_output_cstr(ctx, "file_path");
+    grn_ctx_output_str(ctx, file_name, file_name_len);
+    grn_ctx_output_cstr(ctx, "status");
+    grn_ctx_output_cstr(ctx, status);
+    grn_ctx_output_cstr(ctx, "n_words");
+    grn_ctx_output_int64(ctx, model ? model->n_words : 0);
+    grn_ctx_output_cstr(ctx, "dim_size");
+    grn_ctx_output_int64(ctx, model ? model->dim_size : 0);
+    grn_ctx_output_cstr(ctx, "precision");
+    grn_ctx_output_cstr(ctx, model ? get_precision_name(model->precision) : "");
+    grn_ctx_output_cstr(ctx, "shared");
+    grn_ctx_output_bool(ctx, model && model->shm_lock != -1);
+    grn_ctx_output_cstr(ctx, "memory_size");
+    grn_ctx_output_int64(ctx, model ? (long long)model->memory_size : 0);
+    grn_ctx_output_cstr(ctx, "numa_copies");
+    grn_ctx_output_int32(ctx, model ? model->n_numa_rows : 0);
+    grn_ctx_output_cstr(ctx, "pages");
+    grn_ctx_output_cstr(ctx, model ? get_pages_name(model->pages) : "");
+    grn_ctx_output_cstr(ctx, "locked");
+    grn_ctx_output_bool(ctx, model && model->locked);
+    grn_ctx_output_cstr(ctx, "index");
+    grn_ctx_output_cstr(ctx, model ? get_model_index_name(model) : "");
+    grn_ctx_output_cstr(ctx, "index_mapped");
+    grn_ctx_output_bool(ctx, model && model_index_is_mapped(model));
+    grn_ctx_output_map_close(ctx);
+  }
+  grn_ctx_output_array_close(ctx);
+  pthread_mutex_unlock(&models_mutex);
+  return NULL;
+}
+
+/*
+  Score the insertion-sorted candidates again with the fp32 rows kept
+  behind an int8 model and restore the descending order. Candidates whose
+  exact score falls below the threshold are dropped.
+*/
+static void
+rerank_candidates(grn_ctx *ctx, const word2vec_model *model,
+                  const long long *found_row_idx, const char *op, int input_n_words,
+                  float threshold, char **bestw, float *bestd, long long *besti,
+                  long long N)
+{
+  long long a, b, size = model->dim_size;
+  const float *matrix = model->rerank_matrix;
+  float *exact_vec;
+
+  exact_vec = (float *)GRN_PLUGIN_MALLOC(ctx, size * sizeof(float));
+  if (exact_vec == NULL) {
+    return;
   }
-  grn_ctx_output_bool(ctx, GRN_TRUE);
-  return NULL;
+  for (a = 0; a < size; a++) {
+    exact_vec[a] = 0;
+  }
+  for (b = 0; b < input_n_words; b++) {
+    add_f32(op[b] == '-' ? -1 : 1, matrix + found_row_idx[b] * size, exact_vec, size);
+  }
+  normalize_row(exact_vec, size);
+
+  for (b = 0; b < N && bestw[b][0] != '\0'; b++) {
+    bestd[b] = dot_f32(exact_vec, matrix + besti[b] * size, size);
+  }
+  N = b;
+
+  for (b = 1; b < N; b++) {
+    float dist = bestd[b];
+    long long word_idx = besti[b];
+    /* keys are allocated at their own length, so move the pointers */
+    char *word = bestw[b];
+    for (a = b; a > 0 && bestd[a - 1] < dist; a--) {
+      bestd[a] = bestd[a - 1];
+      besti[a] = besti[a - 1];
+      bestw[a] = bestw[a - 1];
+    }
+    bestd[a] = dist;
+    besti[a] = word_idx;
+    bestw[a] = word;
+  }
+  for (b = 0; threshold > 0 && b < N; b++) {
+    if (bestd[b] < threshold) {
+      bestw[b][0] = '\0';
+    }
+  }
+  GRN_PLUGIN_FREE(ctx, exact_vec);
 }
 
-static grn_obj *
-command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
-                          grn_user_data *user_data)
+static void
+word2vec_distance(grn_ctx *ctx, grn_user_data *user_data, const word2vec_model *model)
 {
   const char *input;
   long long N = DEFAULT_N_SORT;
   char input_term[MAX_TERMS][max_length_of_vocab_word];
   long long found_row_idx[MAX_TERMS];
   char op[MAX_TERMS] = {'+'};
-  float dist, len;
   float *vec;
   char **bestw;
   float *bestd;
@@ -722,35 +7563,27 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
   unsigned int column_names_len = 0;
   char *sortby = NULL;
   unsigned int sortby_len = 0;
-  char file_name[max_size];
-  int model_idx = 0;
   grn_obj *table = NULL;
   grn_obj *res = NULL;
   grn_pat_cursor *pc;
-  int binary = 1;
   int pca = 0;
   int pca_centered = 1;
   int total_count = 0;
-
-  var = grn_plugin_proc_get_var(ctx, user_data, "file_path", -1);
-  if (GRN_TEXT_LEN(var) == 0) {
-    get_model_file_path(ctx, file_name);
-  } else {
-    strcpy(file_name, GRN_TEXT_VALUE(var));
-    file_name[GRN_TEXT_LEN(var)] = '\0';
-  }
-  var = grn_plugin_proc_get_var(ctx, user_data, "binary", -1);
-  if (GRN_TEXT_LEN(var) != 0) {
-    binary = atoi(GRN_TEXT_VALUE(var));
-  }
-
-  model_idx = get_model_idx(ctx, file_name);
-  if (M[model_idx] == NULL || vocab[model_idx] == NULL) {
-    if (word2vec_load(ctx, file_name, model_idx, binary) == GRN_FALSE) {
-      grn_ctx_output_bool(ctx, GRN_FALSE);
-      return NULL;
-    }
-  }
+  int rerank = 1;
+  int8_t *query_int8 = NULL;
+  float query_scale = 0;
+  float *pq_table = NULL;
+  word2vec_model local_model;
+  const word2vec_model *scan_model = model;
+  scan_query query;
+  int scan_threads = get_default_scan_threads();
+  search_mode mode = SEARCH_MODE_EXACT;
+  int ef = DEFAULT_HNSW_EF;
+  int nprobe = DEFAULT_IVF_NPROBE;
+  int lsh_probe = DEFAULT_LSH_PROBE;
+  const char *env;
+  top_k top;
+  long long n_found;
 
   var = grn_plugin_proc_get_var(ctx, user_data, "offset", -1);
   if (GRN_TEXT_LEN(var) != 0) {
@@ -842,6 +7675,40 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
     sortby = GRN_TEXT_VALUE(var);
     sortby_len = GRN_TEXT_LEN(var);
   }
+  var = grn_plugin_proc_get_var(ctx, user_data, "rerank", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    rerank = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "scan_threads", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    scan_threads = atoi(GRN_TEXT_VALUE(var));
+  }
+  env = getenv("GRN_WORD2VEC_SEARCH_MODE");
+  if (env) {
+    parse_search_mode(env, strlen(env), &mode);
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "search_mode", -1);
+  if (GRN_TEXT_LEN(var) != 0 &&
+      !parse_search_mode(GRN_TEXT_VALUE(var), GRN_TEXT_LEN(var), &mode)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_distance] "
+                   "Unknown search_mode : %.*s",
+                   (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return;
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "ef", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    ef = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "nprobe", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    nprobe = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "lsh_probe", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    lsh_probe = atoi(GRN_TEXT_VALUE(var));
+  }
 
   var = grn_plugin_proc_get_var(ctx, user_data, "term", -1);
 
@@ -849,7 +7716,7 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
     GRN_PLUGIN_LOG(ctx, GRN_LOG_NOTICE,
                    "[plugin][word2vec][distance] empty term");
     grn_ctx_output_bool(ctx, GRN_FALSE);
-    return NULL;
+    return;
   } else {
     grn_obj buf;
     int array_len;
@@ -905,9 +7772,13 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
   }
 
   for (a = 0; a < input_n_words; a++) {
-    found_row_idx[a] = grn_pat_get(ctx, vocab[model_idx], input_term[a], strlen(input_term[a]), NULL);
+    found_row_idx[a] = grn_pat_get(ctx, model->vocab, input_term[a], strlen(input_term[a]), NULL);
 
     found_row_idx[a]--;
+    /* words pruned by word2vec_load --max_words are still in a persisted vocab */
+    if (found_row_idx[a] >= model->n_words) {
+      found_row_idx[a] = -1;
+    }
     if (found_row_idx[a] == -1) {
       if (expander_mode == GRN_EXPANDER_NONE) {
         output_header(ctx, 0);
@@ -919,7 +7790,7 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
       } else {
         grn_ctx_output_cstr(ctx, input);
       }
-      return NULL;
+      return;
     }
   }
 
@@ -928,7 +7799,7 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
     if (!table) {
       GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
                      "[word2vec_distance] couldn't open table %.*s", table_len, table_name);
-      return NULL;
+      return;
     }
     if (table) {
       res = grn_table_create(ctx, NULL, 0, NULL,
@@ -938,217 +7809,271 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
         GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
                        "[word2vec_distance] couldn't create temp table");
         grn_obj_unlink(ctx, table);
-        return NULL;
+        return;
       }
     }
-  } else if (!pca || pca && N >= INSERTION_SORT_THRESHOLD) {
+  } else if (!pca) {
     res = grn_table_create(ctx, NULL, 0, NULL,
                            GRN_TABLE_HASH_KEY|GRN_OBJ_WITH_SUBREC,
                            grn_ctx_at(ctx, GRN_DB_SHORT_TEXT), grn_ctx_at(ctx, GRN_DB_FLOAT));
     if (!res) {
       GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
                      "[word2vec_distance] couldn't create temp table");
-      return NULL;
+      return;
     }
   }
 
-  vec = (float *)GRN_PLUGIN_MALLOC(ctx, dim_size[model_idx] * sizeof(float));
+  vec = (float *)GRN_PLUGIN_MALLOC(ctx, model->dim_size * sizeof(float));
 
+  for (a = 0; a < model->dim_size; a++) vec[a] = 0;
   if (input_n_words == 1) {
-    for (a = 0; a < dim_size[model_idx]; a++) vec[a] = 0;
-    for (a = 0; a < dim_size[model_idx]; a++) vec[a] += M[model_idx][a + found_row_idx[b] * dim_size[model_idx]];
+    add_model_row(model, 1, found_row_idx[b], vec);
   } else {
-    for (a = 0; a < dim_size[model_idx]; a++) vec[a] = 0;
-    for (a = 0; a < dim_size[model_idx]; a++) {
-      for (b = 0; b < input_n_words; b++) {
-        if (op[b] == '-') {
-          vec[a] -= M[model_idx][a + found_row_idx[b] * dim_size[model_idx]];
-        } else {
-          vec[a] += M[model_idx][a + found_row_idx[b] * dim_size[model_idx]];
-        }
-      }
+    for (b = 0; b < input_n_words; b++) {
+      add_model_row(model, op[b] == '-' ? -1 : 1, found_row_idx[b], vec);
     }
   }
-
-  len = 0;
-  for (a = 0; a < dim_size[model_idx]; a++) len += vec[a] * vec[a];
-  len = sqrt(len);
-  for (a = 0; a < dim_size[model_idx]; a++) vec[a] /= len;
-
-  bestw = (char **)GRN_PLUGIN_MALLOC(ctx, N * sizeof(char *));
-  for (a = 0; a < N; a++) {
-    bestw[a] = (char *)GRN_PLUGIN_MALLOC(ctx, max_length_of_vocab_word * sizeof(char));
-  }
-  bestd = (float *)GRN_PLUGIN_MALLOC(ctx, N * sizeof(float));
-  besti = (long long *)GRN_PLUGIN_MALLOC(ctx, N * sizeof(long long));
-  for (a = 0; a < N; a++) {
-    bestd[a] = -1;
-    besti[a] = 0;
-    bestw[a][0] = 0;
+  normalize_row(vec, model->dim_size);
+
+  if (model->precision == MODEL_PRECISION_INT8) {
+    query_int8 = (int8_t *)GRN_PLUGIN_MALLOC(ctx, model->dim_size);
+    query_scale = quantize_row(vec, model->dim_size, query_int8);
+  } else if (model->precision == MODEL_PRECISION_PQ) {
+    pq_table = (float *)GRN_PLUGIN_MALLOC(ctx, model->pq_subspaces * PQ_N_CENTROIDS *
+                                               sizeof(float));
+    build_pq_table(model, vec, pq_table);
   }
+  query.vec = vec;
+  query.query_int8 = query_int8;
+  query.query_scale = query_scale;
+  query.pq_table = pq_table;
 
-  if (is_sentence_vectors) {
-    pc = grn_pat_cursor_open(ctx, vocab[model_idx], DOC_ID_PREFIX, DOC_ID_PREFIX_LEN, NULL, 0, 0, -1, GRN_CURSOR_PREFIX);
-  } else if (prefix_filter != NULL) {
-    pc = grn_pat_cursor_open(ctx, vocab[model_idx], prefix_filter, strlen(prefix_filter), NULL, 0, 0, -1, GRN_CURSOR_PREFIX);
-  } else {
-    pc = grn_pat_cursor_open(ctx, vocab[model_idx], NULL, 0, NULL, 0, 0, -1, GRN_CURSOR_BY_ID);
+  /* no more than N rows can be returned */
+  if (!top_k_init(ctx, &top, N < model->n_candidates ? N : model->n_candidates)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[word2vec_distance] couldn't allocate scan buffers");
   }
-  if (pc) {
-    long long word_idx;
-    while ((word_idx = grn_pat_cursor_next(ctx, pc)) != GRN_ID_NIL) {
-      char key_name[GRN_TABLE_MAX_KEY_SIZE];
-      int key_len;
-      /* convert grn_id to idx of array */
-      word_idx--;
-      a = 0;
-      /* skip same word */
-      for (b = 0; b < input_n_words; b++) if (found_row_idx[b] == word_idx) a = 1;
-      if (a == 1) continue;
-
-      /* get word */
-      key_len = grn_pat_get_key(ctx, vocab[model_idx], word_idx + 1, key_name, GRN_TABLE_MAX_KEY_SIZE);
-      key_name[key_len] = '\0';
-
-      /* filter by regexp */
-      if (stop_filter != NULL) {
-        string s = key_name;
-        string t = stop_filter;
-        if ( RE2::FullMatch(s, t) ) {
-          continue;
-        }
-      }
 
-      /* calc distance */
-      dist = 0;
-      for (a = 0; a < dim_size[model_idx]; a++) dist += vec[a] * M[model_idx][a + word_idx * dim_size[model_idx]];
-
-      /* skip if distance is under threshold */
-      if (threshold > 0 && dist < threshold) {
-        continue;
+  if (model->n_numa_rows > 0) {
+    local_model = *model;
+    set_scan_rows(&local_model, get_local_numa_rows(model->numa_rows, model->n_numa_rows));
+    scan_model = &local_model;
+  }
+  /*
+    Rows are scanned in row order. The prefix_filter and sentence_vectors
+    cursors are turned into a sorted list of rows first.
+  */
+  if (top.results != NULL) {
+    long long *rows = NULL;
+    long long n_rows = model->n_candidates;
+    int n_threads;
+    RE2 *stop_filter_re = NULL;
+
+    if (is_sentence_vectors || prefix_filter != NULL) {
+      n_rows = 0;
+      if (is_sentence_vectors) {
+        pc = grn_pat_cursor_open(ctx, model->vocab, DOC_ID_PREFIX, DOC_ID_PREFIX_LEN, NULL, 0, 0, -1, GRN_CURSOR_PREFIX);
+      } else {
+        pc = grn_pat_cursor_open(ctx, model->vocab, prefix_filter, strlen(prefix_filter), NULL, 0, 0, -1, GRN_CURSOR_PREFIX);
       }
-
-      /* Insertion sort to bestw[N] */
-      if (N < INSERTION_SORT_THRESHOLD) {
-        for (a = 0; a < N; a++) {
-          if (dist > bestd[a]) {
-            for (long long d = N - 1; d > a; d--) {
-              bestd[d] = bestd[d - 1];
-              besti[d] = besti[d - 1];
-              strcpy(bestw[d], bestw[d - 1]);
-            }
-            bestd[a] = dist;
-            besti[a] = word_idx;
-            strcpy(bestw[a], key_name);
-            break;
+      if (pc) {
+        long long word_idx, rows_size = 0;
+        while ((word_idx = grn_pat_cursor_next(ctx, pc)) != GRN_ID_NIL) {
+          /* convert grn_id to idx of array */
+          word_idx--;
+          if (word_idx >= model->n_candidates) {
+            continue;
           }
-        }
-      } else {
-        if (key_len > 0) {
-          if (is_sentence_vectors && table_len) {
-            char *doc_id_p;
-            grn_id doc_id = 0;
-            doc_id_p = key_name;
-            doc_id_p += DOC_ID_PREFIX_LEN;
-            doc_id = atoi(doc_id_p);
-            if (doc_id) {
-              add_record_value(ctx, res, &doc_id, sizeof(grn_id), dist);
+          if (n_rows == rows_size) {
+            long long *new_rows;
+            rows_size = rows_size ? rows_size * 2 : 1024;
+            new_rows = (long long *)GRN_PLUGIN_REALLOC(ctx, rows, rows_size * sizeof(long long));
+            if (new_rows == NULL) {
+              GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                             "[word2vec_distance] couldn't allocate scan buffers");
+              n_rows = 0;
+              break;
             }
-          } else {
-            add_record_value(ctx, res, key_name, strlen(key_name), dist);
+            rows = new_rows;
           }
+          rows[n_rows++] = word_idx;
         }
+        grn_pat_cursor_close(ctx, pc);
+      }
+      if (n_rows > 0) {
+        std::sort(rows, rows + n_rows);
       }
     }
-    grn_pat_cursor_close(ctx, pc);
-  }
+    if (stop_filter != NULL) {
+      stop_filter_re = new RE2(stop_filter);
+    }
 
-  if (N < INSERTION_SORT_THRESHOLD) {
-    for (a = 0; a < N; a++) {
-      if (strlen(bestw[a]) > 0) {
-        if (output_filter != NULL || is_phrase) {
-          string s = bestw[a];
-          if (is_phrase) {
-            re2::RE2::GlobalReplace(&s, "_", " ");
-          }
-          if (output_filter != NULL) {
-            re2::RE2::GlobalReplace(&s, output_filter, "");
-          }
-          strcpy(bestw[a], s.c_str());
+    if (mode == SEARCH_MODE_HNSW && model->hnsw == NULL) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                     "[word2vec_distance] "
+                     "Model has no HNSW index, searching exactly");
+      mode = SEARCH_MODE_EXACT;
+    }
+    if (mode == SEARCH_MODE_IVF && model->ivf == NULL) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                     "[word2vec_distance] "
+                     "Model has no IVF index, searching exactly");
+      mode = SEARCH_MODE_EXACT;
+    }
+    if (mode == SEARCH_MODE_LSH && model->lsh == NULL) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                     "[word2vec_distance] "
+                     "Model has no LSH index, searching exactly");
+      mode = SEARCH_MODE_EXACT;
+    }
+    /*
+      LSH candidates are scanned like filtered rows. Filtered rows are
+      narrowed to the candidates unless they are fewer.
+    */
+    if (mode == SEARCH_MODE_LSH) {
+      std::vector<long long> candidates;
+      lsh_collect_rows(model->lsh, query.vec,
+                       lsh_probe < 0 ? 0 : lsh_probe > LSH_MAX_PROBE ? LSH_MAX_PROBE : lsh_probe,
+                       candidates);
+      if (rows == NULL && !(is_sentence_vectors || prefix_filter != NULL)) {
+        rows = (long long *)GRN_PLUGIN_MALLOC(ctx, (candidates.size() + 1) * sizeof(long long));
+        if (rows) {
+          std::copy(candidates.begin(), candidates.end(), rows);
+          n_rows = candidates.size();
+        } else {
+          GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                         "[word2vec_distance] couldn't allocate scan buffers");
         }
-
-        total_count++;
-        if (is_sentence_vectors && table_len) {
-          char *doc_id_p;
-          grn_id doc_id = 0;
-          doc_id_p = bestw[a];
-          doc_id_p += DOC_ID_PREFIX_LEN;
-          doc_id = atoi(doc_id_p);
-          if (doc_id) {
-            add_record_value(ctx, res, &doc_id, sizeof(grn_id), bestd[a]);
+      } else if ((long long)candidates.size() < n_rows) {
+        long long p, n = 0;
+        size_t c = 0;
+        for (p = 0; p < n_rows; p++) {
+          for (; c < candidates.size() && candidates[c] < rows[p]; c++) ;
+          if (c < candidates.size() && candidates[c] == rows[p]) {
+            rows[n++] = rows[p];
           }
-        } else if (!pca) {
-          add_record_value(ctx, res, bestw[a], strlen(bestw[a]), bestd[a]);
         }
+        n_rows = n;
       }
+      mode = SEARCH_MODE_EXACT;
     }
-  } else {
-    grn_obj *sorted;
-    if ((sorted = grn_table_create(ctx, NULL, 0, NULL, GRN_OBJ_TABLE_NO_KEY, NULL, res))) {
-      uint32_t nkeys;
-      grn_table_sort_key *keys;
-      grn_table_cursor *cur;
-      grn_id id;
-      if ((keys = grn_table_sort_key_from_str(ctx, "-_value", strlen("-_value"), res, &nkeys))) {
-        grn_table_sort(ctx, res, 0, -1, sorted, keys, nkeys);
-        grn_table_sort_key_close(ctx, keys, nkeys);
-        if (cur = grn_table_cursor_open(ctx, sorted, NULL, 0, NULL, 0, 0, N,
-                                        GRN_CURSOR_BY_ID)) {
-          grn_obj buf;
-          grn_obj value_buf;
-          GRN_TEXT_INIT(&buf, 0);
-          GRN_FLOAT_INIT(&value_buf, 0);
-          grn_obj *key = grn_obj_column(ctx, sorted,
-                                           GRN_COLUMN_NAME_KEY,
-                                           GRN_COLUMN_NAME_KEY_LEN);
-          grn_obj *value = grn_obj_column(ctx, sorted,
-                                           GRN_COLUMN_NAME_VALUE,
-                                           GRN_COLUMN_NAME_VALUE_LEN);
-
-          total_count = 0;
-          while ((id = grn_table_cursor_next(ctx, cur)) != GRN_ID_NIL) {
-            GRN_BULK_REWIND(&buf);
-            GRN_BULK_REWIND(&value_buf);
-            grn_obj_get_value(ctx, key, id, &buf);
-
-            memcpy(bestw[total_count], GRN_TEXT_VALUE(&buf), GRN_TEXT_LEN(&buf));
-            bestw[total_count][GRN_TEXT_LEN(&buf)] = '\0';
-            if (output_filter != NULL || is_phrase) {
-              string s = bestw[total_count];
-              if (is_phrase) {
-                re2::RE2::GlobalReplace(&s, "_", " ");
-              }
-              if (output_filter != NULL) {
-                re2::RE2::GlobalReplace(&s, output_filter, "");
-              }
-              strcpy(bestw[total_count], s.c_str());
-            }
-            grn_obj_get_value(ctx, value, id, &value_buf);
-            bestd[total_count] = GRN_FLOAT_VALUE(&value_buf);
-            id = grn_table_get(ctx, res, GRN_TEXT_VALUE(&buf), GRN_TEXT_LEN(&buf));
-            besti[total_count] = id - 1;
-            total_count++;
+    if (ef < top.size) {
+      ef = top.size;
+    }
+    /*
+      A graph search scores about ef * HNSW_M0 rows and an IVF search the
+      rows of nprobe lists; fewer filtered rows are simply scanned.
+    */
+    if (mode != SEARCH_MODE_EXACT && (is_sentence_vectors || prefix_filter != NULL)) {
+      long long n_searched = mode == SEARCH_MODE_HNSW ? (long long)ef * HNSW_M0 :
+        (long long)nprobe * (model->ivf->n_rows / model->ivf->n_lists + 1);
+      if (n_rows <= n_searched) {
+        mode = SEARCH_MODE_EXACT;
+      }
+    }
+    if (mode != SEARCH_MODE_EXACT) {
+      uint8_t *row_filter = NULL;
+      scan_arg scan;
+
+      if (rows) {
+        row_filter = (uint8_t *)GRN_PLUGIN_MALLOC(ctx, (model->n_candidates + 7) / 8);
+        if (row_filter) {
+          memset(row_filter, 0, (model->n_candidates + 7) / 8);
+          for (a = 0; a < n_rows; a++) {
+            row_filter[rows[a] >> 3] |= 1 << (rows[a] & 7);
           }
-          grn_obj_unlink(ctx, key);
-          grn_obj_unlink(ctx, value);
-          grn_obj_unlink(ctx, &value_buf);
-          grn_obj_unlink(ctx, &buf);
-          grn_table_cursor_close(ctx, cur);
         }
       }
-      grn_obj_unlink(ctx, sorted);
+      scan.ctx = ctx;
+      scan.model = scan_model;
+      scan.query = &query;
+      scan.rows = NULL;
+      scan.start = 0;
+      scan.end = 0;
+      scan.skip_rows = found_row_idx;
+      scan.n_skip_rows = input_n_words;
+      scan.row_ids = NULL;
+      scan.threshold = threshold;
+      scan.row_filter = row_filter;
+      scan.stop_filter = stop_filter_re;
+      scan.top = &top;
+      if ((rows && !row_filter) ||
+          !(mode == SEARCH_MODE_HNSW ?
+            hnsw_search_rows(ctx, scan_model, &query, ef, &scan) :
+            ivf_search_rows(ctx, scan_model, &query, nprobe, &scan))) {
+        GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                       "[word2vec_distance] couldn't allocate scan buffers");
+      }
+      if (row_filter) {
+        GRN_PLUGIN_FREE(ctx, row_filter);
+      }
     } else {
-      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR, "[word2vec] cannot create temporary sort table.");
+      n_threads = n_rows / get_scan_rows_per_thread();
+      if (n_threads > scan_threads) {
+        n_threads = scan_threads;
+      }
+      scan_rows(ctx, scan_model, &query, rows, n_rows, n_threads,
+                found_row_idx, input_n_words, threshold, stop_filter_re, &top);
+    }
+
+    if (stop_filter_re) {
+      delete stop_filter_re;
+    }
+    if (rows) {
+      GRN_PLUGIN_FREE(ctx, rows);
+    }
+  }
+
+  /* keys are looked up only for the winners */
+  top_k_sort(&top);
+  n_found = top.n;
+  bestw = (char **)GRN_PLUGIN_MALLOC(ctx, (n_found + 1) * sizeof(char *));
+  bestd = (float *)GRN_PLUGIN_MALLOC(ctx, (n_found + 1) * sizeof(float));
+  besti = (long long *)GRN_PLUGIN_MALLOC(ctx, (n_found + 1) * sizeof(long long));
+  for (a = 0; a < n_found; a++) {
+    char key_name[GRN_TABLE_MAX_KEY_SIZE];
+    int key_len;
+    key_len = grn_pat_get_key(ctx, model->vocab, top.results[a].row + 1, key_name,
+                              GRN_TABLE_MAX_KEY_SIZE);
+    bestw[a] = (char *)GRN_PLUGIN_MALLOC(ctx, key_len + 1);
+    memcpy(bestw[a], key_name, key_len);
+    bestw[a][key_len] = '\0';
+    bestd[a] = top.results[a].dist;
+    besti[a] = top.results[a].row;
+  }
+  top_k_fin(ctx, &top);
+
+  if (rerank && model->rerank_matrix) {
+    rerank_candidates(ctx, model, found_row_idx, op, input_n_words, threshold,
+                      bestw, bestd, besti, n_found);
+  }
+
+  for (a = 0; a < n_found; a++) {
+    if (strlen(bestw[a]) > 0) {
+      if (output_filter != NULL || is_phrase) {
+        string s = bestw[a];
+        if (is_phrase) {
+          re2::RE2::GlobalReplace(&s, "_", " ");
+        }
+        if (output_filter != NULL) {
+          re2::RE2::GlobalReplace(&s, output_filter, "");
+        }
+        strcpy(bestw[a], s.c_str());
+      }
+
+      total_count++;
+      if (is_sentence_vectors && table_len) {
+        char *doc_id_p;
+        grn_id doc_id = 0;
+        doc_id_p = bestw[a];
+        doc_id_p += DOC_ID_PREFIX_LEN;
+        doc_id = atoi(doc_id_p);
+        if (doc_id) {
+          add_record_value(ctx, res, &doc_id, sizeof(grn_id), bestd[a]);
+        }
+      } else if (!pca) {
+        add_record_value(ctx, res, bestw[a], strlen(bestw[a]), bestd[a]);
+      }
     }
   }
 
@@ -1164,14 +8089,14 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
     grn_obj_unlink(ctx, &buf);
   } else if (pca) {
     /* Map to matrix of Eigen */
-    MatrixXf X(total_count + 1, dim_size[model_idx]);
-    for (b = 0; b < dim_size[model_idx]; b++) {
-      X(0, b) = M[model_idx][b + found_row_idx[0] * dim_size[model_idx]];
+    MatrixXf X(total_count + 1, model->dim_size);
+    for (b = 0; b < model->dim_size; b++) {
+      X(0, b) = model_value(model, found_row_idx[0], b);
     }
     for (a = 0; a < total_count; a++) {
       if (strlen(bestw[a]) > 0) {
-        for (b = 0; b < dim_size[model_idx]; b++) {
-          X(a+1, b) = M[model_idx][b + besti[a] * dim_size[model_idx]];
+        for (b = 0; b < model->dim_size; b++) {
+          X(a+1, b) = model_value(model, besti[a], b);
         }
       }
     }
@@ -1231,8 +8156,8 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
     /* neighbor terms */
     {
       unsigned int max;
-      if (offset + limit > N) {
-        max = N;
+      if (offset + limit > n_found) {
+        max = n_found;
       } else {
         max = offset + limit;
       }
@@ -1260,7 +8185,7 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
     }
   }
 
-  for (a = 0; a < N; a++) {
+  for (a = 0; a < n_found; a++) {
     GRN_PLUGIN_FREE(ctx, bestw[a]);
     bestw[a] = NULL;
   }
@@ -1273,6 +8198,14 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
 
   GRN_PLUGIN_FREE(ctx, vec);
   vec = NULL;
+  if (query_int8) {
+    GRN_PLUGIN_FREE(ctx, query_int8);
+    query_int8 = NULL;
+  }
+  if (pq_table) {
+    GRN_PLUGIN_FREE(ctx, pq_table);
+    pq_table = NULL;
+  }
 
   if (res) {
     grn_obj_close(ctx, res);
@@ -1283,6 +8216,316 @@ command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_o
     table = NULL;
   }
 
+}
+
+/*
+  Acquire the model of file_name for a query command: wait up to
+  load_timeout msec for a background load, and load it with load_opt if it
+  is not loaded. NULL on failure.
+*/
+static word2vec_model *
+acquire_loaded_model(grn_ctx *ctx, const char *command_name, const char *file_name,
+                     load_option load_opt, int load_timeout)
+{
+  int model_idx;
+  word2vec_model *model;
+
+  model_idx = get_model_idx(ctx, file_name, GRN_TRUE);
+  if (model_idx == -1) {
+    return NULL;
+  }
+  model = acquire_model(model_idx);
+  if (model == NULL && wait_background_load(model_idx, load_timeout)) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                   "[%s] "
+                   "Model is still loading : %s",
+                   command_name, file_name);
+    return NULL;
+  }
+  if (model == NULL) {
+    model = acquire_model(model_idx);
+  }
+  if (model == NULL) {
+    if (word2vec_load(ctx, file_name, model_idx, load_opt) == GRN_FALSE) {
+      return NULL;
+    }
+    model = acquire_model(model_idx);
+  }
+  return model;
+}
+
+static grn_obj *
+command_word2vec_distance(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
+                          grn_user_data *user_data)
+{
+  char file_name[max_size];
+  word2vec_model *model;
+  load_option load_opt;
+  int load_timeout = -1;
+  const char *env;
+  grn_obj *var;
+
+  var = grn_plugin_proc_get_var(ctx, user_data, "file_path", -1);
+  if (GRN_TEXT_LEN(var) == 0) {
+    get_load_model_file_path(ctx, file_name);
+  } else {
+    strcpy(file_name, GRN_TEXT_VALUE(var));
+    file_name[GRN_TEXT_LEN(var)] = '\0';
+  }
+  init_load_option(&load_opt);
+  var = grn_plugin_proc_get_var(ctx, user_data, "binary", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    load_opt.binary = atoi(GRN_TEXT_VALUE(var));
+  }
+  env = getenv("GRN_WORD2VEC_LOAD_TIMEOUT");
+  if (env) {
+    load_timeout = atoi(env);
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "load_timeout", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    load_timeout = atoi(GRN_TEXT_VALUE(var));
+  }
+
+  model = acquire_loaded_model(ctx, "word2vec_distance", file_name, load_opt, load_timeout);
+  if (model == NULL) {
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+
+  word2vec_distance(ctx, user_data, model);
+  release_model(ctx, model);
+  return NULL;
+}
+
+#define WARMUP_CHUNK_SIZE (64 * 1024 * 1024)
+
+typedef struct {
+  const volatile char *data;
+  size_t start;
+  size_t end;
+  size_t page_size;
+  char sum;
+} warmup_arg;
+
+/* read one byte per page so that the page is faulted in */
+static void *
+touch_pages(void *arg)
+{
+  warmup_arg *warmup = (warmup_arg *)arg;
+  size_t offset;
+  char sum = 0;
+
+  for (offset = warmup->start; offset < warmup->end; offset += warmup->page_size) {
+    sum += warmup->data[offset];
+  }
+  warmup->sum = sum;
+  return NULL;
+}
+
+/* fault in data[0..size) with n_threads threads */
+static void
+touch_range(const char *data, size_t size, int n_threads, size_t page_size)
+{
+  pthread_t threads[MAX_LOAD_THREADS];
+  warmup_arg args[MAX_LOAD_THREADS];
+  grn_bool started[MAX_LOAD_THREADS];
+  size_t n_pages, pages_per_thread;
+  int t;
+
+  n_pages = (size + page_size - 1) / page_size;
+  if ((size_t)n_threads > n_pages) {
+    n_threads = n_pages > 0 ? (int)n_pages : 1;
+  }
+  pages_per_thread = (n_pages + n_threads - 1) / n_threads;
+  for (t = 0; t < n_threads; t++) {
+    args[t].data = data;
+    args[t].start = t * pages_per_thread * page_size;
+    args[t].end = (t + 1) * pages_per_thread * page_size;
+    if (args[t].end > size) {
+      args[t].end = size;
+    }
+    args[t].page_size = page_size;
+    started[t] = (n_threads > 1 &&
+                  pthread_create(&threads[t], NULL, touch_pages, &args[t]) == 0);
+  }
+  for (t = 0; t < n_threads; t++) {
+    if (started[t]) {
+      pthread_join(threads[t], NULL);
+    } else {
+      touch_pages(&args[t]);
+    }
+  }
+}
+
+/* hint the kernel to read data[0..size) ahead */
+static void
+advise_range(const char *data, size_t size, size_t page_size)
+{
+  uintptr_t start = (uintptr_t)data & ~(uintptr_t)(page_size - 1);
+  madvise((void *)start, (uintptr_t)data + size - start, MADV_WILLNEED);
+}
+
+/*
+  Fault in the first n_rows scanned rows, in row order so that the most
+  frequent words of a trainer-ordered model are resident first, then the
+  vocab. Returns the number of bytes of rows.
+*/
+static size_t
+warm_up_model(grn_ctx *ctx, const char *file_name, word2vec_model *model,
+              long long n_rows, int n_threads, grn_bool willneed)
+{
+  size_t size, row_size, offset, chunk_size, page_size;
+  const char *rows;
+  int progress = 0;
+
+  page_size = sysconf(_SC_PAGESIZE);
+  rows = (const char *)get_scan_rows(model, &size);
+  if (rows == NULL || model->n_candidates == 0) {
+    return 0;
+  }
+  row_size = size / model->n_candidates;
+  if (n_rows > 0 && n_rows < model->n_candidates) {
+    size = n_rows * row_size;
+  } else {
+    n_rows = model->n_candidates;
+  }
+  if (n_threads < 1) {
+    n_threads = 1;
+  }
+  if (n_threads > MAX_LOAD_THREADS) {
+    n_threads = MAX_LOAD_THREADS;
+  }
+
+  if (model->precision == MODEL_PRECISION_INT8) {
+    touch_range((const char *)model->row_scale, n_rows * sizeof(float), 1, page_size);
+  } else if (model->precision == MODEL_PRECISION_PQ) {
+    touch_range((const char *)model->pq_codebook,
+                PQ_N_CENTROIDS * model->dim_size * sizeof(float), 1, page_size);
+  }
+  for (offset = 0; offset < size; offset += chunk_size) {
+    chunk_size = size - offset;
+    if (chunk_size > WARMUP_CHUNK_SIZE) {
+      chunk_size = WARMUP_CHUNK_SIZE;
+    }
+    if (willneed) {
+      advise_range(rows + offset, chunk_size, page_size);
+    } else {
+      touch_range(rows + offset, chunk_size, n_threads, page_size);
+    }
+    if ((offset + chunk_size) * 10 / size > (size_t)progress) {
+      progress = (offset + chunk_size) * 10 / size;
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_INFO,
+                     "[word2vec_warmup] %s : %lld/%lld rows",
+                     file_name, (long long)((offset + chunk_size) / row_size), n_rows);
+    }
+  }
+
+  if (model->vocab != NULL) {
+    grn_pat_cursor *pc;
+    grn_id id;
+    char key[GRN_TABLE_MAX_KEY_SIZE];
+
+    pc = grn_pat_cursor_open(ctx, model->vocab, NULL, 0, NULL, 0, 0, -1, GRN_CURSOR_BY_ID);
+    if (pc) {
+      while ((id = grn_pat_cursor_next(ctx, pc)) != GRN_ID_NIL) {
+        grn_pat_get_key(ctx, model->vocab, id, key, GRN_TABLE_MAX_KEY_SIZE);
+      }
+      grn_pat_cursor_close(ctx, pc);
+    }
+  }
+  return size;
+}
+
+static grn_obj *
+command_word2vec_warmup(grn_ctx *ctx, GNUC_UNUSED int nargs, GNUC_UNUSED grn_obj **args,
+                        grn_user_data *user_data)
+{
+  char file_name[max_size];
+  word2vec_model *model;
+  load_option load_opt;
+  int load_timeout = -1;
+  int n_threads = get_default_n_threads();
+  long long n_rows = 0;
+  grn_bool willneed = GRN_FALSE;
+  struct timespec start, end;
+  double elapsed;
+  size_t size;
+  const char *env;
+  grn_obj *var;
+
+  var = grn_plugin_proc_get_var(ctx, user_data, "file_path", -1);
+  if (GRN_TEXT_LEN(var) == 0) {
+    get_load_model_file_path(ctx, file_name);
+  } else {
+    strcpy(file_name, GRN_TEXT_VALUE(var));
+    file_name[GRN_TEXT_LEN(var)] = '\0';
+  }
+  init_load_option(&load_opt);
+  var = grn_plugin_proc_get_var(ctx, user_data, "binary", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    load_opt.binary = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "threads", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    n_threads = atoi(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "max_words", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    n_rows = atoll(GRN_TEXT_VALUE(var));
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "method", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    if (GRN_TEXT_LEN(var) == 8 && memcmp(GRN_TEXT_VALUE(var), "willneed", 8) == 0) {
+      willneed = GRN_TRUE;
+    } else if (!(GRN_TEXT_LEN(var) == 5 && memcmp(GRN_TEXT_VALUE(var), "touch", 5) == 0)) {
+      GRN_PLUGIN_LOG(ctx, GRN_LOG_ERROR,
+                     "[word2vec_warmup] "
+                     "Unknown method : %.*s",
+                     (int)GRN_TEXT_LEN(var), GRN_TEXT_VALUE(var));
+      grn_ctx_output_bool(ctx, GRN_FALSE);
+      return NULL;
+    }
+  }
+  env = getenv("GRN_WORD2VEC_LOAD_TIMEOUT");
+  if (env) {
+    load_timeout = atoi(env);
+  }
+  var = grn_plugin_proc_get_var(ctx, user_data, "load_timeout", -1);
+  if (GRN_TEXT_LEN(var) != 0) {
+    load_timeout = atoi(GRN_TEXT_VALUE(var));
+  }
+
+  model = acquire_loaded_model(ctx, "word2vec_warmup", file_name, load_opt, load_timeout);
+  if (model == NULL) {
+    grn_ctx_output_bool(ctx, GRN_FALSE);
+    return NULL;
+  }
+
+  if (n_rows > 0 && n_rows < model->n_candidates && model->key_order) {
+    GRN_PLUGIN_LOG(ctx, GRN_LOG_WARNING,
+                   "[word2vec_warmup] "
+                   "the first rows of a model ordered by key are not the most frequent words : %s",
+                   file_name);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  size = warm_up_model(ctx, file_name, model, n_rows, n_threads, willneed);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  if (n_rows <= 0 || n_rows > model->n_candidates) {
+    n_rows = model->n_candidates;
+  }
+  GRN_PLUGIN_LOG(ctx, GRN_LOG_INFO,
+                 "[word2vec_warmup] %s : %lld rows (%lld bytes) in %.3f sec",
+                 file_name, n_rows, (long long)size, elapsed);
+
+  /* the elapsed time is only logged; the response header already has it */
+  grn_ctx_output_map_open(ctx, "WARMUP", 2);
+  grn_ctx_output_cstr(ctx, "n_rows");
+  grn_ctx_output_int64(ctx, n_rows);
+  grn_ctx_output_cstr(ctx, "size");
+  grn_ctx_output_int64(ctx, (long long)size);
+  grn_ctx_output_map_close(ctx);
+  release_model(ctx, model);
   return NULL;
 }
 
@@ -1891,19 +9134,58 @@ func_query_expander_word2vec(grn_ctx *ctx, int nargs, grn_obj **args,
 grn_rc
 GRN_PLUGIN_INIT(GNUC_UNUSED grn_ctx *ctx)
 {
+  const char *env;
+
   mecab_init(ctx);
+  init_simd_kernels(ctx);
+  env = getenv("GRN_WORD2VEC_PRELOAD");
+  if (env) {
+    preload_models(ctx, env);
+  }
   return GRN_SUCCESS;
 }
 
 grn_rc
 GRN_PLUGIN_REGISTER(grn_ctx *ctx)
 {
-  grn_expr_var vars[21];
+  grn_expr_var vars[28];
 
   grn_plugin_expr_var_init(ctx, &vars[0], "file_path", -1);
   grn_plugin_expr_var_init(ctx, &vars[1], "binary", -1);
-  grn_plugin_command_create(ctx, "word2vec_load", -1, command_word2vec_load, 2, vars);
-  grn_plugin_command_create(ctx, "word2vec_unload", -1, command_word2vec_unload, 0, vars);
+  grn_plugin_expr_var_init(ctx, &vars[2], "threads", -1);
+  grn_plugin_expr_var_init(ctx, &vars[3], "shared", -1);
+  grn_plugin_expr_var_init(ctx, &vars[4], "precision", -1);
+  grn_plugin_expr_var_init(ctx, &vars[5], "pq_subspaces", -1);
+  grn_plugin_expr_var_init(ctx, &vars[6], "async", -1);
+  grn_plugin_expr_var_init(ctx, &vars[7], "max_words", -1);
+  grn_plugin_expr_var_init(ctx, &vars[8], "query_only_tail", -1);
+  grn_plugin_expr_var_init(ctx, &vars[9], "numa", -1);
+  grn_plugin_expr_var_init(ctx, &vars[10], "pages", -1);
+  grn_plugin_expr_var_init(ctx, &vars[11], "lock", -1);
+  grn_plugin_expr_var_init(ctx, &vars[12], "index", -1);
+  grn_plugin_expr_var_init(ctx, &vars[13], "ivf_lists", -1);
+  grn_plugin_expr_var_init(ctx, &vars[14], "lsh_tables", -1);
+  grn_plugin_command_create(ctx, "word2vec_load", -1, command_word2vec_load, 15, vars);
+  grn_plugin_command_create(ctx, "word2vec_unload", -1, command_word2vec_unload, 1, vars);
+  grn_plugin_command_create(ctx, "word2vec_status", -1, command_word2vec_status, 0, NULL);
+
+  grn_plugin_expr_var_init(ctx, &vars[0], "delta_file", -1);
+  grn_plugin_expr_var_init(ctx, &vars[1], "file_path", -1);
+  grn_plugin_expr_var_init(ctx, &vars[2], "binary", -1);
+  grn_plugin_expr_var_init(ctx, &vars[3], "threads", -1);
+  grn_plugin_command_create(ctx, "word2vec_apply_delta", -1, command_word2vec_apply_delta, 4, vars);
+
+  grn_plugin_expr_var_init(ctx, &vars[0], "file_path", -1);
+  grn_plugin_expr_var_init(ctx, &vars[1], "output_file", -1);
+  grn_plugin_expr_var_init(ctx, &vars[2], "binary", -1);
+  grn_plugin_expr_var_init(ctx, &vars[3], "threads", -1);
+  grn_plugin_expr_var_init(ctx, &vars[4], "precision", -1);
+  grn_plugin_expr_var_init(ctx, &vars[5], "pq_subspaces", -1);
+  grn_plugin_expr_var_init(ctx, &vars[6], "output_format", -1);
+  grn_plugin_expr_var_init(ctx, &vars[7], "reorder", -1);
+  grn_plugin_expr_var_init(ctx, &vars[8], "index", -1);
+  grn_plugin_expr_var_init(ctx, &vars[9], "ivf_lists", -1);
+  grn_plugin_command_create(ctx, "word2vec_convert", -1, command_word2vec_convert, 10, vars);
 
   grn_plugin_expr_var_init(ctx, &vars[0], "term", -1);
   grn_plugin_expr_var_init(ctx, &vars[1], "offset", -1);
@@ -1926,7 +9208,22 @@ GRN_PLUGIN_REGISTER(grn_ctx *ctx)
   grn_plugin_expr_var_init(ctx, &vars[18], "table", -1);
   grn_plugin_expr_var_init(ctx, &vars[19], "column", -1);
   grn_plugin_expr_var_init(ctx, &vars[20], "sortby", -1);
-  grn_plugin_command_create(ctx, "word2vec_distance", -1, command_word2vec_distance, 21, vars);
+  grn_plugin_expr_var_init(ctx, &vars[21], "rerank", -1);
+  grn_plugin_expr_var_init(ctx, &vars[22], "load_timeout", -1);
+  grn_plugin_expr_var_init(ctx, &vars[23], "scan_threads", -1);
+  grn_plugin_expr_var_init(ctx, &vars[24], "search_mode", -1);
+  grn_plugin_expr_var_init(ctx, &vars[25], "ef", -1);
+  grn_plugin_expr_var_init(ctx, &vars[26], "nprobe", -1);
+  grn_plugin_expr_var_init(ctx, &vars[27], "lsh_probe", -1);
+  grn_plugin_command_create(ctx, "word2vec_distance", -1, command_word2vec_distance, 28, vars);
+
+  grn_plugin_expr_var_init(ctx, &vars[0], "file_path", -1);
+  grn_plugin_expr_var_init(ctx, &vars[1], "binary", -1);
+  grn_plugin_expr_var_init(ctx, &vars[2], "threads", -1);
+  grn_plugin_expr_var_init(ctx, &vars[3], "max_words", -1);
+  grn_plugin_expr_var_init(ctx, &vars[4], "method", -1);
+  grn_plugin_expr_var_init(ctx, &vars[5], "load_timeout", -1);
+  grn_plugin_command_create(ctx, "word2vec_warmup", -1, command_word2vec_warmup, 6, vars);
 
   grn_plugin_expr_var_init(ctx, &vars[0], "table", -1);
   grn_plugin_expr_var_init(ctx, &vars[1], "column", -1);
@@ -1970,9 +9267,19 @@ GRN_PLUGIN_REGISTER(grn_ctx *ctx)
 grn_rc
 GRN_PLUGIN_FIN(GNUC_UNUSED grn_ctx *ctx)
 {
-  for (int i = 0; i < MAX_MODEL; i++) {
+  pthread_mutex_lock(&models_mutex);
+  while (n_background_loads > 0) {
+    pthread_cond_wait(&models_cond, &models_mutex);
+  }
+  pthread_mutex_unlock(&models_mutex);
+  for (int i = 0; i < n_model_slots; i++) {
     word2vec_unload(ctx, i);
   }
+  if (models) {
+    GRN_PLUGIN_FREE(ctx, models);
+    models = NULL;
+    n_model_slots = 0;
+  }
   if (model_idxes) {
     grn_hash_close(ctx, model_idxes);
     model_idxes = NULL;